@@ -0,0 +1,61 @@
+/* Build-time tool: turns the kernel sources (and optionally an offline compiled SPIR-V
+   module) into a C header, so the host program does not need any file at run time.
+
+   usage: embed_kernels <output.h> <file> [<file> ...]
+
+   Every file is stored under its base name; the host looks files up by that name. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char* base_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    const char *backslash = strrchr(path, '\\');
+    if (backslash > slash) slash = backslash;
+    return slash ? slash + 1 : path;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        printf("usage: %s <output.h> <file> [<file> ...]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *out = fopen(argv[1], "w");
+    if (!out) {
+        perror("Couldn't create the output header");
+        return 1;
+    }
+    fprintf(out, "/* Generated by embed_kernels. Do not edit. */\n");
+    fprintf(out, "#ifndef KERNELS_EMBEDDED_H\n#define KERNELS_EMBEDDED_H\n\n");
+    fprintf(out, "typedef struct {\n    const char *name;\n    const unsigned char *data;\n    size_t size;\n} embedded_file;\n\n");
+
+    long *sizes = (long*)malloc((argc - 2) * sizeof(long));
+    for (int i = 2; i < argc; i++) {
+        FILE *fp = fopen(argv[i], "rb");
+        if (!fp) {
+            perror(argv[i]);
+            return 1;
+        }
+        fprintf(out, "static const unsigned char embedded_file_%d[] = {", i - 2);
+        long size = 0;
+        int c;
+        while ((c = fgetc(fp)) != EOF) {
+            if (size % 16 == 0) fprintf(out, "\n    ");
+            fprintf(out, "0x%02x,", c);
+            size++;
+        }
+        fprintf(out, "\n    0x00  // terminator, not counted in the size\n};\n\n");
+        fclose(fp);
+        sizes[i - 2] = size;
+    }
+
+    fprintf(out, "static const embedded_file EMBEDDED_FILES[] = {\n");
+    for (int i = 2; i < argc; i++)
+        fprintf(out, "    {\"%s\", embedded_file_%d, %ld},\n", base_name(argv[i]), i - 2, sizes[i - 2]);
+    fprintf(out, "};\n#define NUM_EMBEDDED_FILES %d\n\n#endif\n", argc - 2);
+
+    free(sizes);
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,69 @@
+#include "zncc_common.h"
+
+/* Weighted 5x5 median (--median), the edge-preserving alternative to the moving average.
+   A neighbour at (dx, dy) weighs 1 / (1 + |dx| + |dy|), as in Phase5, scaled by 60 to exact
+   integers; neighbours outside the image weigh 0. The result is the smallest value v whose
+   cumulative weight W(<= v) reaches half of the total.
+   The work-group stages its tile and halo in local memory. Instead of sorting the window, each
+   work-item bisects the cumulative weighted histogram between the window's minimum and maximum:
+   about log2(MAX_DISP) evaluations of 25 compares, with no per-work-item arrays. */
+
+#define MEDIAN_RADIUS 2
+#define MEDIAN_TILE_WIDTH (LOCAL_WIDTH + 2 * MEDIAN_RADIUS)
+#define MEDIAN_TILE_HEIGHT (LOCAL_HEIGHT + 2 * MEDIAN_RADIUS)
+
+// 60 / (1 + |dx| + |dy|)
+#define MEDIAN_WEIGHT(dx, dy) (60u / (1u + abs(dx) + abs(dy)))
+
+__kernel __attribute__((reqd_work_group_size(LOCAL_WIDTH, LOCAL_HEIGHT, 1)))
+void weighted_median(__global const uchar* input,
+                     __global uchar* output,
+                     int width,
+                     int height) {
+    __local uchar tile[MEDIAN_TILE_HEIGHT][MEDIAN_TILE_WIDTH];
+    const int lx = get_local_id(0);
+    const int ly = get_local_id(1);
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+
+    // Cooperative load of the tile and its halo, clamped at the image border
+    const int tile_x0 = x - lx - MEDIAN_RADIUS;
+    const int tile_y0 = y - ly - MEDIAN_RADIUS;
+    for (int i = ly * LOCAL_WIDTH + lx; i < MEDIAN_TILE_WIDTH * MEDIAN_TILE_HEIGHT; i += LOCAL_WIDTH * LOCAL_HEIGHT) {
+        int tx = i % MEDIAN_TILE_WIDTH;
+        int ty = i / MEDIAN_TILE_WIDTH;
+        int gx = clamp(tile_x0 + tx, 0, width - 1);
+        int gy = clamp(tile_y0 + ty, 0, height - 1);
+        tile[ty][tx] = input[gy * width + gx];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (x >= width || y >= height) return;
+
+    // Total weight and value range of the window
+    uint total = 0, lo = 255, hi = 0;
+    for (int dy = -MEDIAN_RADIUS; dy <= MEDIAN_RADIUS; dy++) {
+        for (int dx = -MEDIAN_RADIUS; dx <= MEDIAN_RADIUS; dx++) {
+            if (x + dx < 0 || x + dx >= width || y + dy < 0 || y + dy >= height) continue;
+            uint value = tile[ly + MEDIAN_RADIUS + dy][lx + MEDIAN_RADIUS + dx];
+            total += MEDIAN_WEIGHT(dx, dy);
+            lo = min(lo, value);
+            hi = max(hi, value);
+        }
+    }
+
+    // Smallest v in [lo, hi] with 2 * W(<= v) >= total
+    while (lo < hi) {
+        uint mid = (lo + hi) / 2;
+        uint below = 0;
+        for (int dy = -MEDIAN_RADIUS; dy <= MEDIAN_RADIUS; dy++) {
+            for (int dx = -MEDIAN_RADIUS; dx <= MEDIAN_RADIUS; dx++) {
+                if (x + dx < 0 || x + dx >= width || y + dy < 0 || y + dy >= height) continue;
+                if (tile[ly + MEDIAN_RADIUS + dy][lx + MEDIAN_RADIUS + dx] <= mid)
+                    below += MEDIAN_WEIGHT(dx, dy);
+            }
+        }
+        if (2 * below >= total) hi = mid;
+        else lo = mid + 1;
+    }
+    output[y * width + x] = (uchar)lo;
+}
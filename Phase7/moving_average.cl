@@ -1,3 +1,5 @@
+#include "zncc_common.h"
+
 __kernel void moving_average_5x5(__global const unsigned char* input,
                                  __global unsigned char* output,
                                  int width,
@@ -9,9 +11,9 @@ __kernel void moving_average_5x5(__global const unsigned char* input,
     int sum = 0;
     int count = 0;
     
-    // 5x5 neighborhood
-    for (int dy = -4; dy <= 4; dy++) {
-        for (int dx = -4; dx <= 4; dx++) {
+    // (2*FILTER_RADIUS+1)^2 neighborhood
+    for (int dy = -FILTER_RADIUS; dy <= FILTER_RADIUS; dy++) {
+        for (int dx = -FILTER_RADIUS; dx <= FILTER_RADIUS; dx++) {
             int nx = x + dx;
             int ny = y + dy;
             if (nx >= 0 && nx < width && ny >= 0 && ny < height) {
@@ -0,0 +1,52 @@
+#include "zncc_common.h"  // NORMALIZE_GROUP comes from the build options
+
+/* Min/max normalization of an 8-bit map to [0, 255] for visualization, on the device.
+   min_max_reduce folds the map into min_max[0] and min_max[1], which the host sets to 255
+   and 0 first. Each work-item strides through the map, each work-group reduces in local
+   memory, and one work-item per group applies atomic_min / atomic_max. normalize_map then
+   rescales every pixel with the same integer arithmetic as normalize_occlusion() on the host. */
+
+__kernel __attribute__((reqd_work_group_size(NORMALIZE_GROUP, 1, 1)))
+void min_max_reduce(__global const uchar* map, uint pixels, __global uint* min_max) {
+    __local uint local_min[NORMALIZE_GROUP];
+    __local uint local_max[NORMALIZE_GROUP];
+    const uint lid = get_local_id(0);
+
+    uint lo = 255, hi = 0;
+    for (uint i = get_global_id(0); i < pixels; i += get_global_size(0)) {
+        uint value = map[i];
+        lo = min(lo, value);
+        hi = max(hi, value);
+    }
+    local_min[lid] = lo;
+    local_max[lid] = hi;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint stride = NORMALIZE_GROUP / 2; stride > 0; stride /= 2) {
+        if (lid < stride) {
+            local_min[lid] = min(local_min[lid], local_min[lid + stride]);
+            local_max[lid] = max(local_max[lid], local_max[lid + stride]);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0) {
+        atomic_min(&min_max[0], local_min[0]);
+        atomic_max(&min_max[1], local_max[0]);
+    }
+}
+
+// May run in place (map == normalized): each work-item reads and writes only its pixel
+__kernel void normalize_map(
+    __global const uchar* map,        // Map to rescale
+    __global uchar* normalized,       // 8-bit visualization
+    __global const uint* min_max,     // From min_max_reduce
+    uint pixels                       // Number of pixels of the map
+) {
+    const uint i = get_global_id(0);
+    if (i >= pixels) return;
+
+    uint lo = min_max[0];
+    uint range = min_max[1] - lo;
+    normalized[i] = range != 0 ? (uchar)(255 * (map[i] - lo) / range) : 0;
+}
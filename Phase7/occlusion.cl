@@ -1,57 +1,171 @@
+/* Occlusion fill by jump flooding.
+   Every pixel tracks the nearest valid (non-zero) pixel found so far, packed as
+   (row << 16) | col. occlusion_seed starts each valid pixel at itself. Each
+   occlusion_jump_flood pass lets a pixel adopt the seed of one of its 8 neighbours at
+   +-step when that seed is nearer, and the host halves the step from pass to pass.
+   occlusion_filling then copies the disparity of the seed. Distances are Chebyshev, the
+   square rings of a direct search, and a seed further than max_search_radius leaves the hole.
+   Every pass reads 9 seeds per pixel, whatever the size of the holes.
+
+   Jump flooding is approximate: a pass only compares 9 seeds, so a pixel can lose its
+   nearest seed and keep a farther one (or none, near max_search_radius). The extra step-1
+   pass the host adds catches most of these, but the fill is not guaranteed to match a ring
+   search pixel for pixel.
+
+   Valid pixels never change seed, so with a hole list the passes and the fill only visit
+   the holes. occlusion_seed appends them to the list (one global atomic per work-group),
+   and the other kernels loop over it with a stride of their global size: the host sizes
+   those launches without reading the count back. Without a list (holes == NULL) they
+   cover every pixel.
+
+   occlusion_ring_fill is the exact fill, for the band mode: each hole searches the square
+   rings around it, so a row only reads max_search_radius rows on either side and can be
+   filled once, from a window of the map. */
+
+#define NO_SEED 0xFFFFFFFFu
+
+// Chebyshev distance from (col, row) to a packed seed
+uint seed_distance(uint seed, int col, int row) {
+    return max(abs((int)(seed & 0xFFFF) - col), abs((int)(seed >> 16) - row));
+}
+
+// Ties go to the leftmost, then topmost seed: the first one the ring search met
+uint seed_scan_order(uint seed) {
+    return (seed << 16) | (seed >> 16);
+}
+
+__kernel void occlusion_seed(
+    __global const uchar* input_disparity, // Disparity map with holes (0 values)
+    __global uint* seeds,                  // Nearest valid pixel of each pixel
+    __global uint* seeds_next,             // Second buffer of the ping-pong pair
+    __global uchar* filled_disparity,      // Output map: valid pixels copied, holes 0
+    __global uint* holes,                  // Hole list (pixel indices), or NULL
+    __global uint* hole_count,             // Length of the hole list, zeroed by the host
+    uint image_width,                      // Width of the disparity map
+    uint image_height                      // Height of the disparity map
+) {
+    const int col = get_global_id(0);
+    const int row = get_global_id(1);
+    const int index = row * image_width + col;
+    __local uint group_count, group_base;
+
+    uchar value = input_disparity[index];
+    uint seed = value != 0 ? ((uint)row << 16) | (uint)col : NO_SEED;
+    seeds[index] = seed;
+    seeds_next[index] = seed;   // The passes only write holes: valid pixels must be in both
+    filled_disparity[index] = value;
+
+    if (holes) {
+        // Reserve the work-group's slots with a single global atomic
+        if (get_local_id(0) == 0 && get_local_id(1) == 0) group_count = 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        uint slot = value == 0 ? atomic_inc(&group_count) : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (get_local_id(0) == 0 && get_local_id(1) == 0) group_base = atomic_add(hole_count, group_count);
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (value == 0) holes[group_base + slot] = index;
+    }
+}
+
+__kernel void occlusion_jump_flood(
+    __global const uint* seeds_in,  // Seeds after the previous pass
+    __global uint* seeds_out,       // Seeds after this pass
+    __global const uint* holes,     // Hole list, or NULL for every pixel
+    __global const uint* hole_count,// Length of the hole list
+    uint image_width,               // Width of the disparity map
+    uint image_height,              // Height of the disparity map
+    int step                        // Neighbour distance of this pass
+) {
+    const uint count = holes ? *hole_count : image_width * image_height;
+
+    for (uint i = get_global_id(0); i < count; i += get_global_size(0)) {
+        const uint index = holes ? holes[i] : i;
+        const int col = index % image_width;
+        const int row = index / image_width;
+
+        uint best_seed = seeds_in[index];
+        uint best_distance = best_seed == NO_SEED ? UINT_MAX : seed_distance(best_seed, col, row);
+
+        for (int row_offset = -step; row_offset <= step; row_offset += step) {
+            for (int col_offset = -step; col_offset <= step; col_offset += step) {
+                int y = row + row_offset;
+                int x = col + col_offset;
+                if (y < 0 || y >= (int)image_height || x < 0 || x >= (int)image_width ||
+                    (row_offset == 0 && col_offset == 0)) {
+                    continue;
+                }
+
+                uint seed = seeds_in[y * image_width + x];
+                if (seed == NO_SEED) continue;
+                uint distance = seed_distance(seed, col, row);
+                if (distance < best_distance ||
+                    (distance == best_distance && seed_scan_order(seed) < seed_scan_order(best_seed))) {
+                    best_seed = seed;
+                    best_distance = distance;
+                }
+            }
+        }
+        seeds_out[index] = best_seed;
+    }
+}
+
 __kernel void occlusion_filling(
-    __global uchar* input_disparity,  // Original disparity map with holes
-    __global uchar* filled_disparity, // Output filled disparity map
-    uint image_width,                // Width of the disparity map
-    uint image_height,               // Height of the disparity map
-    uint max_search_radius         // Maximum neighborhood radius to search
+    __global const uchar* input_disparity, // Original disparity map with holes
+    __global const uint* seeds,            // Nearest valid pixel after the last pass
+    __global const uint* holes,            // Hole list, or NULL for every pixel
+    __global const uint* hole_count,       // Length of the hole list
+    __global uchar* filled_disparity,      // Output filled disparity map
+    uint image_width,                      // Width of the disparity map
+    uint image_height,                     // Height of the disparity map
+    uint max_search_radius                 // Maximum neighborhood radius to search
 ) {
-    const int col = get_global_id(0);  // Current pixel row (Y-coordinate)
-    const int row = get_global_id(1);  // Current pixel column (X-coordinate)
-    
-    // Immediate neighbor offsets for searching
-    int row_offset, col_offset;
-    int neighbor_index;
-    int current_radius;
-    bool found_non_zero;
-
-    // Initialize output with input value
-    filled_disparity[row * image_width + col] = input_disparity[row * image_width + col];
-    
-    // Only process pixels with missing disparity (0 values)
-    if(input_disparity[row * image_width + col] == 0) {
-        found_non_zero = false;
-        
-        // Expand search radius until valid pixel found or max radius reached
-        for (current_radius = 1; 
-             (current_radius <= max_search_radius) && (!found_non_zero); 
-             current_radius++) {
-            
-            // Search in concentric square neighborhoods
-            for (col_offset = -current_radius; 
-                 (col_offset <= current_radius) && (!found_non_zero); 
-                 col_offset++) {
-                
-                for (row_offset = -current_radius; 
-                     (row_offset <= current_radius) && (!found_non_zero); 
-                     row_offset++) {
-                    
-                    // Skip out-of-bounds coordinates and center pixel
-                    if (row + row_offset < 0 || row + row_offset >= image_height ||
-                        col + col_offset < 0 || col + col_offset >= image_width ||
-                        (row_offset == 0 && col_offset == 0)) {
-                        continue;
-                    }
-
-                    neighbor_index = (row + row_offset) * image_width + (col + col_offset);
-                    
-                    // Copy first valid neighbor found
-                    if(input_disparity[neighbor_index] != 0) {
-                        filled_disparity[row * image_width + col] = input_disparity[neighbor_index];
-                        found_non_zero = true;
-                        break;
-                    }
+    const uint count = holes ? *hole_count : image_width * image_height;
+
+    for (uint i = get_global_id(0); i < count; i += get_global_size(0)) {
+        const uint index = holes ? holes[i] : i;
+
+        // Valid pixels are their own seed, at distance 0
+        uint seed = seeds[index];
+        uchar value = 0;
+        if (seed != NO_SEED && seed_distance(seed, index % image_width, index / image_width) <= max_search_radius)
+            value = input_disparity[(seed >> 16) * image_width + (seed & 0xFFFF)];
+        filled_disparity[index] = value;
+    }
+}
+
+/* Exact fill of rows [get_global_offset(1), + get_global_size(1)) of the window
+   input_disparity (image_height rows): a hole copies the first valid pixel of the square
+   rings around it, scanned column by column from the left and each column from the top, so
+   ties go the same way as in seed_scan_order. Row row of the input goes to row
+   row - filled_first_row of filled_disparity */
+__kernel void occlusion_ring_fill(
+    __global const uchar* input_disparity, // Window of the disparity map with holes
+    __global uchar* filled_disparity,      // Output rows of the filled map
+    uint image_width,                      // Width of the disparity map
+    uint image_height,                     // Rows of the window
+    int filled_first_row,                  // Input row of the first output row
+    uint max_search_radius                 // Maximum neighborhood radius to search
+) {
+    const int col = get_global_id(0);
+    const int row = get_global_id(1);
+
+    uchar value = input_disparity[row * image_width + col];
+    for (int radius = 1; value == 0 && radius <= (int)max_search_radius; radius++) {
+        for (int col_offset = -radius; col_offset <= radius && value == 0; col_offset++) {
+            const int x = col + col_offset;
+            if (x < 0 || x >= (int)image_width) continue;
+            // Inner columns of the ring only have its top and bottom pixel
+            const int row_step = col_offset == -radius || col_offset == radius ? 1 : 2 * radius;
+            for (int row_offset = -radius; row_offset <= radius; row_offset += row_step) {
+                const int y = row + row_offset;
+                if (y < 0 || y >= (int)image_height) continue;
+                const uchar neighbor = input_disparity[y * image_width + x];
+                if (neighbor != 0) {
+                    value = neighbor;
+                    break;
                 }
             }
         }
     }
-}
\ No newline at end of file
+    filled_disparity[(row - filled_first_row) * image_width + col] = value;
+}
@@ -0,0 +1,12 @@
+#include "zncc_common.h"
+
+// Fused resize + grayscale: samples the original RGBA image like resize.cl and writes
+// gray directly, without the intermediate RGBA image
+__kernel void resize_grayscale(__global const uchar4 *input, __global uchar *output, int orig_width, int orig_height){
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int src_x = min(x * RESIZE_SCALE, orig_width - 1);
+    int src_y = min(y * RESIZE_SCALE, orig_height - 1);
+    uchar4 pixel = input[src_y * orig_width + src_x];
+    output[y * get_global_size(0) + x] = RGBA_TO_GRAY(pixel);
+}
@@ -0,0 +1,170 @@
+#include "zncc_common.h"  // WINDOW_SIZE, MAX_DISP, LOCAL_WIDTH/HEIGHT come from the build options
+
+// Search extension on each side of the work-group: disparities 0..MAX_DISP-1
+#define SEARCH_EXT (MAX_DISP - 1)
+
+// Combined tiles. Both start SEARCH_EXT + WINDOW_SIZE columns left of the work-group: the right
+// image reaches back for the left-to-right search, the left image reaches forward for the
+// right-to-left search of the cross-check partner
+#define LEFT_TILE_WIDTH (LOCAL_WIDTH + 2 * SEARCH_EXT + 2 * WINDOW_SIZE)
+#define RIGHT_TILE_WIDTH (LOCAL_WIDTH + SEARCH_EXT + 2 * WINDOW_SIZE)
+
+// Window statistics (sum, sum of squares) for every window centre the searches touch
+#define LEFT_STATS_WIDTH (LOCAL_WIDTH + 2 * SEARCH_EXT)
+#define RIGHT_STATS_WIDTH (LOCAL_WIDTH + SEARCH_EXT)
+
+/* Both ZNCC directions and the cross-check in one pass.
+   Every work-item finds its left-to-right disparity d as zncc_disparity_left_optimized does,
+   then runs the right-to-left search of zncc_disparity_right_optimized for the one pixel the
+   cross-check compares against, x - d, and writes the cross-checked disparity. The tiles are
+   loaded once and the window sums of both images are computed once per window centre instead
+   of once per candidate disparity. The sums are integers below 2^24, so they are exact in
+   float and the results match the separate kernels followed by cross_check. */
+__kernel void zncc_bidirectional(
+    __global const zncc_pixel* left,
+    __global const zncc_pixel* right,
+    __global uchar* disparity,
+    int width,
+    int height,
+    int threshold)
+{
+    __local uchar left_tile[TILE_HEIGHT][LEFT_TILE_WIDTH];
+    __local uchar right_tile[TILE_HEIGHT][RIGHT_TILE_WIDTH];
+    __local ushort left_sum[LOCAL_HEIGHT][LEFT_STATS_WIDTH];
+    __local uint left_sum2[LOCAL_HEIGHT][LEFT_STATS_WIDTH];
+    __local ushort right_sum[LOCAL_HEIGHT][RIGHT_STATS_WIDTH];
+    __local uint right_sum2[LOCAL_HEIGHT][RIGHT_STATS_WIDTH];
+
+    const int local_x = get_local_id(0);
+    const int local_y = get_local_id(1);
+    const int local_id = local_y * LOCAL_WIDTH + local_x;
+
+    // Global tile origin (the global offset lets the host run the kernel over a band of rows)
+    const int group_x0 = get_group_id(0) * LOCAL_WIDTH + (int)get_global_offset(0);
+    const int group_y0 = get_group_id(1) * LOCAL_HEIGHT + (int)get_global_offset(1);
+    const int base_x = group_x0 - SEARCH_EXT - WINDOW_SIZE;
+    const int base_y = group_y0 - WINDOW_SIZE;
+
+    // Coalesced loading of both tiles with boundary clamping
+    for(int ty = local_y; ty < TILE_HEIGHT; ty += LOCAL_HEIGHT) {
+        int gy = clamp(base_y + ty, 0, height-1);
+        for(int tx = local_x; tx < LEFT_TILE_WIDTH; tx += LOCAL_WIDTH) {
+            int gx = clamp(base_x + tx, 0, width-1);
+            left_tile[ty][tx] = ZNCC_LOAD(left, gx, gy, width);
+        }
+        for(int tx = local_x; tx < RIGHT_TILE_WIDTH; tx += LOCAL_WIDTH) {
+            int gx = clamp(base_x + tx, 0, width-1);
+            right_tile[ty][tx] = ZNCC_LOAD(right, gx, gy, width);
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Window statistics; stats column c is centred on tile column c + WINDOW_SIZE
+    for(int i = local_id; i < LOCAL_HEIGHT * (LEFT_STATS_WIDTH + RIGHT_STATS_WIDTH); i += LOCAL_WIDTH * LOCAL_HEIGHT) {
+        const int row = i / (LEFT_STATS_WIDTH + RIGHT_STATS_WIDTH);
+        const int col = i % (LEFT_STATS_WIDTH + RIGHT_STATS_WIDTH);
+        const int is_left = col < LEFT_STATS_WIDTH;
+        const int c = is_left ? col : col - LEFT_STATS_WIDTH;
+        uint s = 0, s2 = 0;
+        for(int wy = 0; wy < WINDOW_DIM; ++wy) {
+            for(int wx = 0; wx < WINDOW_DIM; ++wx) {
+                const uint p = is_left ? left_tile[row + wy][c + wx] : right_tile[row + wy][c + wx];
+                s += p;
+                s2 += p * p;
+            }
+        }
+        if(is_left) {
+            left_sum[row][c] = (ushort)s;
+            left_sum2[row][c] = s2;
+        } else {
+            right_sum[row][c] = (ushort)s;
+            right_sum2[row][c] = s2;
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Global coordinates and border check
+    const int x = group_x0 + local_x;
+    const int y = group_y0 + local_y;
+    if(x >= width || y >= height) return;  // Padding of the rounded-up NDRange
+    if(x < WINDOW_SIZE || x >= width - WINDOW_SIZE ||
+       y < WINDOW_SIZE || y >= height - WINDOW_SIZE) {
+        disparity[y * width + x] = 0;
+        return;
+    }
+
+    // Stats and tile column of this pixel
+    const int sc = SEARCH_EXT + local_x;
+
+    // Left -> right search (zncc_disparity_left_optimized)
+    const float sum_L = left_sum[local_y][sc];
+    const float var_L = left_sum2[local_y][sc] - (sum_L * sum_L) * INV_N;
+    float max_zncc = -INFINITY;
+    int best_d = 0;
+    for(int d = 0; d < MAX_DISP; ++d) {
+        if(x - d < 0) break;
+
+        float sum_LR = 0.0f;
+        #pragma unroll
+        for(int wy = 0; wy < WINDOW_DIM; ++wy) {
+            #pragma unroll
+            for(int wx = 0; wx < WINDOW_DIM; ++wx) {
+                const uchar l = left_tile[local_y + wy][sc + wx];
+                const uchar r = right_tile[local_y + wy][sc - d + wx];
+                sum_LR += l * r;
+            }
+        }
+
+        const float sum_R = right_sum[local_y][sc - d];
+        const float cov = sum_LR - sum_L * sum_R * INV_N;
+        const float var_R = right_sum2[local_y][sc - d] - (sum_R * sum_R) * INV_N;
+        const float zncc = cov * native_rsqrt(var_L * var_R + 1e-8f);
+
+        if(zncc > max_zncc) {
+            max_zncc = zncc;
+            best_d = d;
+        }
+    }
+
+    // Right -> left search for the cross-check partner x - best_d
+    // (zncc_disparity_right_optimized; border pixels have disparity 0 there)
+    const int xr = x - best_d;
+    int best_d_right = 0;
+    if(xr >= WINDOW_SIZE) {
+        const int rc = sc - best_d;
+        const float inv_n = INV_N;
+        const float sum_R = right_sum[local_y][rc];
+        const float var_R = right_sum2[local_y][rc] - (sum_R * sum_R) * inv_n;
+        float max_zncc_right = -INFINITY;
+        for(int d = 0; d < MAX_DISP; ++d) {
+            if(xr + d + WINDOW_SIZE >= width) break;
+
+            float sum_LR = 0.0f;
+            #pragma unroll
+            for(int wy = 0; wy < WINDOW_DIM; ++wy) {
+                #pragma unroll
+                for(int wx = 0; wx < WINDOW_DIM; ++wx) {
+                    const uchar r = right_tile[local_y + wy][rc + wx];
+                    const uchar l = left_tile[local_y + wy][rc + d + wx];
+                    sum_LR += r * l;
+                }
+            }
+
+            const float sum_Ld = left_sum[local_y][rc + d];
+            const float mean_L = sum_Ld * inv_n;
+            const float cov = sum_LR - sum_R * mean_L;
+            const float var_Ld = left_sum2[local_y][rc + d] - (sum_Ld * sum_Ld) * inv_n;
+            const float zncc = cov * rsqrt(var_R * var_Ld + 1e-8f);
+
+            if(zncc > max_zncc_right) {
+                max_zncc_right = zncc;
+                best_d_right = d;
+            }
+        }
+    }
+
+    // Cross-check epilogue (cross_check.cl)
+    disparity[y * width + x] = abs(best_d - best_d_right) > threshold ? 0 : (uchar)best_d;
+}
@@ -0,0 +1,42 @@
+// Constants shared by every kernel of the pipeline.
+// The host injects them as build options (-D WINDOW_SIZE=... etc.) from the same
+// constants it uses for buffer sizes and NDRanges, so the two can not drift apart.
+#ifndef ZNCC_COMMON_H
+#define ZNCC_COMMON_H
+
+#if !defined(WINDOW_SIZE) || !defined(MAX_DISP) || !defined(LOCAL_WIDTH) || !defined(LOCAL_HEIGHT) || !defined(FILTER_RADIUS) || !defined(RESIZE_SCALE) \
+    || !defined(NORMALIZE_GROUP) || !defined(ZNCC_RUN) || !defined(ZNCC_LANES)
+#error "WINDOW_SIZE, MAX_DISP, LOCAL_WIDTH, LOCAL_HEIGHT, FILTER_RADIUS, RESIZE_SCALE, NORMALIZE_GROUP, ZNCC_RUN and ZNCC_LANES must be passed as build options"
+#endif
+
+// Window sums of the ZNCC kernels must stay exact in float (and fit zncc_bidirectional's
+// ushort statistics), disparities are stored as uchar
+#if WINDOW_SIZE < 1 || WINDOW_SIZE > 7 || MAX_DISP < 1 || MAX_DISP > 256
+#error "WINDOW_SIZE must be 1 to 7 and MAX_DISP 1 to 256"
+#endif
+
+#define WINDOW_DIM (2 * WINDOW_SIZE + 1)
+#define NUM_PIXELS (WINDOW_DIM * WINDOW_DIM)      // 9x9 = 81 for WINDOW_SIZE 4
+#define INV_N (1.0f / NUM_PIXELS)
+
+// Local memory tile dimensions (work-group plus window halo)
+#define TILE_WIDTH (LOCAL_WIDTH + 2 * WINDOW_SIZE)
+#define TILE_HEIGHT (LOCAL_HEIGHT + 2 * WINDOW_SIZE)
+
+// Luminance weights of the grayscale stage
+#define RGBA_TO_GRAY(p) ((uchar)(0.2125f * (p).x + 0.7152f * (p).y + 0.0722f * (p).z))
+
+// Source of the ZNCC tiles. By default the kernels read the gray images. With
+// -D ZNCC_TILES_FROM_RGBA they read the original RGBA images and resize and convert each
+// pixel while filling the tile; width is then the working width and the source row pitch
+// is width * RESIZE_SCALE
+#ifdef ZNCC_TILES_FROM_RGBA
+typedef uchar4 zncc_pixel;
+#define ZNCC_LOAD(img, gx, gy, width) \
+    RGBA_TO_GRAY((img)[((gy) * (width) * RESIZE_SCALE + (gx)) * RESIZE_SCALE])
+#else
+typedef uchar zncc_pixel;
+#define ZNCC_LOAD(img, gx, gy, width) ((img)[(gy) * (width) + (gx)])
+#endif
+
+#endif
@@ -0,0 +1,185 @@
+#include "zncc_common.h"  // WINDOW_SIZE, MAX_DISP, LOCAL_WIDTH/HEIGHT come from the build options
+
+/* Packed integer variants of zncc_disparity_left_optimized / _right_optimized (--dot-zncc).
+   Same arguments, tiles and NDRange, so the host launches them the same way.
+   Each window row is read as uchar4 chunks, and the sums of R, L*R and R*R accumulate as
+   4-way dot products in 32-bit integers; only the final ZNCC is computed in float. The
+   sums are exact and the optimized kernels' float sums are exact too (below 2^24), so the
+   maps match pixel for pixel.
+   With -D ZNCC_DOT_PRODUCT (the host adds it when the device has cl_khr_integer_dot_product)
+   a chunk is one dot_acc_sat instruction. Otherwise it is a chain of four mad24. The
+   reference window stays in private memory as chunks, its last chunk masked to the window. */
+
+#ifdef ZNCC_DOT_PRODUCT
+#pragma OPENCL EXTENSION cl_khr_integer_dot_product : enable
+#define DOT4_ACC(a, b, acc) dot_acc_sat((a), (b), (acc))
+#else
+#define DOT4_ACC(a, b, acc) mad24((uint)(a).s0, (uint)(b).s0, mad24((uint)(a).s1, (uint)(b).s1, \
+                            mad24((uint)(a).s2, (uint)(b).s2, mad24((uint)(a).s3, (uint)(b).s3, (acc)))))
+#endif
+
+#define SEARCH_TILE_WIDTH (TILE_WIDTH + MAX_DISP)
+#define DOT_CHUNKS ((WINDOW_DIM + 3) / 4)                 // uchar4 chunks per window row
+#define TAIL_LANES (WINDOW_DIM - 4 * (DOT_CHUNKS - 1))    // Window columns in the last chunk
+#define TILE_PADDING 3  // The last chunk of the last row may read past the tile
+
+/* Search and write this work-item's disparity. Candidate d is search tile column
+   px + search_shift + direction * d: direction -1 is the left-to-right search, +1 the
+   right-to-left one */
+void dot_search(__local const uchar* ref_tile,    // TILE_HEIGHT x TILE_WIDTH
+                __local const uchar* search_tile, // TILE_HEIGHT x SEARCH_TILE_WIDTH
+                int search_shift,
+                int direction,
+                __global uchar* disparity,
+                int width,
+                int height)
+{
+    const int px = get_local_id(0);
+    const int py = get_local_id(1);
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+    if(x >= width || y >= height) return;  // Padding of the rounded-up NDRange
+    if(x < WINDOW_SIZE || x >= width - WINDOW_SIZE ||
+       y < WINDOW_SIZE || y >= height - WINDOW_SIZE) {
+        disparity[y * width + x] = 0;
+        return;
+    }
+
+    // Zeroes the columns of the last chunk that lie past the window
+    const uchar4 tail_mask = (uchar4)(0xff, TAIL_LANES > 1 ? 0xff : 0,
+                                      TAIL_LANES > 2 ? 0xff : 0, TAIL_LANES > 3 ? 0xff : 0);
+    const uchar4 ones = (uchar4)(1);
+
+    // Reference window chunks and statistics
+    uchar4 ref[WINDOW_DIM][DOT_CHUNKS];
+    uint ref_s = 0, ref_s2 = 0;
+    #pragma unroll
+    for(int wy = 0; wy < WINDOW_DIM; ++wy) {
+        #pragma unroll
+        for(int c = 0; c < DOT_CHUNKS; ++c) {
+            uchar4 l = vload4(0, ref_tile + (py + wy) * TILE_WIDTH + px + 4 * c);
+            if(c == DOT_CHUNKS - 1) l &= tail_mask;
+            ref[wy][c] = l;
+            ref_s = DOT4_ACC(l, ones, ref_s);
+            ref_s2 = DOT4_ACC(l, l, ref_s2);
+        }
+    }
+    const float sum_ref = ref_s;
+    const float var_ref = (float)ref_s2 - (sum_ref * sum_ref) * INV_N;
+
+    float max_zncc = -INFINITY;
+    int best_d = 0;
+    for(int d = 0; d < MAX_DISP; ++d) {
+        if(direction < 0 ? x - d < 0 : x + d + WINDOW_SIZE >= width) break;  // Early termination
+
+        const int search_x = px + search_shift + direction * d;
+        uint s = 0, s2 = 0, prod = 0;
+        #pragma unroll
+        for(int wy = 0; wy < WINDOW_DIM; ++wy) {
+            #pragma unroll
+            for(int c = 0; c < DOT_CHUNKS; ++c) {
+                uchar4 r = vload4(0, search_tile + (py + wy) * SEARCH_TILE_WIDTH + search_x + 4 * c);
+                if(c == DOT_CHUNKS - 1) r &= tail_mask;
+                s = DOT4_ACC(r, ones, s);
+                s2 = DOT4_ACC(r, r, s2);
+                prod = DOT4_ACC(ref[wy][c], r, prod);
+            }
+        }
+
+        // The optimized kernels' formulas, on the exact sums
+        const float sum_search = s;
+        float zncc;
+        if(direction < 0) {
+            const float cov = (float)prod - sum_ref * sum_search * INV_N;
+            const float var_search = (float)s2 - (sum_search * sum_search) * INV_N;
+            zncc = cov * native_rsqrt(var_ref * var_search + 1e-8f);
+        } else {
+            const float mean_search = sum_search * INV_N;
+            const float cov = (float)prod - sum_ref * mean_search;
+            const float var_search = (float)s2 - (sum_search * sum_search) * INV_N;
+            zncc = cov * rsqrt(var_ref * var_search + 1e-8f);
+        }
+        if(zncc > max_zncc) {
+            max_zncc = zncc;
+            best_d = d;
+        }
+    }
+
+    disparity[y * width + x] = (uchar)best_d;
+}
+
+__kernel void zncc_disparity_left_dot(
+    __global const zncc_pixel* left,
+    __global const zncc_pixel* right,
+    __global uchar* disparity,
+    int width,
+    int height,
+    int max_disp,
+    int window_size)
+{
+    __local uchar left_tile[TILE_HEIGHT * TILE_WIDTH + TILE_PADDING];          // Left image tile with halo
+    __local uchar right_tile[TILE_HEIGHT * SEARCH_TILE_WIDTH + TILE_PADDING];  // Right tile + search area
+
+    const int local_x = get_local_id(0);
+    const int local_y = get_local_id(1);
+
+    // Tile origin with halo (the global offset lets the host run the kernel over a band of rows)
+    const int base_x = get_group_id(0) * LOCAL_WIDTH + (int)get_global_offset(0) - WINDOW_SIZE;
+    const int base_y = get_group_id(1) * LOCAL_HEIGHT + (int)get_global_offset(1) - WINDOW_SIZE;
+
+    // Coalesced loading of both tiles with boundary clamping; the right tile reaches back
+    // MAX_DISP columns
+    for(int ty = local_y; ty < TILE_HEIGHT; ty += LOCAL_HEIGHT) {
+        int gy = clamp(base_y + ty, 0, height-1);
+        for(int tx = local_x; tx < TILE_WIDTH; tx += LOCAL_WIDTH) {
+            int gx = clamp(base_x + tx, 0, width-1);
+            left_tile[ty * TILE_WIDTH + tx] = ZNCC_LOAD(left, gx, gy, width);
+        }
+        for(int tx = local_x; tx < SEARCH_TILE_WIDTH; tx += LOCAL_WIDTH) {
+            int gx = clamp(base_x - MAX_DISP + tx, 0, width-1);
+            right_tile[ty * SEARCH_TILE_WIDTH + tx] = ZNCC_LOAD(right, gx, gy, width);
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    dot_search(left_tile, right_tile, MAX_DISP, -1, disparity, width, height);
+}
+
+__kernel void zncc_disparity_right_dot(
+    __global const zncc_pixel* right,
+    __global const zncc_pixel* left,
+    __global uchar* disparity,
+    int width,
+    int height,
+    int max_disp,
+    int window_size)
+{
+    __local uchar right_tile[TILE_HEIGHT * TILE_WIDTH + TILE_PADDING];         // Right image tile with halo
+    __local uchar left_tile[TILE_HEIGHT * SEARCH_TILE_WIDTH + TILE_PADDING];   // Left tile + search area
+
+    const int local_x = get_local_id(0);
+    const int local_y = get_local_id(1);
+
+    // Tile origin with halo (the global offset lets the host run the kernel over a band of rows)
+    const int base_x = get_group_id(0) * LOCAL_WIDTH + (int)get_global_offset(0) - WINDOW_SIZE;
+    const int base_y = get_group_id(1) * LOCAL_HEIGHT + (int)get_global_offset(1) - WINDOW_SIZE;
+
+    // Coalesced loading of both tiles with boundary clamping; the left tile reaches forward
+    // MAX_DISP columns
+    for(int ty = local_y; ty < TILE_HEIGHT; ty += LOCAL_HEIGHT) {
+        int gy = clamp(base_y + ty, 0, height-1);
+        for(int tx = local_x; tx < TILE_WIDTH; tx += LOCAL_WIDTH) {
+            int gx = clamp(base_x + tx, 0, width-1);
+            right_tile[ty * TILE_WIDTH + tx] = ZNCC_LOAD(right, gx, gy, width);
+        }
+        for(int tx = local_x; tx < SEARCH_TILE_WIDTH; tx += LOCAL_WIDTH) {
+            int gx = clamp(base_x + tx, 0, width-1);
+            left_tile[ty * SEARCH_TILE_WIDTH + tx] = ZNCC_LOAD(left, gx, gy, width);
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    dot_search(right_tile, left_tile, 0, 1, disparity, width, height);
+}
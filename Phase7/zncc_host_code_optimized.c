@@ -1,17 +1,38 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <omp.h>
 #include <CL/cl.h>
 #include "lodepng.h"
 
-const unsigned MAX_DISP = 65;
-const unsigned WINDOW_SIZE = 4;
+#ifdef EMBED_KERNELS
+#include "kernels_embedded.h"   // Generated by the Makefile with embed_kernels
+#endif
+
+#ifdef _WIN32
+#include <direct.h>
+#define make_dir(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#define make_dir(path) mkdir(path, 0755)
+#endif
+
+unsigned MAX_DISP = 65;                // disparity range and matching window half-size, set with
+unsigned WINDOW_SIZE = 4;              // --max-disp/--window-size; the kernels are specialized for them
 const unsigned THRESHOLD = 2;
 const unsigned MAX_SEARCH_RADIUS = 200;
+const unsigned FILTER_RADIUS = 4;      // moving_average_5x5 reads a 9x9 neighbourhood
+unsigned LOCAL_WIDTH = 16;             // ZNCC work-group / local tile size, replaced by the
+unsigned LOCAL_HEIGHT = 16;            // device's tuning profile (--autotune)
 
 const unsigned ORIG_WIDTH = 2940;
 const unsigned ORIG_HEIGHT = 2016;
 const unsigned WIDTH = 735;
 const unsigned HEIGHT = 504;
+#define RESIZE_SCALE (ORIG_WIDTH / WIDTH)  // Decimation factor of the resize, in both directions
 
 
 void print_platform_and_device_info() {
@@ -89,6 +110,297 @@ void print_profiling_info(const char* name, cl_event event) {
     printf("%s time: %.3f ms\n", name, elapsed);
 }
 
+// Same for a chain of commands, from the start of `first` to the end of `last`
+void print_profiling_span(const char* name, cl_event first, cl_event last) {
+    cl_ulong start, end;
+    clGetEventProfilingInfo(first, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+    clGetEventProfilingInfo(last, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+    printf("%s time: %.3f ms\n", name, (end - start) * 1e-6);
+}
+
+/*................Timeline tracing (--trace FILE)................*/
+/* Every enqueued command and the host stages around them are recorded and written as a
+   Chrome/Perfetto trace (open it in chrome://tracing or ui.perfetto.dev). Each queue gets
+   two tracks: the commands' START..END execution and, below it, their QUEUED..START wait,
+   with the SUBMIT time in the slice arguments. Device timestamps are moved onto the host
+   clock with one marker per queue, enqueued on the empty queue when it is first seen */
+#define TRACE_MAX_RECORDS 65536
+#define TRACE_MAX_QUEUES 64
+
+typedef struct {
+    char name[96];
+    cl_event event;                // NULL for a host span
+    int queue;                     // index into trace_queues, -1 for the host
+    double host_start, host_end;   // omp_get_wtime() seconds of a host span
+} trace_record;
+
+typedef struct {
+    cl_command_queue queue;
+    double offset_us;              // host trace time minus device time
+} trace_queue;
+
+const char *trace_path = NULL;
+double trace_origin = 0.0;
+trace_record *trace_records = NULL;
+int trace_count = 0, trace_dropped = 0;
+trace_queue trace_queues[TRACE_MAX_QUEUES];
+int trace_num_queues = 0;
+
+void trace_start(const char *path) {
+    trace_path = path;
+    trace_origin = omp_get_wtime();
+    trace_records = (trace_record*)malloc(TRACE_MAX_RECORDS * sizeof(trace_record));
+}
+
+trace_record* trace_new_record(void) {
+    if (trace_count == TRACE_MAX_RECORDS) {
+        trace_dropped++;
+        return NULL;
+    }
+    return &trace_records[trace_count++];
+}
+
+// A host span that started at `start` (omp_get_wtime) and ends now
+void trace_host_span(const char *name, const char *detail, double start) {
+    if (!trace_path) return;
+    double end = omp_get_wtime();
+    trace_record *r = trace_new_record();
+    if (!r) return;
+    snprintf(r->name, sizeof(r->name), detail ? "%s %s" : "%s", name, detail);
+    for (char *c = r->name; *c; c++)
+        if (*c == '"' || *c == '\\') *c = '/';   // file names end up in JSON strings
+    r->event = NULL;
+    r->queue = -1;
+    r->host_start = start;
+    r->host_end = end;
+}
+
+int trace_queue_index(cl_command_queue queue) {
+    for (int i = 0; i < trace_num_queues; i++)
+        if (trace_queues[i].queue == queue) return i;
+    if (trace_num_queues == TRACE_MAX_QUEUES) return -1;
+
+    cl_event marker;
+    cl_ulong end = 0;
+    clEnqueueMarkerWithWaitList(queue, 0, NULL, &marker);
+    clWaitForEvents(1, &marker);
+    double host_us = (omp_get_wtime() - trace_origin) * 1e6;
+    clGetEventProfilingInfo(marker, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+    clReleaseEvent(marker);
+
+    trace_queues[trace_num_queues].queue = queue;
+    trace_queues[trace_num_queues].offset_us = host_us - end * 1e-3;
+    return trace_num_queues++;
+}
+
+/* The enqueue wrappers below hand their event slot through these two: with tracing on, a
+   command the caller enqueued without an event gets a private one */
+cl_event* trace_event_slot(cl_command_queue queue, cl_event *caller_event, cl_event *own_event) {
+    if (!trace_path) return caller_event;
+    trace_queue_index(queue);
+    return caller_event ? caller_event : own_event;
+}
+
+void trace_command(cl_command_queue queue, const char *name, size_t bytes, cl_int err,
+                   cl_event *caller_event, cl_event own_event) {
+    if (!trace_path || err != CL_SUCCESS) return;
+    cl_event event = caller_event ? *caller_event : own_event;
+    trace_record *r = trace_new_record();
+    if (r) {
+        if (bytes >= 1024 * 1024) snprintf(r->name, sizeof(r->name), "%s %.2f MB", name, bytes / (1024.0 * 1024.0));
+        else if (bytes) snprintf(r->name, sizeof(r->name), "%s %.1f KB", name, bytes / 1024.0);
+        else snprintf(r->name, sizeof(r->name), "%s", name);
+        r->event = event;
+        r->queue = trace_queue_index(queue);
+        clRetainEvent(event);
+    }
+    if (!caller_event) clReleaseEvent(own_event);
+}
+
+/* Tracing versions of the enqueue and PNG file calls. The host calls these instead of the
+   OpenCL and lodepng functions, so every command and file operation shows up in --trace */
+cl_int traced_enqueue_ndrange_kernel(cl_command_queue queue, cl_kernel kernel, cl_uint work_dim,
+                                     const size_t *offset, const size_t *global_size, const size_t *local_size,
+                                     cl_uint num_events, const cl_event *wait_list, cl_event *event) {
+    cl_event own_event = NULL;
+    cl_int err = clEnqueueNDRangeKernel(queue, kernel, work_dim, offset, global_size, local_size, num_events,
+                                        wait_list, trace_event_slot(queue, event, &own_event));
+    char name[64] = {0};
+    if (trace_path) clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(name) - 1, name, NULL);
+    trace_command(queue, name, 0, err, event, own_event);
+    return err;
+}
+
+cl_int traced_enqueue_write_buffer(cl_command_queue queue, cl_mem buffer, cl_bool blocking, size_t offset,
+                                   size_t size, const void *ptr, cl_uint num_events, const cl_event *wait_list,
+                                   cl_event *event) {
+    cl_event own_event = NULL;
+    cl_int err = clEnqueueWriteBuffer(queue, buffer, blocking, offset, size, ptr, num_events, wait_list,
+                                      trace_event_slot(queue, event, &own_event));
+    trace_command(queue, "Write", size, err, event, own_event);
+    return err;
+}
+
+cl_int traced_enqueue_read_buffer(cl_command_queue queue, cl_mem buffer, cl_bool blocking, size_t offset,
+                                  size_t size, void *ptr, cl_uint num_events, const cl_event *wait_list,
+                                  cl_event *event) {
+    cl_event own_event = NULL;
+    cl_int err = clEnqueueReadBuffer(queue, buffer, blocking, offset, size, ptr, num_events, wait_list,
+                                     trace_event_slot(queue, event, &own_event));
+    trace_command(queue, "Read", size, err, event, own_event);
+    return err;
+}
+
+cl_int traced_enqueue_copy_buffer(cl_command_queue queue, cl_mem src, cl_mem dst, size_t src_offset,
+                                  size_t dst_offset, size_t size, cl_uint num_events, const cl_event *wait_list,
+                                  cl_event *event) {
+    cl_event own_event = NULL;
+    cl_int err = clEnqueueCopyBuffer(queue, src, dst, src_offset, dst_offset, size, num_events, wait_list,
+                                     trace_event_slot(queue, event, &own_event));
+    trace_command(queue, "Copy", size, err, event, own_event);
+    return err;
+}
+
+void* traced_enqueue_map_buffer(cl_command_queue queue, cl_mem buffer, cl_bool blocking, cl_map_flags flags,
+                                size_t offset, size_t size, cl_uint num_events, const cl_event *wait_list,
+                                cl_event *event, cl_int *errcode) {
+    cl_event own_event = NULL;
+    cl_int err;
+    void *ptr = clEnqueueMapBuffer(queue, buffer, blocking, flags, offset, size, num_events, wait_list,
+                                   trace_event_slot(queue, event, &own_event), &err);
+    if (errcode) *errcode = err;
+    trace_command(queue, "Map", size, err, event, own_event);
+    return ptr;
+}
+
+cl_int traced_enqueue_unmap_mem_object(cl_command_queue queue, cl_mem memobj, void *ptr, cl_uint num_events,
+                                       const cl_event *wait_list, cl_event *event) {
+    cl_event own_event = NULL;
+    cl_int err = clEnqueueUnmapMemObject(queue, memobj, ptr, num_events, wait_list,
+                                         trace_event_slot(queue, event, &own_event));
+    trace_command(queue, "Unmap", 0, err, event, own_event);
+    return err;
+}
+
+cl_int traced_enqueue_svm_map(cl_command_queue queue, cl_bool blocking, cl_map_flags flags, void *ptr,
+                              size_t size, cl_uint num_events, const cl_event *wait_list, cl_event *event) {
+    cl_event own_event = NULL;
+    cl_int err = clEnqueueSVMMap(queue, blocking, flags, ptr, size, num_events, wait_list,
+                                 trace_event_slot(queue, event, &own_event));
+    trace_command(queue, "SVM map", size, err, event, own_event);
+    return err;
+}
+
+cl_int traced_enqueue_svm_unmap(cl_command_queue queue, void *ptr, cl_uint num_events,
+                                const cl_event *wait_list, cl_event *event) {
+    cl_event own_event = NULL;
+    cl_int err = clEnqueueSVMUnmap(queue, ptr, num_events, wait_list, trace_event_slot(queue, event, &own_event));
+    trace_command(queue, "SVM unmap", 0, err, event, own_event);
+    return err;
+}
+
+cl_int traced_enqueue_marker(cl_command_queue queue, cl_uint num_events, const cl_event *wait_list,
+                             cl_event *event) {
+    cl_event own_event = NULL;
+    cl_int err = clEnqueueMarkerWithWaitList(queue, num_events, wait_list, trace_event_slot(queue, event, &own_event));
+    trace_command(queue, "Marker", 0, err, event, own_event);
+    return err;
+}
+
+unsigned traced_decode32_file(unsigned char **out, unsigned *w, unsigned *h, const char *filename) {
+    double start = omp_get_wtime();
+    unsigned error = lodepng_decode32_file(out, w, h, filename);
+    trace_host_span("Decode", filename, start);
+    return error;
+}
+
+unsigned traced_encode_file(const char *filename, const unsigned char *image, unsigned w, unsigned h,
+                            LodePNGColorType colortype, unsigned bitdepth) {
+    double start = omp_get_wtime();
+    unsigned error = lodepng_encode_file(filename, image, w, h, colortype, bitdepth);
+    trace_host_span("Encode", filename, start);
+    return error;
+}
+
+unsigned traced_encode32_file(const char *filename, const unsigned char *image, unsigned w, unsigned h) {
+    double start = omp_get_wtime();
+    unsigned error = lodepng_encode32_file(filename, image, w, h);
+    trace_host_span("Encode", filename, start);
+    return error;
+}
+
+// One complete ("X") slice; the host track's name record always precedes it
+void trace_write_event(FILE *fp, const char *name, const char *category, int tid,
+                       double start_us, double end_us, const char *args) {
+    fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f%s%s%s}",
+            name, category, tid, start_us, end_us - start_us,
+            args ? ",\"args\":{" : "", args ? args : "", args ? "}" : "");
+}
+
+/* Write the trace. Track 0 is the host; queue i owns tracks 2i+1 (execution) and 2i+2
+   (waiting from QUEUED to START) */
+void trace_finish(void) {
+    if (!trace_path) return;
+    FILE *fp = fopen(trace_path, "w");
+    if (!fp) {
+        perror("Couldn't write the trace");
+        return;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    fprintf(fp, "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"host\"}}");
+    for (int i = 0; i < trace_num_queues; i++) {
+        char device_name[128] = {0};
+        cl_device_id device;
+        clGetCommandQueueInfo(trace_queues[i].queue, CL_QUEUE_DEVICE, sizeof(device), &device, NULL);
+        clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name) - 1, device_name, NULL);
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"queue %d (%s)\"}}",
+                2 * i + 1, i, device_name);
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"queue %d waiting\"}}",
+                2 * i + 2, i);
+    }
+
+    int written = 0;
+    for (int i = 0; i < trace_count; i++) {
+        trace_record *r = &trace_records[i];
+        if (!r->event) {
+            trace_write_event(fp, r->name, "host", 0, (r->host_start - trace_origin) * 1e6,
+                              (r->host_end - trace_origin) * 1e6, NULL);
+            written++;
+            continue;
+        }
+
+        cl_ulong queued = 0, submit = 0, start = 0, end = 0;
+        cl_int err = clWaitForEvents(1, &r->event);
+        if (err == CL_SUCCESS && r->queue >= 0
+            && clGetEventProfilingInfo(r->event, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, NULL) == CL_SUCCESS
+            && clGetEventProfilingInfo(r->event, CL_PROFILING_COMMAND_SUBMIT, sizeof(submit), &submit, NULL) == CL_SUCCESS
+            && clGetEventProfilingInfo(r->event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL) == CL_SUCCESS
+            && clGetEventProfilingInfo(r->event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL) == CL_SUCCESS) {
+            double offset = trace_queues[r->queue].offset_us;
+            char args[160];
+            snprintf(args, sizeof(args), "\"queued_to_submit_us\":%.3f,\"submit_to_start_us\":%.3f",
+                     (submit - queued) * 1e-3, (start - submit) * 1e-3);
+            trace_write_event(fp, r->name, "device", 2 * r->queue + 1,
+                              start * 1e-3 + offset, end * 1e-3 + offset, args);
+            if (start > queued)
+                trace_write_event(fp, r->name, "wait", 2 * r->queue + 2,
+                                  queued * 1e-3 + offset, start * 1e-3 + offset, args);
+            written++;
+        }
+        clReleaseEvent(r->event);
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+
+    printf("Trace: %d slices on %d queues written to %s", written, trace_num_queues, trace_path);
+    if (trace_dropped) printf(" (%d records beyond %d dropped)", trace_dropped, TRACE_MAX_RECORDS);
+    printf("\n");
+    free(trace_records);
+    trace_records = NULL;
+    trace_path = NULL;
+}
+
 cl_device_id create_device() {
     cl_platform_id platform;
     cl_device_id dev;
@@ -110,36 +422,493 @@ cl_device_id create_device() {
     return dev;
 }
 
-cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename, const char* options) {
+// On-disk cache of program binaries (disable with --no-program-cache)
+#define PROGRAM_CACHE_DIR "kernel_cache"
+const char PROGRAM_CACHE_MAGIC[8] = {'Z', 'N', 'C', 'C', 'B', 'I', 'N', '1'};
+int use_program_cache = 1;
+unsigned program_cache_hits = 0;
+unsigned program_cache_misses = 0;
+const char *program_origin = "source files";   // where the pipeline program came from
+unsigned program_extension_paths = 0;   // bit i: PIPELINE_SOURCES[i] has its extension path in the program
+
+// 64-bit FNV-1a, chained over several inputs
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* The cache key covers everything that changes the binary: the kernel source, the build
+   options, and the device and driver that compiled it */
+uint64_t program_cache_key(cl_device_id dev, const char *source, size_t size, const char *options) {
+    char device_name[256] = {0}, driver_version[256] = {0}, device_version[256] = {0};
+    clGetDeviceInfo(dev, CL_DEVICE_NAME, sizeof(device_name) - 1, device_name, NULL);
+    clGetDeviceInfo(dev, CL_DRIVER_VERSION, sizeof(driver_version) - 1, driver_version, NULL);
+    clGetDeviceInfo(dev, CL_DEVICE_VERSION, sizeof(device_version) - 1, device_version, NULL);
+
+    uint64_t hash = 14695981039346656037ULL;
+    hash = hash_bytes(hash, source, size);
+    hash = hash_bytes(hash, "\0", 1);
+    if (options) hash = hash_bytes(hash, options, strlen(options));
+    hash = hash_bytes(hash, "\0", 1);
+    hash = hash_bytes(hash, device_name, strlen(device_name) + 1);
+    hash = hash_bytes(hash, driver_version, strlen(driver_version) + 1);
+    hash = hash_bytes(hash, device_version, strlen(device_version) + 1);
+    return hash;
+}
+
+void program_cache_path(uint64_t key, char *path, size_t path_size) {
+    snprintf(path, path_size, "%s/%016llx.bin", PROGRAM_CACHE_DIR, (unsigned long long)key);
+}
+
+/* Try to create the program from a cached binary. Returns NULL on a missing, stale or
+   rejected entry; the caller then falls back to building from source */
+cl_program load_cached_program(cl_context ctx, cl_device_id dev, uint64_t key, const char *options) {
+    char path[512];
+    program_cache_path(key, path, sizeof(path));
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+
+    char magic[8];
+    uint64_t stored_key = 0, binary_size = 0;
+    unsigned char *binary = NULL;
+    int ok = fread(magic, 1, sizeof(magic), fp) == sizeof(magic)
+          && memcmp(magic, PROGRAM_CACHE_MAGIC, sizeof(magic)) == 0
+          && fread(&stored_key, sizeof(stored_key), 1, fp) == 1 && stored_key == key
+          && fread(&binary_size, sizeof(binary_size), 1, fp) == 1 && binary_size > 0;
+    if (ok) {
+        binary = (unsigned char*)malloc((size_t)binary_size);
+        ok = fread(binary, 1, (size_t)binary_size, fp) == binary_size;
+    }
+    fclose(fp);
+    if (!ok) {
+        free(binary);
+        return NULL;
+    }
+
+    size_t size = (size_t)binary_size;
+    cl_int binary_status, err;
+    cl_program program = clCreateProgramWithBinary(ctx, 1, &dev, &size, (const unsigned char**)&binary,
+                                                   &binary_status, &err);
+    free(binary);
+    if (err != CL_SUCCESS || binary_status != CL_SUCCESS) {
+        if (program) clReleaseProgram(program);
+        return NULL;
+    }
+    if (clBuildProgram(program, 1, &dev, options, NULL, NULL) != CL_SUCCESS) {
+        clReleaseProgram(program);
+        return NULL;
+    }
+    return program;
+}
+
+void save_program_binary(cl_program program, uint64_t key) {
+    size_t binary_size = 0;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(binary_size), &binary_size, NULL) != CL_SUCCESS
+        || binary_size == 0)
+        return;
+    unsigned char *binary = (unsigned char*)malloc(binary_size);
+    unsigned char *binaries[1] = {binary};
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL) == CL_SUCCESS) {
+        char path[512];
+        make_dir(PROGRAM_CACHE_DIR);
+        program_cache_path(key, path, sizeof(path));
+        FILE *fp = fopen(path, "wb");
+        if (fp) {
+            uint64_t size64 = binary_size;
+            fwrite(PROGRAM_CACHE_MAGIC, 1, sizeof(PROGRAM_CACHE_MAGIC), fp);
+            fwrite(&key, sizeof(key), 1, fp);
+            fwrite(&size64, sizeof(size64), 1, fp);
+            fwrite(binary, 1, binary_size, fp);
+            fclose(fp);
+        }
+    }
+    free(binary);
+}
+
+// Kernel sources (and the SPIR-V module) compiled into the executable, NULL if absent
+const unsigned char* find_embedded_file(const char *name, size_t *size) {
+#ifdef EMBED_KERNELS
+    for (int i = 0; i < NUM_EMBEDDED_FILES; i++) {
+        if (strcmp(EMBEDDED_FILES[i].name, name) == 0) {
+            *size = EMBEDDED_FILES[i].size;
+            return EMBEDDED_FILES[i].data;
+        }
+    }
+#endif
+    (void)name;
+    (void)size;
+    return NULL;
+}
+
+// Embedded copy first, so a self-contained build never touches the working directory
+char* read_kernel_source(const char* filename, size_t *size) {
+    const unsigned char *embedded = find_embedded_file(filename, size);
+    if (embedded) {
+        char *source = (char*)malloc(*size + 1);
+        memcpy(source, embedded, *size);
+        source[*size] = '\0';
+        return source;
+    }
+
     FILE *fp = fopen(filename, "rb");
     if (!fp) {
         perror("Couldn't open kernel file");
         exit(1);
     }
     fseek(fp, 0, SEEK_END);
-    size_t size = ftell(fp);
+    *size = ftell(fp);
     rewind(fp);
-    char *source = (char*)malloc(size + 1);
-    fread(source, 1, size, fp);
+    char *source = (char*)malloc(*size + 1);
+    fread(source, 1, *size, fp);
     fclose(fp);
-    source[size] = '\0';
+    source[*size] = '\0';
+    return source;
+}
+
+void exit_with_build_log(cl_program program, cl_device_id dev, const char *what) {
+    size_t log_size;
+    clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+    char *log = (char*)malloc(log_size);
+    clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
+    printf("%s error:\n%s\n", what, log);
+    free(log);
+    exit(1);
+}
+
+cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename, const char* options) {
+    size_t size;
+    char *source = read_kernel_source(filename, &size);
+
+    uint64_t key = 0;
+    if (use_program_cache) {
+        key = program_cache_key(dev, source, size, options);
+        cl_program cached = load_cached_program(ctx, dev, key, options);
+        if (cached) {
+            program_cache_hits++;
+            free(source);
+            return cached;
+        }
+        program_cache_misses++;
+    }
 
     cl_program program = clCreateProgramWithSource(ctx, 1, (const char**)&source, &size, NULL);
     free(source);
 
     cl_int err = clBuildProgram(program, 1, &dev, options, NULL, NULL);
-    if (err < 0) {
-        size_t log_size;
-        clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-        char *log = (char*)malloc(log_size);
-        clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
-        printf("Build error:\n%s\n", log);
-        free(log);
-        exit(1);
+    if (err < 0)
+        exit_with_build_log(program, dev, "Build");
+    if (use_program_cache) save_program_binary(program, key);
+    return program;
+}
+
+
+// cl_khr_integer_dot_product queries (CL/cl_ext.h of 2021 and later)
+#ifndef CL_DEVICE_INTEGER_DOT_PRODUCT_CAPABILITIES_KHR
+#define CL_DEVICE_INTEGER_DOT_PRODUCT_CAPABILITIES_KHR 0x1073
+#define CL_DEVICE_INTEGER_DOT_PRODUCT_INPUT_4x8BIT_KHR (1 << 1)
+#endif
+
+/* Whether dot_acc_sat takes uchar4 operands. cl_khr_integer_dot_product only guarantees
+   the packed (uint) form; zncc_dot.cl uses the vector one */
+int device_has_dot_4x8(cl_device_id dev) {
+    cl_bitfield caps = 0;
+    return clGetDeviceInfo(dev, CL_DEVICE_INTEGER_DOT_PRODUCT_CAPABILITIES_KHR, sizeof(caps), &caps, NULL) == CL_SUCCESS
+           && (caps & CL_DEVICE_INTEGER_DOT_PRODUCT_INPUT_4x8BIT_KHR);
+}
+
+/* Kernel files of the pipeline and the per-file compile options. Every stage is linked
+   into one program; to try another variant of a stage, change its file here */
+typedef struct {
+    const char *filename;
+    const char *options;
+    const char *extension;  // optional path of the file, used when the device has this extension
+    const char *define;     // -D switch of that path
+    int (*supports)(cl_device_id);  // further check of the extension's optional features, or NULL
+} pipeline_source;
+
+const char *PIPELINE_HEADER = "zncc_common.h";
+const pipeline_source PIPELINE_SOURCES[] = {
+    {"resize.cl", ""},
+    {"grayscale.cl", ""},
+    {"resize_grayscale.cl", ""},
+    {"zncc_left_optimized.cl", "-cl-fast-relaxed-math -cl-mad-enable"},
+    {"zncc_right_optimized.cl", "-cl-fast-relaxed-math -cl-mad-enable"},
+    {"zncc_bidirectional.cl", "-cl-fast-relaxed-math -cl-mad-enable"},
+    {"cross_check.cl", ""},
+    {"occlusion.cl", ""},
+    {"moving_average.cl", ""},
+    {"normalize.cl", ""},
+    {"median.cl", ""},
+    {"zncc_sliding.cl", "-cl-fast-relaxed-math -cl-mad-enable"},
+    {"zncc_subgroup.cl", "-cl-fast-relaxed-math -cl-mad-enable", "cl_khr_subgroups", "ZNCC_SUBGROUPS"},
+    {"zncc_dot.cl", "-cl-fast-relaxed-math -cl-mad-enable", "cl_khr_integer_dot_product", "ZNCC_DOT_PRODUCT",
+     device_has_dot_4x8},
+};
+#define NUM_PIPELINE_SOURCES ((int)(sizeof(PIPELINE_SOURCES) / sizeof(PIPELINE_SOURCES[0])))
+
+// ZNCC kernels fill their tiles from the original RGBA images (--zncc-from-rgba)
+int zncc_tiles_from_rgba = 0;
+
+// Kernels of the separate ZNCC stage: the optimized ones or a variant (--sliding-zncc,
+// --subgroup-zncc, --dot-zncc)
+enum { ZNCC_OPTIMIZED, ZNCC_SLIDING, ZNCC_SUBGROUP, ZNCC_DOT, NUM_ZNCC_SEPARATE };
+int zncc_separate_variant = ZNCC_OPTIMIZED;
+#define ZNCC_RUN 8     // Pixels per sliding-window run of zncc_sliding.cl; divides LOCAL_WIDTH
+#define ZNCC_LANES 16  // Lanes per pixel of zncc_subgroup.cl without sub-groups; divides the work-group
+
+// Left-to-right and right-to-left kernels and profile name of each separate variant
+const struct { const char *left, *right, *name; } ZNCC_SEPARATE[NUM_ZNCC_SEPARATE] = {
+    {"zncc_disparity_left_optimized", "zncc_disparity_right_optimized", "separate"},
+    {"zncc_disparity_left_sliding", "zncc_disparity_right_sliding", "sliding"},
+    {"zncc_disparity_left_subgroup", "zncc_disparity_right_subgroup", "subgroup"},
+    {"zncc_disparity_left_dot", "zncc_disparity_right_dot", "dot"}
+};
+
+#define NORMALIZE_GROUP 64   // Work-group of min_max_reduce (normalize.cl)
+
+// The pipeline constants, passed once to every kernel as -D options
+void pipeline_constant_options(char *options, size_t size) {
+    snprintf(options, size, "-D WINDOW_SIZE=%u -D MAX_DISP=%u -D LOCAL_WIDTH=%u -D LOCAL_HEIGHT=%u -D FILTER_RADIUS=%u -D RESIZE_SCALE=%u -D NORMALIZE_GROUP=%u -D ZNCC_RUN=%u -D ZNCC_LANES=%u%s",
+             WINDOW_SIZE, MAX_DISP, LOCAL_WIDTH, LOCAL_HEIGHT, FILTER_RADIUS, RESIZE_SCALE, NORMALIZE_GROUP, ZNCC_RUN, ZNCC_LANES,
+             zncc_tiles_from_rgba ? " -D ZNCC_TILES_FROM_RGBA" : "");
+}
+
+/* Build the pipeline from the SPIR-V module compiled offline by `make SPIRV=1`. It is only
+   used when the device consumes SPIR-V and the module was compiled with the same constants
+   as this host; otherwise NULL is returned and the caller builds from source. The module
+   has no extension paths (see extension_options), so the caller skips it on devices that
+   take any */
+cl_program load_embedded_spirv(cl_context ctx, cl_device_id dev, const char *constants) {
+#ifdef CL_VERSION_2_1
+    size_t spirv_size = 0, options_size = 0;
+    const unsigned char *spirv = find_embedded_file("pipeline.spv", &spirv_size);
+    const unsigned char *spirv_options = find_embedded_file("pipeline.spv.options", &options_size);
+    if (!spirv || !spirv_options) return NULL;
+    if (options_size != strlen(constants) || memcmp(spirv_options, constants, options_size) != 0) {
+        printf("Embedded SPIR-V was built with other constants, compiling from source\n");
+        return NULL;
+    }
+
+    char il_version[256] = {0};
+    if (clGetDeviceInfo(dev, CL_DEVICE_IL_VERSION, sizeof(il_version) - 1, il_version, NULL) != CL_SUCCESS
+        || strstr(il_version, "SPIR-V") == NULL)
+        return NULL;
+
+    cl_int err;
+    cl_program program = clCreateProgramWithIL(ctx, spirv, spirv_size, &err);
+    if (err != CL_SUCCESS) return NULL;
+    if (clBuildProgram(program, 1, &dev, NULL, NULL, NULL) != CL_SUCCESS) {
+        clReleaseProgram(program);
+        return NULL;
+    }
+    return program;
+#else
+    (void)ctx;
+    (void)dev;
+    (void)constants;
+    return NULL;
+#endif
+}
+
+// Whether the device lists the extension among CL_DEVICE_EXTENSIONS
+int device_has_extension(cl_device_id dev, const char *name) {
+    size_t size = 0;
+    if (clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, 0, NULL, &size) != CL_SUCCESS || size == 0) return 0;
+    char *extensions = (char *)malloc(size + 1);
+    int found = 0;
+    if (clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, size, extensions, NULL) == CL_SUCCESS) {
+        extensions[size] = '\0';
+        size_t len = strlen(name);
+        // Whole names only: cl_khr_subgroups must not match cl_khr_subgroups_extended
+        for (const char *at = strstr(extensions, name); at && !found; at = strstr(at + 1, name))
+            found = (at == extensions || at[-1] == ' ') && (at[len] == ' ' || at[len] == '\0');
+    }
+    free(extensions);
+    return found;
+}
+
+/* Options that switch a kernel file to its extension path: the file's -D define, and the
+   device's OpenCL C version, since the sub-group and dot-product built-ins need OpenCL C
+   2.0 or later. OpenCL 3.0 devices may report OpenCL C 1.2 there, so their compilers get
+   CL3.0, where the extensions come as optional features.
+   Empty when the file has no such path or the device cannot take it, extension or features */
+void extension_options(cl_device_id dev, const pipeline_source *src, char *options, size_t size) {
+    options[0] = '\0';
+    if (!src->extension || !device_has_extension(dev, src->extension)) return;
+    if (src->supports && !src->supports(dev)) return;
+    char version[128] = {0};
+    int major = 0, minor = 0;
+    if (clGetDeviceInfo(dev, CL_DEVICE_VERSION, sizeof(version) - 1, version, NULL) == CL_SUCCESS
+        && sscanf(version, "OpenCL %d.%d", &major, &minor) == 2 && major >= 3) {
+        major = 3;
+        minor = 0;
+    } else if (clGetDeviceInfo(dev, CL_DEVICE_OPENCL_C_VERSION, sizeof(version) - 1, version, NULL) != CL_SUCCESS
+               || sscanf(version, "OpenCL C %d.%d", &major, &minor) != 2 || major < 2) {
+        return;
+    }
+    snprintf(options, size, " -cl-std=CL%d.%d -D %s", major, minor, src->define);
+}
+
+// Whether the pipeline builds the kernel file with its extension path on this device
+int pipeline_extension_enabled(cl_device_id dev, const char *filename) {
+    char options[128] = "";
+    for (int i = 0; i < NUM_PIPELINE_SOURCES; i++)
+        if (strcmp(PIPELINE_SOURCES[i].filename, filename) == 0)
+            extension_options(dev, &PIPELINE_SOURCES[i], options, sizeof(options));
+    return options[0] != '\0';
+}
+
+// Whether the last pipeline program built or fetched has the kernel file's extension path
+int pipeline_extension_built(const char *filename) {
+    for (int i = 0; i < NUM_PIPELINE_SOURCES; i++)
+        if (strcmp(PIPELINE_SOURCES[i].filename, filename) == 0)
+            return (program_extension_paths >> i) & 1;
+    return 0;
+}
+
+/* Compile every kernel file separately against the shared header with clCompileProgram and
+   link the results with clLinkProgram into one program that holds the whole pipeline. The
+   linked binary goes through the same on-disk cache as build_program, and an embedded
+   SPIR-V module is preferred over compiling the sources when it holds the same program: on
+   a device that takes an extension path the sources are compiled, so the cache key, built
+   from the options, always describes the binary saved under it */
+cl_program build_pipeline_program(cl_context ctx, cl_device_id dev) {
+    char constants[256];
+    pipeline_constant_options(constants, sizeof(constants));
+
+    size_t header_size;
+    char *header = read_kernel_source(PIPELINE_HEADER, &header_size);
+    char *sources[NUM_PIPELINE_SOURCES];
+    size_t sizes[NUM_PIPELINE_SOURCES];
+    char options[NUM_PIPELINE_SOURCES][512];
+
+    // Everything that goes into the program also goes into its cache key
+    size_t key_size = header_size + strlen(constants);
+    unsigned extension_paths = 0;
+    for (int i = 0; i < NUM_PIPELINE_SOURCES; i++) {
+        sources[i] = read_kernel_source(PIPELINE_SOURCES[i].filename, &sizes[i]);
+        char extension[128];
+        extension_options(dev, &PIPELINE_SOURCES[i], extension, sizeof(extension));
+        if (extension[0]) extension_paths |= 1u << i;
+        snprintf(options[i], sizeof(options[i]), "%s %s%s", constants, PIPELINE_SOURCES[i].options, extension);
+        key_size += sizes[i] + strlen(options[i]);
+    }
+    char *key_data = (char*)malloc(key_size + 1);
+    size_t pos = 0;
+    memcpy(key_data + pos, header, header_size); pos += header_size;
+    for (int i = 0; i < NUM_PIPELINE_SOURCES; i++) {
+        memcpy(key_data + pos, sources[i], sizes[i]); pos += sizes[i];
+        memcpy(key_data + pos, options[i], strlen(options[i])); pos += strlen(options[i]);
+    }
+    uint64_t key = program_cache_key(dev, key_data, pos, constants);
+    free(key_data);
+
+    cl_program program = NULL;
+    if (use_program_cache) {
+        program = load_cached_program(ctx, dev, key, NULL);
+        if (program) program_cache_hits++;
+        else program_cache_misses++;
+    }
+    size_t spirv_size;
+    if (program) {
+        program_origin = "program cache";
+    } else if (extension_paths && find_embedded_file("pipeline.spv", &spirv_size)) {
+        printf("Embedded SPIR-V has no extension paths, compiling from source\n");
+    } else if ((program = load_embedded_spirv(ctx, dev, constants)) != NULL) {
+        program_origin = "embedded SPIR-V";
+        extension_paths = 0;   // The module has none
+        if (use_program_cache) save_program_binary(program, key);
+    }
+
+    if (!program) {
+        size_t embedded_size;
+        program_origin = find_embedded_file(PIPELINE_HEADER, &embedded_size) ? "embedded source" : "source files";
+        cl_program header_prog = clCreateProgramWithSource(ctx, 1, (const char**)&header, &header_size, NULL);
+        cl_program compiled[NUM_PIPELINE_SOURCES];
+        for (int i = 0; i < NUM_PIPELINE_SOURCES; i++) {
+            compiled[i] = clCreateProgramWithSource(ctx, 1, (const char**)&sources[i], &sizes[i], NULL);
+            cl_int err = clCompileProgram(compiled[i], 1, &dev, options[i], 1, &header_prog, &PIPELINE_HEADER, NULL, NULL);
+            if (err < 0) {
+                printf("While compiling %s:\n", PIPELINE_SOURCES[i].filename);
+                exit_with_build_log(compiled[i], dev, "Compile");
+            }
+        }
+
+        cl_int err;
+        program = clLinkProgram(ctx, 1, &dev, NULL, NUM_PIPELINE_SOURCES, compiled, NULL, NULL, &err);
+        if (err < 0) {
+            if (program) exit_with_build_log(program, dev, "Link");
+            printf("Link error: %d\n", err);
+            exit(1);
+        }
+        if (use_program_cache) save_program_binary(program, key);
+
+        for (int i = 0; i < NUM_PIPELINE_SOURCES; i++)
+            clReleaseProgram(compiled[i]);
+        clReleaseProgram(header_prog);
+    }
+    program_extension_paths = extension_paths;
+
+    free(header);
+    for (int i = 0; i < NUM_PIPELINE_SOURCES; i++)
+        free(sources[i]);
+    return program;
+}
+
+/* In-process cache of specialized pipeline programs. Each parameter set (window size,
+   disparity range, work-group shape, ...) becomes a different set of -D constants and a
+   different, fully unrolled program; it is built once per process and then shared. The
+   on-disk cache of build_pipeline_program covers later runs */
+#define MAX_SPECIALIZATIONS 32
+typedef struct {
+    cl_context context;
+    cl_device_id device;
+    char constants[256];
+    cl_program program;
+    unsigned extension_paths;   // program_extension_paths of the program
+} pipeline_specialization;
+
+pipeline_specialization specializations[MAX_SPECIALIZATIONS];
+int num_specializations = 0;
+
+// The pipeline program for the current constants; release it with clReleaseProgram
+cl_program get_specialized_pipeline(cl_context ctx, cl_device_id dev) {
+    char constants[256];
+    pipeline_constant_options(constants, sizeof(constants));
+    for (int i = 0; i < num_specializations; i++) {
+        pipeline_specialization *s = &specializations[i];
+        if (s->context == ctx && s->device == dev && strcmp(s->constants, constants) == 0) {
+            program_origin = "in-process cache";
+            program_extension_paths = s->extension_paths;
+            clRetainProgram(s->program);
+            return s->program;
+        }
+    }
+
+    cl_program program = build_pipeline_program(ctx, dev);
+    if (num_specializations < MAX_SPECIALIZATIONS) {
+        pipeline_specialization *s = &specializations[num_specializations++];
+        s->context = ctx;
+        s->device = dev;
+        snprintf(s->constants, sizeof(s->constants), "%s", constants);
+        s->program = program;
+        s->extension_paths = program_extension_paths;
+        clRetainProgram(program);
     }
     return program;
 }
 
+void release_specializations(void) {
+    for (int i = 0; i < num_specializations; i++)
+        clReleaseProgram(specializations[i].program);
+    num_specializations = 0;
+}
+
+// Host counterpart of normalize.cl, for the banded mode's assembled map
 void normalize_occlusion(unsigned char* occlusion_img, int width, int height) {
     unsigned char max_val = 0;
     unsigned char min_val = UCHAR_MAX;
@@ -162,203 +931,1306 @@ void normalize_occlusion(unsigned char* occlusion_img, int width, int height) {
     }
 }
 
+/* One row of the CPU ZNCC matcher. Mirrors zncc_disparity_left_optimized (direction -1,
+   search at x - d) and zncc_disparity_right_optimized (direction +1, search at x + d),
+   each with its kernel's expression order. Window sums are exact integers, so they are
+   built from per-column sums over the 9 window rows, which the compiler vectorizes across x.
+   The kernels' native_rsqrt / rsqrt and fast-relaxed math have no exact host equivalent, so
+   near-ties can still pick another disparity; run_hybrid measures how often */
+void zncc_row_cpu(const unsigned char *ref, const unsigned char *search, unsigned char *out_row,
+                  int width, int y, int direction,
+                  int *col_a, int *col_a2, int *col_b, int *col_b2, int *col_ab,
+                  float *best_zncc) {
+    const int ws = (int)WINDOW_SIZE;
+    const float inv_n = 1.0f / (float)((2 * ws + 1) * (2 * ws + 1));
+
+    for (int x = 0; x < width; x++) {
+        out_row[x] = 0;
+        best_zncc[x] = -INFINITY;
+    }
 
-int main(){
-
-    /*..........Get the DEVICE information................*/
-    // Print device information
-    print_platform_and_device_info();
-
-
+    // Reference window statistics, independent of d
+    #pragma omp simd
+    for (int x = 0; x < width; x++) {
+        int a = 0, a2 = 0;
+        for (int wy = -ws; wy <= ws; wy++) {
+            int v = ref[(y + wy) * width + x];
+            a += v;
+            a2 += v * v;
+        }
+        col_a[x] = a;
+        col_a2[x] = a2;
+    }
 
+    for (int d = 0; d < (int)MAX_DISP; d++) {
+        // Column sums of the search window, clamped at the image border like the kernels
+        #pragma omp simd
+        for (int x = 0; x < width; x++) {
+            int sx = x + direction * d;
+            sx = sx < 0 ? 0 : (sx > width - 1 ? width - 1 : sx);
+            int b = 0, b2 = 0, ab = 0;
+            for (int wy = -ws; wy <= ws; wy++) {
+                int r = search[(y + wy) * width + sx];
+                int l = ref[(y + wy) * width + x];
+                b += r;
+                b2 += r * r;
+                ab += l * r;
+            }
+            col_b[x] = b;
+            col_b2[x] = b2;
+            col_ab[x] = ab;
+        }
 
-    /*...............Load images..........................*/
-    // Load input images
-    unsigned char *im0_data = NULL, *im1_data = NULL;
-    unsigned l_width, l_height, r_width, r_height;
+        // Slide the window horizontally
+        int sum_a = 0, sum_a2 = 0, sum_b = 0, sum_b2 = 0, sum_ab = 0;
+        for (int x = 0; x < 2 * ws; x++) {
+            sum_a += col_a[x]; sum_a2 += col_a2[x];
+            sum_b += col_b[x]; sum_b2 += col_b2[x]; sum_ab += col_ab[x];
+        }
+        for (int x = ws; x < width - ws; x++) {
+            sum_a += col_a[x + ws]; sum_a2 += col_a2[x + ws];
+            sum_b += col_b[x + ws]; sum_b2 += col_b2[x + ws]; sum_ab += col_ab[x + ws];
+
+            int valid = direction < 0 ? (x - d >= 0) : (x + d + ws < width);
+            if (valid) {
+                float var_a = sum_a2 - ((float)sum_a * sum_a) * inv_n;
+                float var_b = sum_b2 - ((float)sum_b * sum_b) * inv_n;
+                // Left kernel: sum_L * sum_R * INV_N; right kernel: sum_R * mean_L
+                float cov = direction < 0 ? sum_ab - ((float)sum_a * sum_b) * inv_n
+                                          : sum_ab - (float)sum_a * (sum_b * inv_n);
+                float zncc = cov * (1.0f / sqrtf(var_a * var_b + 1e-8f));
+                if (zncc > best_zncc[x]) {
+                    best_zncc[x] = zncc;
+                    out_row[x] = (unsigned char)d;
+                }
+            }
+
+            sum_a -= col_a[x - ws]; sum_a2 -= col_a2[x - ws];
+            sum_b -= col_b[x - ws]; sum_b2 -= col_b2[x - ws]; sum_ab -= col_ab[x - ws];
+        }
+    }
+}
 
-    unsigned error = lodepng_decode32_file(&im0_data, &l_width, &l_height, "im0.png");
-    if(error) printf("Error %u: %s\n", error, lodepng_error_text(error));
+/* CPU (OpenMP + SIMD) ZNCC matcher for rows [y_begin, y_end) of both disparity maps.
+   Border pixels are zero, as in the OpenCL kernels */
+void zncc_disparity_cpu(const unsigned char *left, const unsigned char *right,
+                        unsigned char *disp_left, unsigned char *disp_right,
+                        int width, int height, int y_begin, int y_end) {
+    const int ws = (int)WINDOW_SIZE;
+    double start = omp_get_wtime();
+
+    #pragma omp parallel
+    {
+        int *cols = (int*)malloc(5 * width * sizeof(int));
+        float *best_zncc = (float*)malloc(width * sizeof(float));
+
+        #pragma omp for schedule(dynamic)
+        for (int y = y_begin; y < y_end; y++) {
+            if (y < ws || y >= height - ws) {
+                memset(disp_left + y * width, 0, width);
+                memset(disp_right + y * width, 0, width);
+                continue;
+            }
+            zncc_row_cpu(left, right, disp_left + y * width, width, y, -1,
+                         cols, cols + width, cols + 2 * width, cols + 3 * width, cols + 4 * width, best_zncc);
+            zncc_row_cpu(right, left, disp_right + y * width, width, y, +1,
+                         cols, cols + width, cols + 2 * width, cols + 3 * width, cols + 4 * width, best_zncc);
+        }
 
-    error = lodepng_decode32_file(&im1_data, &r_width, &r_height, "im1.png");
-    if(error) printf("Error %u: %s\n", error, lodepng_error_text(error));
+        free(cols);
+        free(best_zncc);
+    }
+    trace_host_span("CPU ZNCC", NULL, start);
+}
 
-    //Check if your image loaded correctly
-    printf("Loaded left image: %ux%u\n", l_width, l_height);
-    printf("Loaded right image: %ux%u\n", r_width, r_height);
-    if(l_width != ORIG_WIDTH || l_height != ORIG_HEIGHT) {
-        printf("Error: Left image has incorrect dimensions!\n");
-        exit(1);
+/* Host-side resize, the same sampling as resize.cl: every RESIZE_SCALE-th pixel of every
+   RESIZE_SCALE-th row. Runs while copying into the (pinned) staging buffer so only the 735x504 image is
+   uploaded */
+void decimate_rgba_cpu(const unsigned char *src, unsigned char *dst) {
+    double start = omp_get_wtime();
+    #pragma omp parallel for
+    for (int y = 0; y < (int)HEIGHT; y++) {
+        int src_y = y * RESIZE_SCALE < ORIG_HEIGHT ? y * RESIZE_SCALE : ORIG_HEIGHT - 1;
+        const unsigned char *row = src + (size_t)src_y * ORIG_WIDTH * 4;
+        unsigned char *out = dst + (size_t)y * WIDTH * 4;
+        #pragma omp simd
+        for (int x = 0; x < (int)WIDTH; x++) {
+            int src_x = x * RESIZE_SCALE < ORIG_WIDTH ? x * RESIZE_SCALE : ORIG_WIDTH - 1;
+            memcpy(out + x * 4, row + src_x * 4, 4);
+        }
     }
+    trace_host_span("Host decimation", NULL, start);
+}
 
+// Host-side resize + grayscale, the same weights as grayscale.cl
+void decimate_gray_cpu(const unsigned char *src, unsigned char *dst) {
+    double start = omp_get_wtime();
+    #pragma omp parallel for
+    for (int y = 0; y < (int)HEIGHT; y++) {
+        int src_y = y * RESIZE_SCALE < ORIG_HEIGHT ? y * RESIZE_SCALE : ORIG_HEIGHT - 1;
+        const unsigned char *row = src + (size_t)src_y * ORIG_WIDTH * 4;
+        unsigned char *out = dst + (size_t)y * WIDTH;
+        #pragma omp simd
+        for (int x = 0; x < (int)WIDTH; x++) {
+            int src_x = x * RESIZE_SCALE < ORIG_WIDTH ? x * RESIZE_SCALE : ORIG_WIDTH - 1;
+            const unsigned char *p = row + src_x * 4;
+            out[x] = (unsigned char)(0.2125f * p[0] + 0.7152f * p[1] + 0.0722f * p[2]);
+        }
+    }
+    trace_host_span("Host decimation", NULL, start);
+}
 
 
-    /*................Prepare the DEVICE for input.....................*/
-    // Create device, context and queues
-    cl_device_id device = create_device();
-    cl_context context = clCreateContext(NULL, 1, &device, NULL, NULL, NULL);
-    cl_queue_properties queue_props[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 // Terminator
-    };
-    cl_command_queue queue = clCreateCommandQueueWithProperties(context, device, queue_props, NULL);
+// All kernels of the pipeline, built once and shared by the execution modes
+typedef struct {
+    cl_program program;
+    cl_kernel resize_kernel, gray_kernel, resize_gray_kernel;
+    cl_kernel zncc_left_to_right_kernel, zncc_right_to_left_kernel, zncc_bidirectional_kernel;
+    cl_kernel cross_check_kernel, occlusion_seed_kernel, occlusion_flood_kernel, occlusion_kernel,
+              occlusion_ring_kernel, filter_kernel;
+    cl_kernel min_max_kernel, normalize_kernel, median_kernel;
+} pipeline_kernels;
+
+void create_pipeline_kernels(cl_context context, cl_device_id device, pipeline_kernels *k) {
+    k->program = get_specialized_pipeline(context, device);
+
+    k->resize_kernel = clCreateKernel(k->program, "resize", NULL);
+    k->gray_kernel = clCreateKernel(k->program, "rgba_to_grayscale", NULL);
+    k->resize_gray_kernel = clCreateKernel(k->program, "resize_grayscale", NULL);
+    k->zncc_left_to_right_kernel = clCreateKernel(k->program, ZNCC_SEPARATE[zncc_separate_variant].left, NULL);
+    k->zncc_right_to_left_kernel = clCreateKernel(k->program, ZNCC_SEPARATE[zncc_separate_variant].right, NULL);
+    k->zncc_bidirectional_kernel = clCreateKernel(k->program, "zncc_bidirectional", NULL);
+    k->cross_check_kernel = clCreateKernel(k->program, "cross_check", NULL);
+    k->occlusion_seed_kernel = clCreateKernel(k->program, "occlusion_seed", NULL);
+    k->occlusion_flood_kernel = clCreateKernel(k->program, "occlusion_jump_flood", NULL);
+    k->occlusion_kernel = clCreateKernel(k->program, "occlusion_filling", NULL);
+    k->occlusion_ring_kernel = clCreateKernel(k->program, "occlusion_ring_fill", NULL);
+    k->filter_kernel = clCreateKernel(k->program, "moving_average_5x5", NULL);
+    k->min_max_kernel = clCreateKernel(k->program, "min_max_reduce", NULL);
+    k->normalize_kernel = clCreateKernel(k->program, "normalize_map", NULL);
+    k->median_kernel = clCreateKernel(k->program, "weighted_median", NULL);
+}
 
-    // Create buffers
-    cl_mem im0_buf = clCreateBuffer(context, CL_MEM_READ_ONLY, l_width*l_height*4, NULL, NULL);
-    cl_mem im1_buf = clCreateBuffer(context, CL_MEM_READ_ONLY, r_width*r_height*4, NULL, NULL);
+void release_pipeline_kernels(pipeline_kernels *k) {
+    clReleaseKernel(k->resize_kernel);
+    clReleaseKernel(k->gray_kernel);
+    clReleaseKernel(k->resize_gray_kernel);
+    clReleaseKernel(k->zncc_left_to_right_kernel);
+    clReleaseKernel(k->zncc_right_to_left_kernel);
+    clReleaseKernel(k->zncc_bidirectional_kernel);
+    clReleaseKernel(k->cross_check_kernel);
+    clReleaseKernel(k->occlusion_seed_kernel);
+    clReleaseKernel(k->occlusion_flood_kernel);
+    clReleaseKernel(k->occlusion_kernel);
+    clReleaseKernel(k->occlusion_ring_kernel);
+    clReleaseKernel(k->filter_kernel);
+    clReleaseKernel(k->min_max_kernel);
+    clReleaseKernel(k->normalize_kernel);
+    clReleaseKernel(k->median_kernel);
+
+    clReleaseProgram(k->program);
+}
 
-    
-    
-    
-    /*....................Transfer data from HOST to the DEVICE..................*/
-    // Transfer the left and the right images to the DEVICE
-    cl_event write_events[2];
-    clEnqueueWriteBuffer(queue, im0_buf, CL_TRUE, 0, l_width*l_height*4, im0_data, 0, NULL, &write_events[0]);
-    clEnqueueWriteBuffer(queue, im1_buf, CL_TRUE, 0, r_width*r_height*4, im1_data, 0, NULL, &write_events[1]);
+// Scratch of the occlusion fill: the seed ping-pong pair and the hole list, for `rows` rows
+typedef struct {
+    cl_mem seeds[2];
+    cl_mem holes, hole_count;
+} fill_buffers;
+
+void create_fill_buffers(cl_context context, unsigned rows, fill_buffers *f) {
+    size_t bytes = (size_t)WIDTH * rows * sizeof(cl_uint);
+    f->seeds[0] = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL, NULL);
+    f->seeds[1] = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL, NULL);
+    f->holes = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL, NULL);
+    f->hole_count = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, NULL);
+}
 
-    
-    /*...........Image RESIZING using kernel and DEVICE..................*/
-    // This variables are common for both image resize operation
-    cl_program resize_prog = build_program(context, device, "resize.cl", NULL);
-    cl_kernel resize_kernel = clCreateKernel(resize_prog, "resize", NULL);
-    cl_mem resized_left_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY, WIDTH*HEIGHT*4, NULL, NULL);
-    cl_mem resized_right_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY, WIDTH * HEIGHT * 4, NULL, NULL);
-    cl_event resize_events[2];
-    size_t global_size_resize[2] = {WIDTH, HEIGHT};
+void release_fill_buffers(fill_buffers *f) {
+    clReleaseMemObject(f->seeds[0]);
+    clReleaseMemObject(f->seeds[1]);
+    clReleaseMemObject(f->holes);
+    clReleaseMemObject(f->hole_count);
+}
 
-    //Resize left image (im0.png)
-    clSetKernelArg(resize_kernel, 0, sizeof(cl_mem), &im0_buf);
-    clSetKernelArg(resize_kernel, 1, sizeof(cl_mem), &resized_left_buf);
-    clSetKernelArg(resize_kernel, 2, sizeof(int), &ORIG_WIDTH);
-    clSetKernelArg(resize_kernel, 3, sizeof(int), &ORIG_HEIGHT);
-    clEnqueueNDRangeKernel(queue, resize_kernel, 2, NULL, global_size_resize, NULL, 0, NULL, &resize_events[0]);
+// Work-items the device runs at once, roughly: one full work-group per compute unit
+size_t device_slots(cl_command_queue queue) {
+    cl_device_id dev;
+    cl_uint compute_units = 1;
+    size_t max_work_group = 1;
+    clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(dev), &dev, NULL);
+    clGetDeviceInfo(dev, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
+    clGetDeviceInfo(dev, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_work_group), &max_work_group, NULL);
+    return (size_t)compute_units * max_work_group;
+}
 
+/* Occlusion fill (occlusion.cl) of a map `rows` high: seed, jump-flooding passes, then the
+   fill. The first step is the largest power of two within MAX_SEARCH_RADIUS, since further
+   seeds are never used. A final extra pass at step 1 corrects most of jump flooding's misses,
+   not all of them: the fill approximates the nearest-valid-pixel search.
+   With `compact` the seed kernel builds the hole list and the passes and the fill run over it,
+   with one work-item per compute unit slot (CL_DEVICE_MAX_COMPUTE_UNITS * max work-group)
+   striding through the list; the hole count stays on the device. Without, they cover every
+   pixel. All commands go to one in-order queue. first and done receive the first and the
+   last command's event when not NULL. Returns the number of jump-flooding passes */
+unsigned enqueue_occlusion_fill(cl_command_queue queue, pipeline_kernels *k, cl_mem disparity, fill_buffers *f,
+                                cl_mem filled, unsigned rows, int compact,
+                                cl_uint num_wait, const cl_event *wait, cl_event *first, cl_event *done) {
+    static const cl_uint zero = 0;
+    size_t pixels = (size_t)WIDTH * rows;
+    size_t list_size = pixels;
+    cl_mem holes = NULL;
+    if (compact) {
+        if (device_slots(queue) < list_size) list_size = device_slots(queue);
+        holes = f->holes;
+        traced_enqueue_write_buffer(queue, f->hole_count, CL_FALSE, 0, sizeof(zero), &zero, num_wait, wait, first);
+        num_wait = 0;
+        wait = NULL;
+        first = NULL;
+    }
 
-    //Resize right image (im1.png)
-    clSetKernelArg(resize_kernel, 0, sizeof(cl_mem), &im1_buf);
-    clSetKernelArg(resize_kernel, 1, sizeof(cl_mem), &resized_right_buf);
-    clSetKernelArg(resize_kernel, 2, sizeof(int), &ORIG_WIDTH);
-    clSetKernelArg(resize_kernel, 3, sizeof(int), &ORIG_HEIGHT);
-    clEnqueueNDRangeKernel(queue, resize_kernel, 2, NULL, global_size_resize, NULL, 0, NULL, &resize_events[1]);
+    size_t global_size_all[2] = {WIDTH, rows};
+    clSetKernelArg(k->occlusion_seed_kernel, 0, sizeof(cl_mem), &disparity);
+    clSetKernelArg(k->occlusion_seed_kernel, 1, sizeof(cl_mem), &f->seeds[0]);
+    clSetKernelArg(k->occlusion_seed_kernel, 2, sizeof(cl_mem), &f->seeds[1]);
+    clSetKernelArg(k->occlusion_seed_kernel, 3, sizeof(cl_mem), &filled);
+    clSetKernelArg(k->occlusion_seed_kernel, 4, sizeof(cl_mem), &holes);
+    clSetKernelArg(k->occlusion_seed_kernel, 5, sizeof(cl_mem), &f->hole_count);
+    clSetKernelArg(k->occlusion_seed_kernel, 6, sizeof(int), &WIDTH);
+    clSetKernelArg(k->occlusion_seed_kernel, 7, sizeof(int), &rows);
+    traced_enqueue_ndrange_kernel(queue, k->occlusion_seed_kernel, 2, NULL, global_size_all, NULL, num_wait, wait, first);
+
+    unsigned reach = (WIDTH > rows ? WIDTH : rows) - 1;
+    if (reach > MAX_SEARCH_RADIUS) reach = MAX_SEARCH_RADIUS;
+    int first_step = 1;
+    while ((unsigned)first_step * 2 <= reach) first_step *= 2;
+
+    // Steps first_step, ..., 2, 1, then 1 again
+    unsigned passes = 2;
+    for (int step = first_step; step > 1; step /= 2) passes++;
+    for (unsigned i = 0; i < passes; i++) {
+        int step = (first_step >> i) > 1 ? first_step >> i : 1;
+        clSetKernelArg(k->occlusion_flood_kernel, 0, sizeof(cl_mem), &f->seeds[i % 2]);
+        clSetKernelArg(k->occlusion_flood_kernel, 1, sizeof(cl_mem), &f->seeds[(i + 1) % 2]);
+        clSetKernelArg(k->occlusion_flood_kernel, 2, sizeof(cl_mem), &holes);
+        clSetKernelArg(k->occlusion_flood_kernel, 3, sizeof(cl_mem), &f->hole_count);
+        clSetKernelArg(k->occlusion_flood_kernel, 4, sizeof(int), &WIDTH);
+        clSetKernelArg(k->occlusion_flood_kernel, 5, sizeof(int), &rows);
+        clSetKernelArg(k->occlusion_flood_kernel, 6, sizeof(int), &step);
+        traced_enqueue_ndrange_kernel(queue, k->occlusion_flood_kernel, 1, NULL, &list_size, NULL, 0, NULL, NULL);
+    }
 
+    clSetKernelArg(k->occlusion_kernel, 0, sizeof(cl_mem), &disparity);
+    clSetKernelArg(k->occlusion_kernel, 1, sizeof(cl_mem), &f->seeds[passes % 2]);
+    clSetKernelArg(k->occlusion_kernel, 2, sizeof(cl_mem), &holes);
+    clSetKernelArg(k->occlusion_kernel, 3, sizeof(cl_mem), &f->hole_count);
+    clSetKernelArg(k->occlusion_kernel, 4, sizeof(cl_mem), &filled);
+    clSetKernelArg(k->occlusion_kernel, 5, sizeof(int), &WIDTH);
+    clSetKernelArg(k->occlusion_kernel, 6, sizeof(int), &rows);
+    clSetKernelArg(k->occlusion_kernel, 7, sizeof(int), &MAX_SEARCH_RADIUS);
+    traced_enqueue_ndrange_kernel(queue, k->occlusion_kernel, 1, NULL, &list_size, NULL, 0, NULL, done);
+    return passes;
+}
 
-    // Read back resized image
-    unsigned char *resized_left_img = (unsigned char*)malloc(WIDTH*HEIGHT*4);
-    unsigned char *resized_right_img = (unsigned char*)malloc(WIDTH * HEIGHT * 4);
-    cl_event read_resize_events[2];
+/* Min/max normalization of a map on the device (normalize.cl), in place. The map is a
+   buffer, or an SVM allocation when svm_map is not NULL. min_max is a 2-uint scratch buffer.
+   first and done receive the first and the last command's event when not NULL */
+
+void enqueue_normalize(cl_command_queue queue, pipeline_kernels *k, cl_mem map, void *svm_map, cl_mem min_max,
+                       cl_uint num_wait, const cl_event *wait, cl_event *first, cl_event *done) {
+    static const cl_uint min_max_init[2] = {255, 0};
+    cl_uint pixels = WIDTH * HEIGHT;
+    traced_enqueue_write_buffer(queue, min_max, CL_FALSE, 0, sizeof(min_max_init), min_max_init, num_wait, wait, first);
+
+    // Enough groups to fill the device, each striding through the map
+    size_t local_size = NORMALIZE_GROUP;
+    size_t reduce_size = device_slots(queue);
+    if (reduce_size > pixels) reduce_size = pixels;
+    reduce_size = (reduce_size + NORMALIZE_GROUP - 1) / NORMALIZE_GROUP * NORMALIZE_GROUP;
+    if (svm_map)
+        clSetKernelArgSVMPointer(k->min_max_kernel, 0, svm_map);
+    else
+        clSetKernelArg(k->min_max_kernel, 0, sizeof(cl_mem), &map);
+    clSetKernelArg(k->min_max_kernel, 1, sizeof(cl_uint), &pixels);
+    clSetKernelArg(k->min_max_kernel, 2, sizeof(cl_mem), &min_max);
+    traced_enqueue_ndrange_kernel(queue, k->min_max_kernel, 1, NULL, &reduce_size, &local_size, 0, NULL, NULL);
+
+    size_t global_size = pixels;
+    if (svm_map) {
+        clSetKernelArgSVMPointer(k->normalize_kernel, 0, svm_map);
+        clSetKernelArgSVMPointer(k->normalize_kernel, 1, svm_map);
+    } else {
+        clSetKernelArg(k->normalize_kernel, 0, sizeof(cl_mem), &map);
+        clSetKernelArg(k->normalize_kernel, 1, sizeof(cl_mem), &map);
+    }
+    clSetKernelArg(k->normalize_kernel, 2, sizeof(cl_mem), &min_max);
+    clSetKernelArg(k->normalize_kernel, 3, sizeof(cl_uint), &pixels);
+    traced_enqueue_ndrange_kernel(queue, k->normalize_kernel, 1, NULL, &global_size, NULL, 0, NULL, done);
+}
 
-    clEnqueueReadBuffer(queue, resized_left_buf, CL_TRUE, 0, WIDTH*HEIGHT*4, resized_left_img, 0, NULL, &read_resize_events[0]);
-    clEnqueueReadBuffer(queue, resized_right_buf, CL_TRUE, 0, WIDTH*HEIGHT*4, resized_right_img, 0, NULL, &read_resize_events[1]);
-    
-    lodepng_encode32_file("output/resized_left.png", resized_left_img, WIDTH, HEIGHT);
-    lodepng_encode32_file("output/resized_right.png", resized_right_img, WIDTH, HEIGHT);
+// Smoothing of the filled map: the moving average, or the weighted median with --median
+int use_median_filter = 0;
+
+/* Smooth rows [row0, row0 + row_count) of the `rows` high map in into out, or into the SVM
+   allocation svm_out when it is not NULL. The weighted median (median.cl) runs in ZNCC-sized
+   work-groups over its local tiles, rounded up past the map; the moving average lets the
+   driver choose. done receives the launch's event when not NULL */
+void enqueue_smoothing(cl_command_queue queue, pipeline_kernels *k, cl_mem in, cl_mem out, void *svm_out,
+                       unsigned rows, unsigned row0, unsigned row_count,
+                       cl_uint num_wait, const cl_event *wait, cl_event *done) {
+    cl_kernel kernel = use_median_filter ? k->median_kernel : k->filter_kernel;
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), &in);
+    if (svm_out)
+        clSetKernelArgSVMPointer(kernel, 1, svm_out);
+    else
+        clSetKernelArg(kernel, 1, sizeof(cl_mem), &out);
+    clSetKernelArg(kernel, 2, sizeof(int), &WIDTH);
+    clSetKernelArg(kernel, 3, sizeof(int), &rows);
+
+    size_t offset[2] = {0, row0};
+    size_t global_size[2] = {WIDTH, row_count};
+    if (use_median_filter) {
+        size_t local_size[2] = {LOCAL_WIDTH, LOCAL_HEIGHT};
+        global_size[0] = (global_size[0] + LOCAL_WIDTH - 1) / LOCAL_WIDTH * LOCAL_WIDTH;
+        global_size[1] = (global_size[1] + LOCAL_HEIGHT - 1) / LOCAL_HEIGHT * LOCAL_HEIGHT;
+        traced_enqueue_ndrange_kernel(queue, kernel, 2, offset, global_size, local_size, num_wait, wait, done);
+    } else {
+        traced_enqueue_ndrange_kernel(queue, kernel, 2, offset, global_size, NULL, num_wait, wait, done);
+    }
+}
 
+/* Occlusion fill cost against the hole fraction (--fill-benchmark). The first map is the
+   frame's own cross-checked map. The others punch random holes into the frame's filled
+   map, so their holes are scattered pixels rather than the occluded bands of a real scene.
+   Each map is filled over every pixel and over the hole list; the best of FILL_BENCH_RUNS
+   device times is kept */
+#define FILL_BENCH_RUNS 5
+
+void run_fill_benchmark(cl_context context, cl_command_queue queue, pipeline_kernels *k,
+                        const unsigned char *cross_checked) {
+    static const double fractions[] = {0.0, 0.01, 0.05, 0.10, 0.25, 0.50};   // 0: the frame itself
+    size_t pixels = (size_t)WIDTH * HEIGHT;
+    unsigned char *map = (unsigned char*)malloc(pixels);
+    cl_mem map_buf = clCreateBuffer(context, CL_MEM_READ_ONLY, pixels, NULL, NULL);
+    cl_mem out_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, pixels, NULL, NULL);
+    fill_buffers fill;
+    create_fill_buffers(context, HEIGHT, &fill);
+
+    // The frame's filled map, the base of the added hole fractions
+    unsigned char *filled = (unsigned char*)malloc(pixels);
+    traced_enqueue_write_buffer(queue, map_buf, CL_FALSE, 0, pixels, cross_checked, 0, NULL, NULL);
+    enqueue_occlusion_fill(queue, k, map_buf, &fill, out_buf, HEIGHT, 1, 0, NULL, NULL, NULL);
+    traced_enqueue_read_buffer(queue, out_buf, CL_TRUE, 0, pixels, filled, 0, NULL, NULL);
+
+    printf("\nOcclusion fill against the hole fraction (best of %d runs)\n", FILL_BENCH_RUNS);
+    printf("%-16s %8s %12s %14s %8s\n", "map", "holes", "dense ms", "compacted ms", "speedup");
+    srand(1);
+    for (size_t f = 0; f < sizeof(fractions) / sizeof(fractions[0]); f++) {
+        if (fractions[f] == 0.0) {
+            memcpy(map, cross_checked, pixels);
+        } else {
+            memcpy(map, filled, pixels);
+            for (size_t i = 0; i < pixels; i++)
+                if (rand() < fractions[f] * ((double)RAND_MAX + 1.0)) map[i] = 0;
+        }
+        size_t holes = 0;
+        for (size_t i = 0; i < pixels; i++) holes += map[i] == 0;
+        traced_enqueue_write_buffer(queue, map_buf, CL_TRUE, 0, pixels, map, 0, NULL, NULL);
+
+        double best_ms[2] = {1e30, 1e30};
+        for (int compact = 0; compact < 2; compact++) {
+            for (int run = 0; run < FILL_BENCH_RUNS; run++) {
+                cl_event first, done;
+                cl_ulong start, end;
+                enqueue_occlusion_fill(queue, k, map_buf, &fill, out_buf, HEIGHT, compact, 0, NULL, &first, &done);
+                clWaitForEvents(1, &done);
+                clGetEventProfilingInfo(first, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+                clGetEventProfilingInfo(done, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+                if ((end - start) * 1e-6 < best_ms[compact]) best_ms[compact] = (end - start) * 1e-6;
+                clReleaseEvent(first);
+                clReleaseEvent(done);
+            }
+        }
 
+        char label[32];
+        if (fractions[f] == 0.0)
+            snprintf(label, sizeof(label), "frame");
+        else
+            snprintf(label, sizeof(label), "filled + %.0f%%", fractions[f] * 100.0);
+        printf("%-16s %7.1f%% %12.3f %14.3f %7.2fx\n", label, 100.0 * holes / pixels,
+               best_ms[0], best_ms[1], best_ms[0] / best_ms[1]);
+    }
 
+    release_fill_buffers(&fill);
+    clReleaseMemObject(map_buf);
+    clReleaseMemObject(out_buf);
+    free(filled);
+    free(map);
+}
 
+/* Resource report of the built kernels (--kernel-report). The static part comes from
+   clGetKernelWorkGroupInfo and the device limits. OpenCL does not expose register counts, so
+   private memory is what the compiler reports per work-item (usually spills and stack).
+   Occupancy is an estimate: a compute unit is assumed to hold at most
+   CL_DEVICE_MAX_WORK_GROUP_SIZE work-items, and local memory caps the resident work-groups */
+void print_kernel_resources(pipeline_kernels *k, cl_device_id dev) {
+    cl_ulong device_local_mem = 0;
+    size_t device_max_work_group = 0;
+    cl_uint compute_units = 0, clock_mhz = 0;
+    clGetDeviceInfo(dev, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(device_local_mem), &device_local_mem, NULL);
+    clGetDeviceInfo(dev, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(device_max_work_group), &device_max_work_group, NULL);
+    clGetDeviceInfo(dev, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
+    clGetDeviceInfo(dev, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(clock_mhz), &clock_mhz, NULL);
+
+    // Work-group of each launch; 0 = chosen by the driver
+    const size_t zncc_group = (size_t)LOCAL_WIDTH * LOCAL_HEIGHT;
+    struct { const char *name; cl_kernel kernel; size_t work_group; } kernels[] = {
+        {"resize", k->resize_kernel, 0},
+        {"rgba_to_grayscale", k->gray_kernel, 0},
+        {"resize_grayscale", k->resize_gray_kernel, 0},
+        {ZNCC_SEPARATE[zncc_separate_variant].left, k->zncc_left_to_right_kernel, zncc_group},
+        {ZNCC_SEPARATE[zncc_separate_variant].right, k->zncc_right_to_left_kernel, zncc_group},
+        {"zncc_bidirectional", k->zncc_bidirectional_kernel, zncc_group},
+        {"cross_check", k->cross_check_kernel, 0},
+        {"occlusion_seed", k->occlusion_seed_kernel, 0},
+        {"occlusion_jump_flood", k->occlusion_flood_kernel, 0},
+        {"occlusion_filling", k->occlusion_kernel, 0},
+        {"occlusion_ring_fill", k->occlusion_ring_kernel, 0},
+        {"moving_average_5x5", k->filter_kernel, 0},
+        {"min_max_reduce", k->min_max_kernel, NORMALIZE_GROUP},
+        {"normalize_map", k->normalize_kernel, 0},
+        {"weighted_median", k->median_kernel, zncc_group},
+    };
 
+    printf("\nKernel resources (device: %u compute units at %u MHz, %llu KB local memory, work-groups up to %zu)\n",
+           compute_units, clock_mhz, (unsigned long long)(device_local_mem / 1024), device_max_work_group);
+    printf("%-32s %8s %8s %10s %10s %8s %8s %9s\n", "kernel", "max wg", "wg mult", "local B", "private B",
+           "launch", "wg/CU", "occupancy");
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        size_t max_work_group = 0, multiple = 0;
+        cl_ulong local_mem = 0, private_mem = 0;
+        clGetKernelWorkGroupInfo(kernels[i].kernel, dev, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_work_group), &max_work_group, NULL);
+        clGetKernelWorkGroupInfo(kernels[i].kernel, dev, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(multiple), &multiple, NULL);
+        clGetKernelWorkGroupInfo(kernels[i].kernel, dev, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(local_mem), &local_mem, NULL);
+        clGetKernelWorkGroupInfo(kernels[i].kernel, dev, CL_KERNEL_PRIVATE_MEM_SIZE, sizeof(private_mem), &private_mem, NULL);
+
+        printf("%-32s %8zu %8zu %10llu %10llu ", kernels[i].name, max_work_group, multiple,
+               (unsigned long long)local_mem, (unsigned long long)private_mem);
+        size_t work_group = kernels[i].work_group;
+        if (work_group == 0 || device_max_work_group == 0) {
+            printf("%8s %8s %9s\n", "auto", "-", "-");
+            continue;
+        }
+        size_t by_threads = device_max_work_group / work_group;
+        size_t by_local = local_mem ? (size_t)(device_local_mem / local_mem) : by_threads;
+        size_t resident = by_threads < by_local ? by_threads : by_local;
+        double occupancy = (double)(resident * work_group) / device_max_work_group;
+        printf("%8zu %8zu %8.0f%%%s\n", work_group, resident, occupancy * 100.0,
+               work_group > max_work_group ? "  exceeds kernel limit" : "");
+    }
+}
 
-    /*.............Convert RGBA image to Grayscale image............*/
-    // Convert to grayscale
-    cl_program gray_prog = build_program(context, device, "grayscale.cl", NULL);
-    cl_kernel gray_kernel = clCreateKernel(gray_prog, "rgba_to_grayscale", NULL);
-    cl_mem gray_left_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY, WIDTH*HEIGHT, NULL, NULL); // Single channel
-    cl_mem gray_right_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY, WIDTH*HEIGHT, NULL, NULL); // Single channel
-    size_t global_size_gray[2] = {WIDTH, HEIGHT};
-    cl_event gray_events[2];
+// Modelled global traffic and arithmetic of one launch, set against its measured time
+typedef struct {
+    double bytes;   // global memory read + written
+    double flops;   // arithmetic of the algorithm, 0 when data-dependent
+} launch_work;
+
+launch_work zncc_launch_work(int fused) {
+    const double pixels = (double)WIDTH * HEIGHT;
+    const double window = (2.0 * WINDOW_SIZE + 1) * (2.0 * WINDOW_SIZE + 1);
+    const double groups = (double)((WIDTH + LOCAL_WIDTH - 1) / LOCAL_WIDTH) * ((HEIGHT + LOCAL_HEIGHT - 1) / LOCAL_HEIGHT);
+    const double tile_height = LOCAL_HEIGHT + 2.0 * WINDOW_SIZE;
+    const double tile_width = LOCAL_WIDTH + 2.0 * WINDOW_SIZE;
+    const double bytes_per_pixel = zncc_tiles_from_rgba ? 4.0 : 1.0;
+    const double ext = MAX_DISP - 1.0;
+    launch_work w;
+    if (fused) {
+        // Both tiles once, window statistics once per centre, one multiply-add sum per candidate
+        // in each direction
+        w.bytes = groups * tile_height * (2.0 * tile_width + 3.0 * ext) * bytes_per_pixel + pixels;
+        w.flops = groups * LOCAL_HEIGHT * (2.0 * LOCAL_WIDTH + 3.0 * ext) * 3.0 * window
+                + pixels * 2.0 * MAX_DISP * (2.0 * window + 8.0);
+    } else if (zncc_separate_variant == ZNCC_SLIDING) {
+        // Same tiles; the search window sums once per tile (column and row slides of R and
+        // R^2); per pixel and candidate, the run's share of the L*R column updates (two
+        // multiply-adds per row, a window's height at the start of each block column), the
+        // sliding update and the final formulas
+        const double columns = (ZNCC_RUN + 2.0 * WINDOW_SIZE) / ZNCC_RUN;
+        const double side = 2.0 * WINDOW_SIZE + 1;
+        const double column_rows = (side + 2.0 * (LOCAL_HEIGHT - 1)) / LOCAL_HEIGHT;
+        w.bytes = groups * tile_height * (2.0 * tile_width + MAX_DISP) * bytes_per_pixel + pixels;
+        w.flops = pixels * 3.0 * columns * side
+                + groups * (tile_width + MAX_DISP) * LOCAL_HEIGHT * 6.0 * 2.0
+                + pixels * MAX_DISP * (columns * 2.0 * column_rows + 2.0 + 8.0);
+    } else {
+        // Left and right tiles per group, three sums per candidate (the subgroup kernels only
+        // spread the candidates over lanes, the dot kernels pack them in integers)
+        w.bytes = groups * tile_height * (2.0 * tile_width + MAX_DISP) * bytes_per_pixel + pixels;
+        w.flops = pixels * (3.0 * window + MAX_DISP * (5.0 * window + 8.0));
+    }
+    return w;
+}
 
-    clSetKernelArg(gray_kernel, 0, sizeof(cl_mem), &resized_left_buf);
-    clSetKernelArg(gray_kernel, 1, sizeof(cl_mem), &gray_left_buf);
-    clEnqueueNDRangeKernel(queue, gray_kernel, 2, NULL, global_size_gray, NULL, 1, &resize_events[0], &gray_events[0]);
+// A chain of launches, from the start of `first` to the end of `last`
+void print_launch_span(const char *name, cl_event first, cl_event last, launch_work w) {
+    cl_ulong start, end;
+    clGetEventProfilingInfo(first, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+    clGetEventProfilingInfo(last, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+    double seconds = (end - start) * 1e-9;
+    printf("%-32s %9.3f %9.2f %9.2f", name, seconds * 1e3, w.bytes / 1e6, seconds > 0 ? w.bytes / seconds / 1e9 : 0.0);
+    if (w.flops > 0)
+        printf(" %9.3f %9.2f\n", w.flops / 1e9, seconds > 0 ? w.flops / seconds / 1e9 : 0.0);
+    else
+        printf(" %9s %9s\n", "-", "-");
+}
 
-    clSetKernelArg(gray_kernel, 0, sizeof(cl_mem), &resized_right_buf);
-    clSetKernelArg(gray_kernel, 1, sizeof(cl_mem), &gray_right_buf);
-    clEnqueueNDRangeKernel(queue, gray_kernel, 2, NULL, global_size_gray, NULL, 1, &resize_events[0], &gray_events[1]);
+void print_launch_work(const char *name, cl_event event, launch_work w) {
+    print_launch_span(name, event, event, w);
+}
 
-    // Read grayscale
-    unsigned char *gray_left_img = (unsigned char*)malloc(WIDTH*HEIGHT);
-    unsigned char *gray_right_img = (unsigned char*)malloc(WIDTH*HEIGHT);
-    cl_event read_gray_events[2];
 
-    clEnqueueReadBuffer(queue, gray_left_buf, CL_TRUE, 0, WIDTH*HEIGHT, gray_left_img, 0, NULL, &read_gray_events[0]);
-    clEnqueueReadBuffer(queue, gray_right_buf, CL_TRUE, 0, WIDTH*HEIGHT, gray_right_img, 0, NULL, &read_gray_events[1]);
-    lodepng_encode_file("output/gray_left.png", gray_left_img, WIDTH, HEIGHT, LCT_GREY, 8);
-    lodepng_encode_file("output/gray_right.png", gray_right_img, WIDTH, HEIGHT, LCT_GREY, 8);
-    
-    /*..........End of RGBA to grayscale conversion..........*/
+// Artifacts the full-frame mode can save to output/
+enum {
+    OUTPUT_RESIZED       = 1 << 0,
+    OUTPUT_GRAY          = 1 << 1,
+    OUTPUT_DISPARITY     = 1 << 2,
+    OUTPUT_CROSS_CHECKED = 1 << 3,
+    OUTPUT_OCCLUSION     = 1 << 4,
+    OUTPUT_FILTERED      = 1 << 5,
+    OUTPUT_ALL           = (1 << 6) - 1
+};
+
+static const struct { const char *name; unsigned bit; } OUTPUT_NAMES[] = {
+    {"resized",   OUTPUT_RESIZED},
+    {"gray",      OUTPUT_GRAY},
+    {"disparity", OUTPUT_DISPARITY},
+    {"cross",     OUTPUT_CROSS_CHECKED},
+    {"occlusion", OUTPUT_OCCLUSION},
+    {"filtered",  OUTPUT_FILTERED},
+    {"all",       OUTPUT_ALL},
+    {"none",      0}
+};
+
+/* Parse a comma separated list of artifact names into an OUTPUT_* mask.
+   Returns -1 on an unknown name */
+int parse_output_list(const char *list, unsigned *mask) {
+    *mask = 0;
+    while (*list) {
+        size_t len = strcspn(list, ",");
+        int found = 0;
+        for (size_t i = 0; i < sizeof(OUTPUT_NAMES) / sizeof(OUTPUT_NAMES[0]); i++) {
+            if (strlen(OUTPUT_NAMES[i].name) == len && strncmp(list, OUTPUT_NAMES[i].name, len) == 0) {
+                *mask |= OUTPUT_NAMES[i].bit;
+                found = 1;
+            }
+        }
+        if (!found) return -1;
+        list += len;
+        if (*list == ',') list++;
+    }
+    return 0;
+}
 
+// Host decimation modes of the full-frame upload
+enum { HOST_DECIMATE_OFF = 0, HOST_DECIMATE_RGBA, HOST_DECIMATE_GRAY };
+
+// Command line options
+typedef struct {
+    unsigned band_rows;     // 0 = full-frame mode, otherwise output rows per band
+    int hybrid;             // split the disparity rows between the device and the CPU
+    unsigned frames;        // number of times the pair is processed
+    unsigned outputs;       // OUTPUT_* mask of artifacts saved by the full-frame mode
+    int stream;             // pipeline frames over rotating buffer sets and separate queues
+    const char *sequence;   // directory of im0_NNNN.png/im1_NNNN.png pairs for streaming
+    int pinned;             // decode into mapped CL_MEM_ALLOC_HOST_PTR buffers
+    int svm;                // full-frame SVM inputs: 1 = requested, 0 = when supported, -1 = off
+    int host_decimate;      // HOST_DECIMATE_*: resize (and gray) on the host before the upload
+    int fused_zncc;         // one bidirectional ZNCC + cross-check kernel instead of three (-1 = from the profile)
+    int separate_kernels;   // ZNCC_* kernels of the separate stage (-1 = from the profile)
+    int autotune;           // tune the ZNCC variant and work-group shape, save the device profile
+    int use_profile;        // apply the device's tuning profile
+    const char *trace;      // Chrome/Perfetto trace of every command and host stage, or NULL
+    int kernel_report;      // print kernel resources, occupancy and per-launch throughput
+    int fill_benchmark;     // time the occlusion fill, dense and compacted, against the hole fraction
+    int multi_device;       // split the rows across every usable OpenCL device
+    unsigned sub_devices;   // split the rows across this many sub-devices of the CPU device
+} pipeline_options;
+
+void parse_options(int argc, char **argv, pipeline_options *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->frames = 1;
+    opts->outputs = OUTPUT_FILTERED;
+    opts->fused_zncc = -1;
+    opts->separate_kernels = -1;
+    opts->use_profile = 1;
+    int frames_given = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--band-rows") == 0 && i + 1 < argc) {
+            opts->band_rows = (unsigned)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-program-cache") == 0) {
+            use_program_cache = 0;
+        } else if (strcmp(argv[i], "--hybrid") == 0) {
+            opts->hybrid = 1;
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            opts->frames = (unsigned)atoi(argv[++i]);
+            if (opts->frames == 0) opts->frames = 1;
+            frames_given = 1;
+        } else if (strcmp(argv[i], "--outputs") == 0 && i + 1 < argc
+                   && parse_output_list(argv[i + 1], &opts->outputs) == 0) {
+            i++;
+        } else if (strcmp(argv[i], "--debug-dumps") == 0) {
+            opts->outputs = OUTPUT_ALL;
+        } else if (strcmp(argv[i], "--host-decimate") == 0 && i + 1 < argc
+                   && (strcmp(argv[i + 1], "rgba") == 0 || strcmp(argv[i + 1], "gray") == 0)) {
+            opts->host_decimate = strcmp(argv[++i], "gray") == 0 ? HOST_DECIMATE_GRAY : HOST_DECIMATE_RGBA;
+        } else if (strcmp(argv[i], "--fused-zncc") == 0) {
+            opts->fused_zncc = 1;
+        } else if (strcmp(argv[i], "--separate-zncc") == 0) {
+            opts->fused_zncc = 0;
+            opts->separate_kernels = ZNCC_OPTIMIZED;
+        } else if (strcmp(argv[i], "--sliding-zncc") == 0) {
+            opts->fused_zncc = 0;
+            opts->separate_kernels = ZNCC_SLIDING;
+        } else if (strcmp(argv[i], "--subgroup-zncc") == 0) {
+            opts->fused_zncc = 0;
+            opts->separate_kernels = ZNCC_SUBGROUP;
+        } else if (strcmp(argv[i], "--dot-zncc") == 0) {
+            opts->fused_zncc = 0;
+            opts->separate_kernels = ZNCC_DOT;
+        } else if (strcmp(argv[i], "--window-size") == 0 && i + 1 < argc) {
+            WINDOW_SIZE = (unsigned)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-disp") == 0 && i + 1 < argc) {
+            MAX_DISP = (unsigned)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--kernel-report") == 0) {
+            opts->kernel_report = 1;
+        } else if (strcmp(argv[i], "--fill-benchmark") == 0) {
+            opts->fill_benchmark = 1;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            opts->trace = argv[++i];
+        } else if (strcmp(argv[i], "--multi-device") == 0) {
+            opts->multi_device = 1;
+        } else if (strcmp(argv[i], "--sub-devices") == 0 && i + 1 < argc) {
+            opts->sub_devices = (unsigned)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--autotune") == 0) {
+            opts->autotune = 1;
+        } else if (strcmp(argv[i], "--no-tune-profile") == 0) {
+            opts->use_profile = 0;
+        } else if (strcmp(argv[i], "--zncc-from-rgba") == 0) {
+            zncc_tiles_from_rgba = 1;
+        } else if (strcmp(argv[i], "--median") == 0) {
+            use_median_filter = 1;
+        } else if (strcmp(argv[i], "--svm") == 0) {
+            opts->svm = 1;
+        } else if (strcmp(argv[i], "--no-svm") == 0) {
+            opts->svm = -1;
+        } else if (strcmp(argv[i], "--pinned") == 0) {
+            opts->pinned = 1;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            opts->stream = 1;
+        } else if (strcmp(argv[i], "--sequence") == 0 && i + 1 < argc) {
+            opts->stream = 1;
+            opts->sequence = argv[++i];
+        } else {
+            printf("Usage: %s [--window-size N] [--max-disp N]\n"
+                   "       [--band-rows N] [--hybrid] [--multi-device | --sub-devices N]\n"
+                   "       [--frames N] [--stream] [--sequence DIR]\n"
+                   "       [--outputs LIST] [--debug-dumps] [--pinned] [--svm | --no-svm]\n"
+                   "       [--host-decimate rgba|gray] [--zncc-from-rgba]\n"
+                   "       [--fused-zncc | --separate-zncc | --sliding-zncc | --subgroup-zncc | --dot-zncc]\n"
+                   "       [--median] [--autotune] [--no-tune-profile] [--trace FILE]\n"
+                   "       [--kernel-report] [--fill-benchmark] [--no-program-cache]\n", argv[0]);
+            printf("  --window-size N matching window half-size, 1 to 7 (default 4, a 9x9 window)\n");
+            printf("  --max-disp N    number of disparities searched, 1 to 256 (default 65)\n");
+            printf("  --band-rows N   stream the pair in bands of N output rows (low-memory mode); N must\n");
+            printf("                  leave room for the occlusion fill's reach: below %u\n",
+                   HEIGHT - 2 * (MAX_SEARCH_RADIUS + FILTER_RADIUS));
+            printf("  --hybrid        split the disparity computation between the device and the CPU\n");
+            printf("  --multi-device  split the rows of every frame across all usable OpenCL devices\n");
+            printf("  --sub-devices N split the rows across N sub-devices of the CPU device\n");
+            printf("  --frames N      process the pair N times (hybrid and multi-device modes re-balance\n");
+            printf("                  after each frame; full-frame mode recycles its buffers through a pool;\n");
+            printf("                  with --sequence, the maximum number of frames read)\n");
+            printf("  --stream        pipeline the frames: upload, kernels and download of consecutive frames overlap\n");
+            printf("  --sequence DIR  stream DIR/im0_NNNN.png and DIR/im1_NNNN.png instead of repeating the pair\n");
+            printf("  --outputs LIST  artifacts saved in full-frame mode, comma separated from\n");
+            printf("                  resized,gray,disparity,cross,occlusion,filtered,all,none (default: filtered)\n");
+            printf("  --debug-dumps   save every intermediate image (same as --outputs all)\n");
+            printf("  --pinned        decode into pinned, mapped buffers (zero-copy in full-frame mode,\n");
+            printf("                  which then runs one frame)\n");
+            printf("  --svm, --no-svm full-frame inputs and result in shared virtual memory (default: when supported)\n");
+            printf("  --host-decimate rgba|gray  full-frame mode: resize (and convert to gray) on the host,\n");
+            printf("                  upload only the %ux%u working image\n", WIDTH, HEIGHT);
+            printf("  --zncc-from-rgba  full-frame mode: the ZNCC kernels fill their tiles straight from the\n");
+            printf("                  original RGBA images, skipping the resize and grayscale stages\n");
+            printf("  --fused-zncc    run the fused ZNCC and cross-check kernel (the default without a profile,\n");
+            printf("                  except on devices with cl_khr_integer_dot_product)\n");
+            printf("  --separate-zncc run the left, right and cross-check kernels instead of the fused one\n");
+            printf("  --sliding-zncc  separate kernels that slide column sums along runs of %d pixels\n", ZNCC_RUN);
+            printf("  --subgroup-zncc separate kernels where the lanes of a sub-group split each pixel's\n");
+            printf("                  disparities (a local-memory reduction without cl_khr_subgroups)\n");
+            printf("  --dot-zncc      separate kernels that accumulate the window sums as packed 8-bit\n");
+            printf("                  dot products (mad24 without cl_khr_integer_dot_product); the\n");
+            printf("                  default on devices with it, unless a tuning profile applies\n");
+            printf("  --median        smooth the filled map with an edge-preserving 5x5 weighted median\n");
+            printf("                  instead of the moving average\n");
+            printf("  --autotune      benchmark the ZNCC variants and work-group shapes on this device, check them\n");
+            printf("                  against the CPU and save the fastest as the device's tuning profile\n");
+            printf("  --no-tune-profile  ignore the tuning profile and use the built-in defaults\n");
+            printf("  --trace FILE    write a Chrome/Perfetto timeline of every OpenCL command and host stage\n");
+            printf("  --kernel-report print each kernel's resources and estimated occupancy; the full-frame mode\n");
+            printf("                  also prints modelled bytes/FLOPs and achieved throughput per launch\n");
+            printf("  --fill-benchmark  full-frame mode: time the occlusion fill over every pixel and over\n");
+            printf("                  the hole list, for the frame and for added hole fractions\n");
+            printf("  --no-program-cache  always compile the kernels from source\n");
+            exit(1);
+        }
+    }
+    // Window sums must stay exact in float and fit the ushort statistics of
+    // zncc_bidirectional; disparities are stored as uchar
+    if (WINDOW_SIZE < 1 || WINDOW_SIZE > 7 || MAX_DISP < 1 || MAX_DISP > 256) {
+        printf("--window-size must be 1 to 7 and --max-disp 1 to 256\n");
+        exit(1);
+    }
+    // A sequence runs to its last frame unless --frames caps it
+    if (opts->sequence && !frames_given) opts->frames = UINT_MAX;
+    // The band mode's cross-checked window spans the occlusion fill's reach on both sides of
+    // a band; once it covers the whole map the mode saves nothing
+    if (opts->band_rows && opts->band_rows + 2 * (MAX_SEARCH_RADIUS + FILTER_RADIUS) >= HEIGHT) {
+        printf("--band-rows must be below %u: the occlusion fill reads %u rows on each side of a band\n",
+               HEIGHT - 2 * (MAX_SEARCH_RADIUS + FILTER_RADIUS), MAX_SEARCH_RADIUS + FILTER_RADIUS);
+        exit(1);
+    }
+    // The full-frame mode hands the pinned pair over by unmapping it, so it runs one frame
+    if (opts->pinned && opts->frames > 1 && !opts->band_rows && !opts->hybrid && !opts->stream
+        && !opts->multi_device && !opts->sub_devices) {
+        printf("--pinned runs a single full-frame frame; drop --frames or use another mode\n");
+        exit(1);
+    }
+    // The RGBA tile variant replaces the gray inputs of the ZNCC kernels, which only the
+    // full-frame mode can provide
+    if (zncc_tiles_from_rgba && (opts->band_rows || opts->hybrid || opts->stream || opts->host_decimate
+                                 || opts->multi_device || opts->sub_devices)) {
+        printf("--zncc-from-rgba needs the full-frame mode without --host-decimate\n");
+        exit(1);
+    }
+}
 
 
 
-    /*.................Disparity calculation using ZNCC.............*/
-    cl_program zncc_prog_left = build_program(context, device, "zncc_left_optimized.cl", "-cl-fast-relaxed-math -cl-mad-enable");
-    cl_program zncc_prog_right = build_program(context, device, "zncc_right_optimized.cl", "-cl-fast-relaxed-math -cl-mad-enable");
-    cl_kernel zncc_left_to_right_kernel = clCreateKernel(zncc_prog_left, "zncc_disparity_left_optimized", NULL);
-    cl_kernel zncc_right_to_left_kernel = clCreateKernel(zncc_prog_right, "zncc_disparity_right_optimized", NULL);
+/* Pinned input pair: the decoded images live in CL_MEM_ALLOC_HOST_PTR buffers mapped into
+   host memory. While mapped they are page-locked staging memory for full-speed DMA writes;
+   the full-frame mode unmaps them and reads the buffers directly, which is zero-copy on
+   integrated and CPU devices */
+typedef struct {
+    cl_mem buf[2];           // left, right
+    unsigned char *ptr[2];   // mapped host pointers, NULL once unmapped
+} pinned_pair;
+
+// Decode a PNG straight into `dest` (ORIG_WIDTH x ORIG_HEIGHT RGBA) without a temporary RGBA image
+unsigned decode_png_into(const char *filename, unsigned char *dest) {
+    unsigned char *png = NULL, *raw = NULL;
+    size_t png_size = 0;
+    unsigned w = 0, h = 0;
+    double start = omp_get_wtime();
+    unsigned error = lodepng_load_file(&png, &png_size, filename);
+    if (!error) {
+        LodePNGState state;
+        lodepng_state_init(&state);
+        state.decoder.color_convert = 0;   // Keep the PNG's own format, converted below
+        error = lodepng_decode(&raw, &w, &h, &state, png, png_size);
+        if (!error && (w != ORIG_WIDTH || h != ORIG_HEIGHT)) {
+            printf("Error: %s is %ux%u, expected %ux%u\n", filename, w, h, ORIG_WIDTH, ORIG_HEIGHT);
+            exit(1);
+        }
+        if (!error) {
+            LodePNGColorMode rgba = lodepng_color_mode_make(LCT_RGBA, 8);
+            error = lodepng_convert(dest, raw, &rgba, &state.info_png.color, w, h);
+        }
+        lodepng_state_cleanup(&state);
+    }
+    if (error) printf("Error %u: %s\n", error, lodepng_error_text(error));
+    free(png);
+    free(raw);
+    trace_host_span("Decode", filename, start);
+    return error;
+}
 
+void create_pinned_pair(cl_context context, cl_command_queue queue, pinned_pair *p,
+                        const char *left_file, const char *right_file) {
+    const size_t orig_bytes = (size_t)ORIG_WIDTH * ORIG_HEIGHT * 4;
+    const char *files[2] = {left_file, right_file};
+    cl_int err;
+    for (int i = 0; i < 2; i++) {
+        p->buf[i] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, orig_bytes, NULL, &err);
+        if (err < 0) {
+            perror("Couldn't create a pinned input buffer");
+            exit(1);
+        }
+        p->ptr[i] = (unsigned char*)traced_enqueue_map_buffer(queue, p->buf[i], CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION,
+                                                              0, orig_bytes, 0, NULL, NULL, &err);
+        if (err < 0) {
+            perror("Couldn't map the pinned input buffer");
+            exit(1);
+        }
+        if (decode_png_into(files[i], p->ptr[i]))
+            exit(1);
+    }
+    printf("Loaded %s and %s into pinned host memory: %ux%u\n", left_file, right_file, ORIG_WIDTH, ORIG_HEIGHT);
+}
 
-    cl_mem disparity_left_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY, WIDTH*HEIGHT, NULL, NULL);
-    cl_mem disparity_right_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY, WIDTH*HEIGHT, NULL, NULL);
-    size_t global_size_zncc[2] = {WIDTH, HEIGHT};
-    cl_event zncc_events[2];
-    size_t local_size[2] = {16, 16}; // Optimal for most GPUs
-    size_t global_size[2] = {
-        ((WIDTH + local_size[0]-1)/local_size[0])*local_size[0],
-        ((HEIGHT + local_size[1]-1)/local_size[1])*local_size[1]
-    };
+void release_pinned_pair(cl_command_queue queue, pinned_pair *p) {
+    for (int i = 0; i < 2; i++) {
+        if (p->ptr[i])
+            traced_enqueue_unmap_mem_object(queue, p->buf[i], p->ptr[i], 0, NULL, NULL);
+        p->ptr[i] = NULL;
+    }
+    clFinish(queue);
+    clReleaseMemObject(p->buf[0]);
+    clReleaseMemObject(p->buf[1]);
+}
 
 
-    clSetKernelArg(zncc_left_to_right_kernel, 0, sizeof(cl_mem), &gray_left_buf);
-    clSetKernelArg(zncc_left_to_right_kernel, 1, sizeof(cl_mem), &gray_right_buf);
-    clSetKernelArg(zncc_left_to_right_kernel, 2, sizeof(cl_mem), &disparity_left_buf);
-    clSetKernelArg(zncc_left_to_right_kernel, 3, sizeof(int), &WIDTH);
-    clSetKernelArg(zncc_left_to_right_kernel, 4, sizeof(int), &HEIGHT);
-    clSetKernelArg(zncc_left_to_right_kernel, 5, sizeof(int), &MAX_DISP);
-    clSetKernelArg(zncc_left_to_right_kernel, 6, sizeof(int), &WINDOW_SIZE);
-    clEnqueueNDRangeKernel(queue, zncc_left_to_right_kernel, 2, NULL, global_size, local_size, 0, NULL, &zncc_events[0]);
-
-    clSetKernelArg(zncc_right_to_left_kernel, 0, sizeof(cl_mem), &gray_right_buf);
-    clSetKernelArg(zncc_right_to_left_kernel, 1, sizeof(cl_mem), &gray_left_buf);
-    clSetKernelArg(zncc_right_to_left_kernel, 2, sizeof(cl_mem), &disparity_right_buf);
-    clSetKernelArg(zncc_right_to_left_kernel, 3, sizeof(int), &WIDTH);
-    clSetKernelArg(zncc_right_to_left_kernel, 4, sizeof(int), &HEIGHT);
-    clSetKernelArg(zncc_right_to_left_kernel, 5, sizeof(int), &MAX_DISP);
-    clSetKernelArg(zncc_right_to_left_kernel, 6, sizeof(int), &WINDOW_SIZE);
-    clEnqueueNDRangeKernel(queue, zncc_right_to_left_kernel, 2, NULL, global_size, local_size, 0, NULL, &zncc_events[1]);
-
-    // Read disparity map
-    unsigned char *disparity_left_img = (unsigned char*)malloc(WIDTH * HEIGHT);
-    unsigned char *disparity_right_img = (unsigned char*)malloc(WIDTH * HEIGHT);
-    cl_event read_disparity_events[2];
-    clEnqueueReadBuffer(queue, disparity_left_buf, CL_TRUE, 0, WIDTH*HEIGHT, disparity_left_img, 0, NULL, &read_disparity_events[0]);
-    clEnqueueReadBuffer(queue, disparity_right_buf, CL_TRUE, 0, WIDTH*HEIGHT, disparity_right_img, 0, NULL, &read_disparity_events[1]);
-    lodepng_encode_file("output/disparity_left.png", disparity_left_img, WIDTH, HEIGHT, LCT_GREY, 8);
-    lodepng_encode_file("output/disparity_right.png", disparity_right_img, WIDTH, HEIGHT, LCT_GREY, 8);
 
-    /*.................End of disparity calculation using ZNCC.............*/
+/* Shared virtual memory pair (OpenCL 2.0): the input images and the final map are clSVMAlloc
+   allocations passed to the kernels with clSetKernelArgSVMPointer, so no separate device
+   copy of the ~47 MB input pair exists. Fine-grained SVM is shared outright; coarse-grained
+   SVM is mapped while the host writes or reads it */
+typedef struct {
+    unsigned char *ptr[2];   // left, right
+    int fine_grain;
+    int mapped;              // coarse-grained only: inputs currently mapped for the host
+} svm_pair;
+
+// SVM capabilities of the device, 0 when it has none (or is an OpenCL 1.x device)
+cl_device_svm_capabilities query_svm_capabilities(cl_device_id dev) {
+    cl_device_svm_capabilities caps = 0;
+    if (clGetDeviceInfo(dev, CL_DEVICE_SVM_CAPABILITIES, sizeof(caps), &caps, NULL) != CL_SUCCESS)
+        return 0;
+    return caps;
+}
+
+// Allocate the pair in SVM and decode the images into it. Returns -1 if the allocation fails
+int create_svm_pair(cl_context context, cl_command_queue queue, cl_device_svm_capabilities caps,
+                    svm_pair *p, const char *left_file, const char *right_file) {
+    const size_t orig_bytes = (size_t)ORIG_WIDTH * ORIG_HEIGHT * 4;
+    const char *files[2] = {left_file, right_file};
+    p->fine_grain = (caps & CL_DEVICE_SVM_FINE_GRAIN_BUFFER) != 0;
+    cl_svm_mem_flags flags = CL_MEM_READ_ONLY | (p->fine_grain ? CL_MEM_SVM_FINE_GRAIN_BUFFER : 0);
+    for (int i = 0; i < 2; i++) {
+        p->ptr[i] = (unsigned char*)clSVMAlloc(context, flags, orig_bytes, 0);
+        if (!p->ptr[i]) {
+            if (i == 1) clSVMFree(context, p->ptr[0]);
+            return -1;
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (!p->fine_grain)
+            traced_enqueue_svm_map(queue, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, p->ptr[i], orig_bytes, 0, NULL, NULL);
+        if (decode_png_into(files[i], p->ptr[i]))
+            exit(1);
+    }
+    p->mapped = !p->fine_grain;
+    printf("Loaded %s and %s into %s-grained SVM: %ux%u\n", left_file, right_file,
+           p->fine_grain ? "fine" : "coarse", ORIG_WIDTH, ORIG_HEIGHT);
+    return 0;
+}
+
+void release_svm_pair(cl_context context, cl_command_queue queue, svm_pair *p) {
+    for (int i = 0; i < 2; i++) {
+        if (p->mapped)
+            traced_enqueue_svm_unmap(queue, p->ptr[i], 0, NULL, NULL);
+    }
+    clFinish(queue);
+    clSVMFree(context, p->ptr[0]);
+    clSVMFree(context, p->ptr[1]);
+}
+
+
+
+/*................Device buffer pool................*/
+/* Buffers are recycled by exact size and flags instead of being created and released per
+   frame. A buffer may go back to the pool as soon as its last command is enqueued: the
+   next owner only touches it through later commands on the same in-order queue, so the
+   stages whose lifetimes do not overlap share storage (the resized RGBA and original
+   images after grayscale, the gray pair after ZNCC, ...). Buffers created with a host
+   pointer are never pooled */
+#define MAX_POOL_BUFFERS 64
+
+typedef struct {
+    cl_context context;
+    cl_mem buf;
+    cl_mem_flags flags;
+    size_t bytes;
+    int in_use;
+} pool_entry;
+
+pool_entry buffer_pool[MAX_POOL_BUFFERS];
+int pool_count = 0;
+unsigned pool_created = 0, pool_reused = 0;
+size_t pool_bytes = 0, pool_peak_bytes = 0;               // Device memory held by the pool
+size_t pool_in_use_bytes = 0, pool_peak_in_use_bytes = 0; // Device memory live at once
+
+cl_mem pool_acquire(cl_context context, cl_mem_flags flags, size_t bytes) {
+    for (int i = 0; i < pool_count; i++) {
+        pool_entry *e = &buffer_pool[i];
+        if (!e->in_use && e->context == context && e->flags == flags && e->bytes == bytes) {
+            e->in_use = 1;
+            pool_reused++;
+            pool_in_use_bytes += bytes;
+            if (pool_in_use_bytes > pool_peak_in_use_bytes) pool_peak_in_use_bytes = pool_in_use_bytes;
+            return e->buf;
+        }
+    }
+
+    cl_int err;
+    cl_mem buf = clCreateBuffer(context, flags, bytes, NULL, &err);
+    if (err != CL_SUCCESS) {
+        printf("Error %d: buffer pool could not create %zu bytes\n", err, bytes);
+        exit(1);
+    }
+    pool_created++;
+    pool_in_use_bytes += bytes;
+    if (pool_in_use_bytes > pool_peak_in_use_bytes) pool_peak_in_use_bytes = pool_in_use_bytes;
+    if (pool_count == MAX_POOL_BUFFERS)
+        return buf;   // Pool full: an unpooled buffer, pool_release() frees it
+    pool_entry *e = &buffer_pool[pool_count++];
+    e->context = context;
+    e->buf = buf;
+    e->flags = flags;
+    e->bytes = bytes;
+    e->in_use = 1;
+    pool_bytes += bytes;
+    if (pool_bytes > pool_peak_bytes) pool_peak_bytes = pool_bytes;
+    return buf;
+}
+
+void pool_release(cl_mem buf) {
+    if (!buf) return;
+    for (int i = 0; i < pool_count; i++) {
+        if (buffer_pool[i].buf == buf) {
+            buffer_pool[i].in_use = 0;
+            pool_in_use_bytes -= buffer_pool[i].bytes;
+            return;
+        }
+    }
+    size_t bytes = 0;
+    clGetMemObjectInfo(buf, CL_MEM_SIZE, sizeof(bytes), &bytes, NULL);
+    pool_in_use_bytes -= bytes;
+    clReleaseMemObject(buf);
+}
+
+void print_pool_report(void) {
+    printf("Buffer pool: %u buffers created, %u reuses, peak %.2f MB live at once, %.2f MB of device memory held\n",
+           pool_created, pool_reused, pool_peak_in_use_bytes / 1048576.0, pool_peak_bytes / 1048576.0);
+}
+
+// Release every pooled buffer; the queues using them must have drained
+void drain_buffer_pool(void) {
+    for (int i = 0; i < pool_count; i++)
+        clReleaseMemObject(buffer_pool[i].buf);
+    pool_count = 0;
+    pool_bytes = pool_in_use_bytes = 0;
+}
+
+
+
+/* Full-frame execution: every stage runs over the whole image. The whole chain is
+   enqueued without host synchronization; only the artifacts selected in `outputs` are
+   read back (non-blocking, right behind the kernel that produces them) and saved to
+   output/ once the queue has drained.
+   With a pinned pair the inputs are unmapped instead of copied and the final map is read
+   through a mapped CL_MEM_ALLOC_HOST_PTR buffer. With an SVM pair the resize kernel reads the
+   shared allocations and the filter writes the final map into SVM.
+   With host decimation the host resizes (HOST_DECIMATE_RGBA) or resizes and converts to gray
+   (HOST_DECIMATE_GRAY) into pinned staging, and only the 735x504 image is uploaded */
+void run_full_frame(cl_context context, cl_command_queue queue, pipeline_kernels *k,
+                    unsigned char *im0_data, unsigned char *im1_data, const pipeline_options *opts,
+                    pinned_pair *pinned, svm_pair *svm) {
+    unsigned outputs = opts->outputs;
+    int host_decimate = opts->host_decimate;
+
+    // Create buffers
+    cl_mem im0_buf = NULL, im1_buf = NULL;
+    cl_event write_events[2];
+    cl_mem staging[2] = {NULL, NULL};
+    unsigned char *staged[2] = {NULL, NULL};
+    size_t staged_bytes = (size_t)WIDTH * HEIGHT * (host_decimate == HOST_DECIMATE_GRAY ? 1 : 4);
+    if (host_decimate == HOST_DECIMATE_GRAY)
+        outputs &= ~OUTPUT_RESIZED;   // No RGBA working image exists
+    if (zncc_tiles_from_rgba)
+        outputs &= ~(OUTPUT_RESIZED | OUTPUT_GRAY);   // Neither working image exists
+    if (host_decimate) {
+        /*....................Decimate on the HOST into pinned staging..................*/
+        unsigned char *inputs[2] = {im0_data, im1_data};
+        double decimate_start = omp_get_wtime();
+        for (int i = 0; i < 2; i++) {
+            staging[i] = pool_acquire(context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, staged_bytes);
+            staged[i] = (unsigned char*)traced_enqueue_map_buffer(queue, staging[i], CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION,
+                                                                  0, staged_bytes, 0, NULL, NULL, NULL);
+            if (host_decimate == HOST_DECIMATE_GRAY)
+                decimate_gray_cpu(inputs[i], staged[i]);
+            else
+                decimate_rgba_cpu(inputs[i], staged[i]);
+        }
+        printf("Host decimation%s: %.3f ms, uploading %zu bytes per image instead of %zu\n",
+               host_decimate == HOST_DECIMATE_GRAY ? " + grayscale" : "",
+               (omp_get_wtime() - decimate_start) * 1000.0, staged_bytes, (size_t)ORIG_WIDTH * ORIG_HEIGHT * 4);
+    } else if (svm) {
+        /*....................Hand the SVM images over to the DEVICE..................*/
+        // Coarse-grained: the unmap publishes the host writes. Fine-grained: nothing to do,
+        // a marker keeps the profile uniform
+        for (int i = 0; i < 2; i++) {
+            if (svm->mapped)
+                traced_enqueue_svm_unmap(queue, svm->ptr[i], 0, NULL, &write_events[i]);
+            else
+                traced_enqueue_marker(queue, 0, NULL, &write_events[i]);
+        }
+        svm->mapped = 0;
+    } else if (pinned) {
+        /*....................Hand the pinned images over to the DEVICE..................*/
+        // Unmapping is the transfer: a DMA on discrete devices, free on shared memory
+        im0_buf = pinned->buf[0];
+        im1_buf = pinned->buf[1];
+        clRetainMemObject(im0_buf);
+        clRetainMemObject(im1_buf);
+        traced_enqueue_unmap_mem_object(queue, im0_buf, pinned->ptr[0], 0, NULL, &write_events[0]);
+        traced_enqueue_unmap_mem_object(queue, im1_buf, pinned->ptr[1], 0, NULL, &write_events[1]);
+        pinned->ptr[0] = pinned->ptr[1] = NULL;
+    } else {
+        im0_buf = pool_acquire(context, CL_MEM_READ_ONLY, ORIG_WIDTH*ORIG_HEIGHT*4);
+        im1_buf = pool_acquire(context, CL_MEM_READ_ONLY, ORIG_WIDTH*ORIG_HEIGHT*4);
+
+        /*....................Transfer data from HOST to the DEVICE..................*/
+        // Transfer the left and the right images to the DEVICE
+        traced_enqueue_write_buffer(queue, im0_buf, CL_FALSE, 0, ORIG_WIDTH*ORIG_HEIGHT*4, im0_data, 0, NULL, &write_events[0]);
+        traced_enqueue_write_buffer(queue, im1_buf, CL_FALSE, 0, ORIG_WIDTH*ORIG_HEIGHT*4, im1_data, 0, NULL, &write_events[1]);
+    }
+
+    
+    /*...........Image RESIZING and GRAYSCALE using kernels and DEVICE..................*/
+    // The fused resize_grayscale kernel is the default. The separate resize and grayscale
+    // kernels (and the intermediate RGBA image) only run when the resized images are
+    // requested, or after a host-side RGBA decimation
+    cl_kernel resize_kernel = k->resize_kernel;
+    cl_kernel gray_kernel = k->gray_kernel;
+    int separate_resize = !zncc_tiles_from_rgba && host_decimate != HOST_DECIMATE_GRAY
+                          && ((outputs & OUTPUT_RESIZED) || host_decimate == HOST_DECIMATE_RGBA);
+    cl_mem resized_left_buf = NULL, resized_right_buf = NULL;
+    cl_mem gray_left_buf = NULL, gray_right_buf = NULL;
+    cl_event resize_events[2], gray_events[2];
+    size_t global_size_resize[2] = {WIDTH, HEIGHT};
+    size_t global_size_gray[2] = {WIDTH, HEIGHT};
+    if (separate_resize) {
+        resized_left_buf = pool_acquire(context, CL_MEM_READ_WRITE, WIDTH*HEIGHT*4);
+        resized_right_buf = pool_acquire(context, CL_MEM_READ_WRITE, WIDTH * HEIGHT * 4);
+    }
+    if (!zncc_tiles_from_rgba) {
+        gray_left_buf = pool_acquire(context, CL_MEM_READ_WRITE, WIDTH*HEIGHT); // Single channel
+        gray_right_buf = pool_acquire(context, CL_MEM_READ_WRITE, WIDTH*HEIGHT); // Single channel
+    }
+
+    if (zncc_tiles_from_rgba) {
+        // The ZNCC kernels sample the original images themselves
+        gray_events[0] = write_events[0];
+        gray_events[1] = write_events[1];
+    } else if (host_decimate == HOST_DECIMATE_GRAY) {
+        // Gray comes straight from the host
+        traced_enqueue_write_buffer(queue, gray_left_buf, CL_FALSE, 0, staged_bytes, staged[0], 0, NULL, &write_events[0]);
+        traced_enqueue_write_buffer(queue, gray_right_buf, CL_FALSE, 0, staged_bytes, staged[1], 0, NULL, &write_events[1]);
+        gray_events[0] = write_events[0];
+        gray_events[1] = write_events[1];
+    } else if (!separate_resize) {
+        // Fused resize + grayscale
+        cl_mem gray_bufs[2] = {gray_left_buf, gray_right_buf};
+        cl_mem im_bufs[2] = {im0_buf, im1_buf};
+        for (int i = 0; i < 2; i++) {
+            if (svm)
+                clSetKernelArgSVMPointer(k->resize_gray_kernel, 0, svm->ptr[i]);
+            else
+                clSetKernelArg(k->resize_gray_kernel, 0, sizeof(cl_mem), &im_bufs[i]);
+            clSetKernelArg(k->resize_gray_kernel, 1, sizeof(cl_mem), &gray_bufs[i]);
+            clSetKernelArg(k->resize_gray_kernel, 2, sizeof(int), &ORIG_WIDTH);
+            clSetKernelArg(k->resize_gray_kernel, 3, sizeof(int), &ORIG_HEIGHT);
+            traced_enqueue_ndrange_kernel(queue, k->resize_gray_kernel, 2, NULL, global_size_gray, NULL, 1, &write_events[i], &gray_events[i]);
+        }
+    } else {
+        if (host_decimate == HOST_DECIMATE_RGBA) {
+            // The host already resized: the upload stands in for the resize kernel
+            traced_enqueue_write_buffer(queue, resized_left_buf, CL_FALSE, 0, staged_bytes, staged[0], 0, NULL, &write_events[0]);
+            traced_enqueue_write_buffer(queue, resized_right_buf, CL_FALSE, 0, staged_bytes, staged[1], 0, NULL, &write_events[1]);
+            resize_events[0] = write_events[0];
+            resize_events[1] = write_events[1];
+        } else {
+            //Resize left image (im0.png)
+            if (svm)
+                clSetKernelArgSVMPointer(resize_kernel, 0, svm->ptr[0]);
+            else
+                clSetKernelArg(resize_kernel, 0, sizeof(cl_mem), &im0_buf);
+            clSetKernelArg(resize_kernel, 1, sizeof(cl_mem), &resized_left_buf);
+            clSetKernelArg(resize_kernel, 2, sizeof(int), &ORIG_WIDTH);
+            clSetKernelArg(resize_kernel, 3, sizeof(int), &ORIG_HEIGHT);
+            traced_enqueue_ndrange_kernel(queue, resize_kernel, 2, NULL, global_size_resize, NULL, 1, &write_events[0], &resize_events[0]);
+
+
+            //Resize right image (im1.png)
+            if (svm)
+                clSetKernelArgSVMPointer(resize_kernel, 0, svm->ptr[1]);
+            else
+                clSetKernelArg(resize_kernel, 0, sizeof(cl_mem), &im1_buf);
+            clSetKernelArg(resize_kernel, 1, sizeof(cl_mem), &resized_right_buf);
+            clSetKernelArg(resize_kernel, 2, sizeof(int), &ORIG_WIDTH);
+            clSetKernelArg(resize_kernel, 3, sizeof(int), &ORIG_HEIGHT);
+            traced_enqueue_ndrange_kernel(queue, resize_kernel, 2, NULL, global_size_resize, NULL, 1, &write_events[1], &resize_events[1]);
+        }
+
+        /*.............Convert RGBA image to Grayscale image............*/
+        clSetKernelArg(gray_kernel, 0, sizeof(cl_mem), &resized_left_buf);
+        clSetKernelArg(gray_kernel, 1, sizeof(cl_mem), &gray_left_buf);
+        traced_enqueue_ndrange_kernel(queue, gray_kernel, 2, NULL, global_size_gray, NULL, 1, &resize_events[0], &gray_events[0]);
+
+        clSetKernelArg(gray_kernel, 0, sizeof(cl_mem), &resized_right_buf);
+        clSetKernelArg(gray_kernel, 1, sizeof(cl_mem), &gray_right_buf);
+        traced_enqueue_ndrange_kernel(queue, gray_kernel, 2, NULL, global_size_gray, NULL, 1, &resize_events[1], &gray_events[1]);
+    }
+
+
+    // Read back resized image (debug output)
+    unsigned char *resized_left_img = NULL, *resized_right_img = NULL;
+    cl_event read_resize_events[2];
+    if (outputs & OUTPUT_RESIZED) {
+        resized_left_img = (unsigned char*)malloc(WIDTH*HEIGHT*4);
+        resized_right_img = (unsigned char*)malloc(WIDTH * HEIGHT * 4);
+        traced_enqueue_read_buffer(queue, resized_left_buf, CL_FALSE, 0, WIDTH*HEIGHT*4, resized_left_img, 1, &resize_events[0], &read_resize_events[0]);
+        traced_enqueue_read_buffer(queue, resized_right_buf, CL_FALSE, 0, WIDTH*HEIGHT*4, resized_right_img, 1, &resize_events[1], &read_resize_events[1]);
+    }
+
+    // Read grayscale (debug output)
+    unsigned char *gray_left_img = NULL, *gray_right_img = NULL;
+    cl_event read_gray_events[2];
+    if (outputs & OUTPUT_GRAY) {
+        gray_left_img = (unsigned char*)malloc(WIDTH*HEIGHT);
+        gray_right_img = (unsigned char*)malloc(WIDTH*HEIGHT);
+        traced_enqueue_read_buffer(queue, gray_left_buf, CL_FALSE, 0, WIDTH*HEIGHT, gray_left_img, 1, &gray_events[0], &read_gray_events[0]);
+        traced_enqueue_read_buffer(queue, gray_right_buf, CL_FALSE, 0, WIDTH*HEIGHT, gray_right_img, 1, &gray_events[1], &read_gray_events[1]);
+    }
+    
+
+    // The resized RGBA pair is dead once grayscale is enqueued, and so are the originals
+    // unless the ZNCC tiles sample them
+    pool_release(resized_left_buf);
+    pool_release(resized_right_buf);
+    if (im0_buf && !pinned && !zncc_tiles_from_rgba) {
+        pool_release(im0_buf);
+        pool_release(im1_buf);
+        im0_buf = im1_buf = NULL;
+    }
+    /*..........End of RGBA to grayscale conversion..........*/
 
 
 
 
-    /*....................Cross checking of left and right disparity image........*/
-    cl_program cross_check_prog = build_program(context, device, "cross_check.cl", NULL);
-    cl_kernel cross_check_kernel = clCreateKernel(cross_check_prog, "cross_check", NULL);
-    cl_mem cross_checked_buff = clCreateBuffer(context, CL_MEM_WRITE_ONLY, WIDTH*HEIGHT, NULL, NULL);
+    /*.................Disparity calculation using ZNCC.............*/
+    cl_kernel zncc_left_to_right_kernel = k->zncc_left_to_right_kernel;
+    cl_kernel zncc_right_to_left_kernel = k->zncc_right_to_left_kernel;
+
+
+    size_t local_size[2] = {LOCAL_WIDTH, LOCAL_HEIGHT};
+    size_t global_size[2] = {
+        ((WIDTH + local_size[0]-1)/local_size[0])*local_size[0],
+        ((HEIGHT + local_size[1]-1)/local_size[1])*local_size[1]
+    };
+
+    // Tile sources: the gray pair, or the original RGBA pair with ZNCC_TILES_FROM_RGBA
+    cl_mem zncc_left_src = zncc_tiles_from_rgba ? im0_buf : gray_left_buf;
+    cl_mem zncc_right_src = zncc_tiles_from_rgba ? im1_buf : gray_right_buf;
+
+    cl_kernel cross_check_kernel = k->cross_check_kernel;
+    cl_mem cross_checked_buff = pool_acquire(context, CL_MEM_READ_WRITE, WIDTH*HEIGHT);
     size_t global_size_cross[2] = {WIDTH, HEIGHT};
     cl_event cross_check_kernel_event;
 
+    // The fused bidirectional kernel goes straight to the cross-checked map. The separate
+    // kernels run when the raw disparity maps are requested or with --separate-zncc
+    int fused_zncc = opts->fused_zncc && !(outputs & OUTPUT_DISPARITY);
+    cl_mem disparity_left_buf = NULL, disparity_right_buf = NULL;
+    cl_event zncc_events[2];
+    unsigned char *disparity_left_img = NULL, *disparity_right_img = NULL;
+    cl_event read_disparity_events[2];
+    if (fused_zncc) {
+        cl_kernel bidirectional_kernel = k->zncc_bidirectional_kernel;
+        if (zncc_tiles_from_rgba && svm) {
+            clSetKernelArgSVMPointer(bidirectional_kernel, 0, svm->ptr[0]);
+            clSetKernelArgSVMPointer(bidirectional_kernel, 1, svm->ptr[1]);
+        } else {
+            clSetKernelArg(bidirectional_kernel, 0, sizeof(cl_mem), &zncc_left_src);
+            clSetKernelArg(bidirectional_kernel, 1, sizeof(cl_mem), &zncc_right_src);
+        }
+        clSetKernelArg(bidirectional_kernel, 2, sizeof(cl_mem), &cross_checked_buff);
+        clSetKernelArg(bidirectional_kernel, 3, sizeof(int), &WIDTH);
+        clSetKernelArg(bidirectional_kernel, 4, sizeof(int), &HEIGHT);
+        clSetKernelArg(bidirectional_kernel, 5, sizeof(int), &THRESHOLD);
+        traced_enqueue_ndrange_kernel(queue, bidirectional_kernel, 2, NULL, global_size, local_size, 2, gray_events, &cross_check_kernel_event);
+    } else {
+        disparity_left_buf = pool_acquire(context, CL_MEM_READ_WRITE, WIDTH*HEIGHT);
+        disparity_right_buf = pool_acquire(context, CL_MEM_READ_WRITE, WIDTH*HEIGHT);
+
+        if (zncc_tiles_from_rgba && svm) {
+            clSetKernelArgSVMPointer(zncc_left_to_right_kernel, 0, svm->ptr[0]);
+            clSetKernelArgSVMPointer(zncc_left_to_right_kernel, 1, svm->ptr[1]);
+            clSetKernelArgSVMPointer(zncc_right_to_left_kernel, 0, svm->ptr[1]);
+            clSetKernelArgSVMPointer(zncc_right_to_left_kernel, 1, svm->ptr[0]);
+        } else {
+            clSetKernelArg(zncc_left_to_right_kernel, 0, sizeof(cl_mem), &zncc_left_src);
+            clSetKernelArg(zncc_left_to_right_kernel, 1, sizeof(cl_mem), &zncc_right_src);
+            clSetKernelArg(zncc_right_to_left_kernel, 0, sizeof(cl_mem), &zncc_right_src);
+            clSetKernelArg(zncc_right_to_left_kernel, 1, sizeof(cl_mem), &zncc_left_src);
+        }
+
+        clSetKernelArg(zncc_left_to_right_kernel, 2, sizeof(cl_mem), &disparity_left_buf);
+        clSetKernelArg(zncc_left_to_right_kernel, 3, sizeof(int), &WIDTH);
+        clSetKernelArg(zncc_left_to_right_kernel, 4, sizeof(int), &HEIGHT);
+        clSetKernelArg(zncc_left_to_right_kernel, 5, sizeof(int), &MAX_DISP);
+        clSetKernelArg(zncc_left_to_right_kernel, 6, sizeof(int), &WINDOW_SIZE);
+        traced_enqueue_ndrange_kernel(queue, zncc_left_to_right_kernel, 2, NULL, global_size, local_size, 2, gray_events, &zncc_events[0]);
+
+        clSetKernelArg(zncc_right_to_left_kernel, 2, sizeof(cl_mem), &disparity_right_buf);
+        clSetKernelArg(zncc_right_to_left_kernel, 3, sizeof(int), &WIDTH);
+        clSetKernelArg(zncc_right_to_left_kernel, 4, sizeof(int), &HEIGHT);
+        clSetKernelArg(zncc_right_to_left_kernel, 5, sizeof(int), &MAX_DISP);
+        clSetKernelArg(zncc_right_to_left_kernel, 6, sizeof(int), &WINDOW_SIZE);
+        traced_enqueue_ndrange_kernel(queue, zncc_right_to_left_kernel, 2, NULL, global_size, local_size, 2, gray_events, &zncc_events[1]);
+
+        // Read disparity map (debug output)
+        if (outputs & OUTPUT_DISPARITY) {
+            disparity_left_img = (unsigned char*)malloc(WIDTH * HEIGHT);
+            disparity_right_img = (unsigned char*)malloc(WIDTH * HEIGHT);
+            traced_enqueue_read_buffer(queue, disparity_left_buf, CL_FALSE, 0, WIDTH*HEIGHT, disparity_left_img, 1, &zncc_events[0], &read_disparity_events[0]);
+            traced_enqueue_read_buffer(queue, disparity_right_buf, CL_FALSE, 0, WIDTH*HEIGHT, disparity_right_img, 1, &zncc_events[1], &read_disparity_events[1]);
+        }
+
+        // Cross checking of left and right disparity image
+        clSetKernelArg(cross_check_kernel, 0, sizeof(cl_mem), &disparity_left_buf);
+        clSetKernelArg(cross_check_kernel, 1, sizeof(cl_mem), &disparity_right_buf);
+        clSetKernelArg(cross_check_kernel, 2, sizeof(cl_mem), &cross_checked_buff);
+        clSetKernelArg(cross_check_kernel, 3, sizeof(int), &WIDTH);
+        clSetKernelArg(cross_check_kernel, 4, sizeof(int), &THRESHOLD);
+        traced_enqueue_ndrange_kernel(queue, cross_check_kernel, 2, NULL, global_size_cross, NULL, 2, zncc_events, &cross_check_kernel_event);
+    }
 
-    clSetKernelArg(cross_check_kernel, 0, sizeof(cl_mem), &disparity_left_buf);
-    clSetKernelArg(cross_check_kernel, 1, sizeof(cl_mem), &disparity_right_buf);
-    clSetKernelArg(cross_check_kernel, 2, sizeof(cl_mem), &cross_checked_buff);
-    clSetKernelArg(cross_check_kernel, 3, sizeof(int), &WIDTH);
-    clSetKernelArg(cross_check_kernel, 4, sizeof(int), &THRESHOLD);
-    clEnqueueNDRangeKernel(queue, cross_check_kernel, 2, NULL, global_size_cross, NULL, 2, zncc_events, &cross_check_kernel_event);
 
+    // Read cross checked disparity (debug output)
+    unsigned char *cross_checked_img = NULL;
+    cl_event read_cross_checked_buff_event;
+    if ((outputs & OUTPUT_CROSS_CHECKED) || opts->fill_benchmark) {
+        cross_checked_img = (unsigned char*)malloc(WIDTH * HEIGHT);
+        traced_enqueue_read_buffer(queue, cross_checked_buff, CL_FALSE, 0, WIDTH*HEIGHT, cross_checked_img, 1, &cross_check_kernel_event, &read_cross_checked_buff_event);
+    }
 
-// Read final disparity
-unsigned char *cross_checked_img = (unsigned char*)malloc(WIDTH * HEIGHT);
-cl_event read_cross_checked_buff_event;
-clEnqueueReadBuffer(queue, cross_checked_buff, CL_TRUE, 0, WIDTH*HEIGHT, cross_checked_img, 1, &cross_check_kernel_event, &read_cross_checked_buff_event);
-lodepng_encode_file("output/cross_checked.png", cross_checked_img, WIDTH, HEIGHT, LCT_GREY, 8);
+    // Matching is enqueued: the gray and raw disparity pairs become the next stages' buffers
+    pool_release(gray_left_buf);
+    pool_release(gray_right_buf);
+    pool_release(disparity_left_buf);
+    pool_release(disparity_right_buf);
     /*.....................End of Crosse checking.................................*/
 
 
@@ -369,86 +2241,225 @@ lodepng_encode_file("output/cross_checked.png", cross_checked_img, WIDTH, HEIGHT
 
 
     /*...........Occlusion Fill....................................................*/
-    cl_program occlusion_prog = build_program(context, device, "occlusion.cl", NULL);
-    cl_kernel occlusion_kernel = clCreateKernel(occlusion_prog, "occlusion_filling", NULL);
-    cl_mem occlusion_buff = clCreateBuffer(context, CL_MEM_WRITE_ONLY, WIDTH*HEIGHT, NULL, NULL);
-    size_t global_size_occlusion[2] = {WIDTH, HEIGHT};
-    cl_event occlusion_kernel_event;
-
-    clSetKernelArg(occlusion_kernel, 0, sizeof(cl_mem), &cross_checked_buff);
-    clSetKernelArg(occlusion_kernel, 1, sizeof(cl_mem), &occlusion_buff);
-    clSetKernelArg(occlusion_kernel, 2, sizeof(int), &WIDTH);
-    clSetKernelArg(occlusion_kernel, 3, sizeof(int), &HEIGHT);
-    clSetKernelArg(occlusion_kernel, 4, sizeof(int), &MAX_SEARCH_RADIUS);
-    clEnqueueNDRangeKernel(queue, occlusion_kernel, 2, NULL, global_size_occlusion, NULL, 1, &cross_check_kernel_event, &occlusion_kernel_event);
-
-    // Transfer occlusion filled image from DEVICE to the HOST
-    unsigned char *occlusion_img = (unsigned char*)malloc(WIDTH * HEIGHT);
-    cl_event read_occlusion_event;
-    clEnqueueReadBuffer(queue, occlusion_buff, CL_TRUE, 0, WIDTH*HEIGHT, occlusion_img, 1, &occlusion_kernel_event, &read_occlusion_event);
-    
-    
-    // Normalize occlusion image from [0-64] to [0-255]
-    
-    normalize_occlusion(occlusion_img, WIDTH, HEIGHT);
-    
-
-    lodepng_encode_file("output/occlusion_filled.png", occlusion_img, WIDTH, HEIGHT, LCT_GREY, 8);
+    cl_mem occlusion_buff = pool_acquire(context, CL_MEM_READ_WRITE, WIDTH*HEIGHT);
+    fill_buffers fill;
+    fill.seeds[0] = pool_acquire(context, CL_MEM_READ_WRITE, (size_t)WIDTH*HEIGHT*4);
+    fill.seeds[1] = pool_acquire(context, CL_MEM_READ_WRITE, (size_t)WIDTH*HEIGHT*4);
+    fill.holes = pool_acquire(context, CL_MEM_READ_WRITE, (size_t)WIDTH*HEIGHT*4);
+    fill.hole_count = pool_acquire(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+    cl_event occlusion_seed_event, occlusion_kernel_event;
+    unsigned flood_passes = enqueue_occlusion_fill(queue, k, cross_checked_buff, &fill, occlusion_buff, HEIGHT, 1,
+                                                   1, &cross_check_kernel_event, &occlusion_seed_event, &occlusion_kernel_event);
+    // The hole count is only needed for the report, after the queue drains
+    cl_uint hole_count = 0;
+    traced_enqueue_read_buffer(queue, fill.hole_count, CL_FALSE, 0, sizeof(hole_count), &hole_count, 0, NULL, NULL);
+    pool_release(fill.seeds[0]);
+    pool_release(fill.seeds[1]);
+    pool_release(fill.holes);
+    pool_release(fill.hole_count);
 
     /*...........END OF Occlusion Fill....................................................*/
 
 
     /*...........................Apply moving average filter to the normalized depth map............*/
-    // Apply 5x5 moving average
-    cl_program filter_prog = build_program(context, device, "moving_average.cl", NULL);
-    cl_kernel filter_kernel = clCreateKernel(filter_prog, "moving_average_5x5", NULL);
-    cl_mem filtered_occlusion_buff = clCreateBuffer(context, CL_MEM_WRITE_ONLY, WIDTH*HEIGHT, NULL, NULL);
-
-    clSetKernelArg(filter_kernel, 0, sizeof(cl_mem), &occlusion_buff);
-    clSetKernelArg(filter_kernel, 1, sizeof(cl_mem), &filtered_occlusion_buff);
-    clSetKernelArg(filter_kernel, 2, sizeof(int), &WIDTH);
-    clSetKernelArg(filter_kernel, 3, sizeof(int), &HEIGHT);
+    // Apply 5x5 moving average, or the weighted median with --median
+    cl_mem filtered_occlusion_buff = NULL;
+    unsigned char *filtered_svm = NULL;
+    if (svm) {
+        filtered_svm = (unsigned char*)clSVMAlloc(context, CL_MEM_READ_WRITE | (svm->fine_grain ? CL_MEM_SVM_FINE_GRAIN_BUFFER : 0),
+                                                  WIDTH*HEIGHT, 0);
+    } else {
+        // Read-write: normalized in place. Without pinning it recycles a dead single-channel buffer
+        filtered_occlusion_buff = pool_acquire(context, CL_MEM_READ_WRITE | (pinned ? CL_MEM_ALLOC_HOST_PTR : 0),
+                                               WIDTH*HEIGHT);
+    }
 
     cl_event filter_event;
-    clEnqueueNDRangeKernel(queue, filter_kernel, 2, NULL, global_size_occlusion, NULL, 1, &occlusion_kernel_event, &filter_event);
+    enqueue_smoothing(queue, k, occlusion_buff, filtered_occlusion_buff, filtered_svm, HEIGHT, 0, HEIGHT,
+                      1, &occlusion_kernel_event, &filter_event);
+
+    /*...........................Normalize the saved maps to [0-255] on the DEVICE............*/
+    // In place, behind the filter that reads the occlusion map; the host gets 8-bit images
+    cl_mem min_max_buff = pool_acquire(context, CL_MEM_READ_WRITE, 2 * sizeof(cl_uint));
+    cl_event normalize_occlusion_events[2], normalize_filtered_events[2];
+    unsigned char *occlusion_img = NULL;
+    cl_event read_occlusion_event;
+    if (outputs & OUTPUT_OCCLUSION) {
+        enqueue_normalize(queue, k, occlusion_buff, NULL, min_max_buff, 1, &filter_event,
+                          &normalize_occlusion_events[0], &normalize_occlusion_events[1]);
+        occlusion_img = (unsigned char*)malloc(WIDTH * HEIGHT);
+        traced_enqueue_read_buffer(queue, occlusion_buff, CL_FALSE, 0, WIDTH*HEIGHT, occlusion_img, 1, &normalize_occlusion_events[1], &read_occlusion_event);
+    }
+    if (outputs & OUTPUT_FILTERED)
+        enqueue_normalize(queue, k, filtered_occlusion_buff, filtered_svm, min_max_buff, 1, &filter_event,
+                          &normalize_filtered_events[0], &normalize_filtered_events[1]);
+    pool_release(min_max_buff);
 
     // Read final result
-    unsigned char *filtered_img = (unsigned char*)malloc(WIDTH * HEIGHT);
+    unsigned char *filtered_img = NULL;
     cl_event read_filter_event;
-    
-    clEnqueueReadBuffer(queue, filtered_occlusion_buff, CL_TRUE, 0, WIDTH*HEIGHT, filtered_img, 1, &filter_event, &read_filter_event);
-    normalize_occlusion(filtered_img, WIDTH, HEIGHT);
-    lodepng_encode_file("output/filtered_occlusion.png", filtered_img, WIDTH, HEIGHT, LCT_GREY, 8);
+    if ((outputs & OUTPUT_FILTERED) && svm) {
+        // The final map is consumed where the kernel wrote it
+        filtered_img = filtered_svm;
+        if (svm->fine_grain)
+            traced_enqueue_marker(queue, 1, &normalize_filtered_events[1], &read_filter_event);
+        else
+            traced_enqueue_svm_map(queue, CL_FALSE, CL_MAP_READ | CL_MAP_WRITE, filtered_svm, WIDTH*HEIGHT,
+                                   1, &normalize_filtered_events[1], &read_filter_event);
+    } else if ((outputs & OUTPUT_FILTERED) && pinned) {
+        // Consume the result in place
+        filtered_img = (unsigned char*)traced_enqueue_map_buffer(queue, filtered_occlusion_buff, CL_FALSE, CL_MAP_READ | CL_MAP_WRITE,
+                                                                 0, WIDTH*HEIGHT, 1, &normalize_filtered_events[1], &read_filter_event, NULL);
+    } else if (outputs & OUTPUT_FILTERED) {
+        filtered_img = (unsigned char*)malloc(WIDTH * HEIGHT);
+        traced_enqueue_read_buffer(queue, filtered_occlusion_buff, CL_FALSE, 0, WIDTH*HEIGHT, filtered_img, 1, &normalize_filtered_events[1], &read_filter_event);
+    }
+    pool_release(cross_checked_buff);
+    pool_release(occlusion_buff);
     /*...........................END of Applying moving average filter to the normalized depth map............*/
 
 
 
+    // The only host synchronization of the frame
+    clFinish(queue);
+    if (opts->fill_benchmark)
+        run_fill_benchmark(context, queue, k, cross_checked_img);
+
+
+
+    /*...............Save the requested outputs.................*/
+    if (outputs & OUTPUT_RESIZED) {
+        traced_encode32_file("output/resized_left.png", resized_left_img, WIDTH, HEIGHT);
+        traced_encode32_file("output/resized_right.png", resized_right_img, WIDTH, HEIGHT);
+    }
+    if (outputs & OUTPUT_GRAY) {
+        traced_encode_file("output/gray_left.png", gray_left_img, WIDTH, HEIGHT, LCT_GREY, 8);
+        traced_encode_file("output/gray_right.png", gray_right_img, WIDTH, HEIGHT, LCT_GREY, 8);
+    }
+    if (outputs & OUTPUT_DISPARITY) {
+        traced_encode_file("output/disparity_left.png", disparity_left_img, WIDTH, HEIGHT, LCT_GREY, 8);
+        traced_encode_file("output/disparity_right.png", disparity_right_img, WIDTH, HEIGHT, LCT_GREY, 8);
+    }
+    if (outputs & OUTPUT_CROSS_CHECKED)
+        traced_encode_file("output/cross_checked.png", cross_checked_img, WIDTH, HEIGHT, LCT_GREY, 8);
+    // Both maps were normalized from [0-64] to [0-255] on the device
+    if (outputs & OUTPUT_OCCLUSION)
+        traced_encode_file("output/occlusion_filled.png", occlusion_img, WIDTH, HEIGHT, LCT_GREY, 8);
+    if (outputs & OUTPUT_FILTERED)
+        traced_encode_file("output/filtered_occlusion.png", filtered_img, WIDTH, HEIGHT, LCT_GREY, 8);
+
+
+
 
 
     /*...............Profiling data transfer and kernel execution time.................*/
     // Print profiling info
-    print_profiling_info("Host to device transfer time for left image:", write_events[0]);
-    print_profiling_info("Host to device transfer time for right image:", write_events[1]);
-    print_profiling_info("Left image resize", resize_events[0]);
-    print_profiling_info("Right image resize", resize_events[1]);
-    print_profiling_info("Device to Host transfer time for left resized image", read_resize_events[0]);
-    print_profiling_info("Device to Host transfer time for right resized image", read_resize_events[1]);
-    print_profiling_info("Left image grayscale conversion", gray_events[0]);
-    print_profiling_info("Right image grayscale conversion", gray_events[1]);
-    print_profiling_info("Device to Host transfer time for left grascale image", read_gray_events[0]);
-    print_profiling_info("Device to Host transfer time for right grayscale image", read_gray_events[1]);
-    printf("\n");
-    print_profiling_info("Left disparity calculation: Left -> Right", zncc_events[0]);
-    print_profiling_info("Right disparity calculation: Right -> Left", zncc_events[1]);
+    print_profiling_info(svm ? "SVM hand-over time for left image:" : pinned ? "Unmap time for pinned left image:"
+                         : "Host to device transfer time for left image:", write_events[0]);
+    print_profiling_info(svm ? "SVM hand-over time for right image:" : pinned ? "Unmap time for pinned right image:"
+                         : "Host to device transfer time for right image:", write_events[1]);
+    if (separate_resize && !host_decimate) {
+        print_profiling_info("Left image resize", resize_events[0]);
+        print_profiling_info("Right image resize", resize_events[1]);
+    }
+    if (outputs & OUTPUT_RESIZED) {
+        print_profiling_info("Device to Host transfer time for left resized image", read_resize_events[0]);
+        print_profiling_info("Device to Host transfer time for right resized image", read_resize_events[1]);
+    }
+    if (separate_resize) {
+        print_profiling_info("Left image grayscale conversion", gray_events[0]);
+        print_profiling_info("Right image grayscale conversion", gray_events[1]);
+    } else if (host_decimate != HOST_DECIMATE_GRAY && !zncc_tiles_from_rgba) {
+        print_profiling_info("Left image fused resize + grayscale", gray_events[0]);
+        print_profiling_info("Right image fused resize + grayscale", gray_events[1]);
+    }
+    if (outputs & OUTPUT_GRAY) {
+        print_profiling_info("Device to Host transfer time for left grascale image", read_gray_events[0]);
+        print_profiling_info("Device to Host transfer time for right grayscale image", read_gray_events[1]);
+    }
     printf("\n");
-    print_profiling_info("Device to Host transfer time for left disparity", read_disparity_events[0]);
-    print_profiling_info("Device to Host transfer time for right disparity", read_disparity_events[1]);
-    print_profiling_info("Cross checked kernel execution time", cross_check_kernel_event);
-    print_profiling_info("Device to Host transfer time for cross checked image", read_cross_checked_buff_event);
-    print_profiling_info("Occlusion kernel execution time", occlusion_kernel_event);
-    print_profiling_info("Device to Host transfer time for occlusion filled image", read_occlusion_event);
-    print_profiling_info("Moving average filter execution time", filter_event);
-    print_profiling_info("Device to Host transfer time for filtered image", read_filter_event);
+    if (fused_zncc) {
+        print_profiling_info("Bidirectional disparity + cross check", cross_check_kernel_event);
+        printf("\n");
+    } else {
+        print_profiling_info("Left disparity calculation: Left -> Right", zncc_events[0]);
+        print_profiling_info("Right disparity calculation: Right -> Left", zncc_events[1]);
+        printf("\n");
+        if (outputs & OUTPUT_DISPARITY) {
+            print_profiling_info("Device to Host transfer time for left disparity", read_disparity_events[0]);
+            print_profiling_info("Device to Host transfer time for right disparity", read_disparity_events[1]);
+        }
+        print_profiling_info("Cross checked kernel execution time", cross_check_kernel_event);
+    }
+    if (outputs & OUTPUT_CROSS_CHECKED)
+        print_profiling_info("Device to Host transfer time for cross checked image", read_cross_checked_buff_event);
+    printf("Occlusion fill: %u holes (%.1f%%), %u jump-flooding passes over the hole list\n",
+           hole_count, 100.0 * hole_count / (WIDTH * HEIGHT), flood_passes);
+    print_profiling_span("Occlusion fill execution time", occlusion_seed_event, occlusion_kernel_event);
+    print_profiling_info(use_median_filter ? "Weighted median filter execution time" : "Moving average filter execution time",
+                         filter_event);
+    if (outputs & OUTPUT_OCCLUSION) {
+        print_profiling_span("Occlusion map normalization", normalize_occlusion_events[0], normalize_occlusion_events[1]);
+        print_profiling_info("Device to Host transfer time for occlusion filled image", read_occlusion_event);
+    }
+    if (outputs & OUTPUT_FILTERED) {
+        print_profiling_span("Filtered map normalization", normalize_filtered_events[0], normalize_filtered_events[1]);
+        print_profiling_info(svm ? "SVM hand-back time for filtered image" : pinned ? "Map time for filtered image"
+                             : "Device to Host transfer time for filtered image", read_filter_event);
+    }
+
+    // Whole chain, first upload to last command
+    cl_ulong chain_start, chain_end;
+    clGetEventProfilingInfo(write_events[0], CL_PROFILING_COMMAND_START, sizeof(chain_start), &chain_start, NULL);
+    clGetEventProfilingInfo((outputs & OUTPUT_FILTERED) ? read_filter_event : filter_event,
+                            CL_PROFILING_COMMAND_END, sizeof(chain_end), &chain_end, NULL);
+    printf("Device timeline, upload to final result: %.3f ms\n", (chain_end - chain_start) * 1e-6);
+
+    if (opts->kernel_report) {
+        const double pixels = (double)WIDTH * HEIGHT;
+        launch_work resize_work = {pixels * 8.0, 0.0};
+        launch_work gray_work = {pixels * 5.0, pixels * 5.0};
+        launch_work cross_work = {pixels * 3.0, pixels * 2.0};
+        // Seed: 1 byte in; 2 seeds, the copy and the list entry out. Per hole and pass: index,
+        // 9 seeds in, 1 out. Fill per hole: index, seed, gathered disparity, result
+        launch_work occlusion_work = {pixels * 10.0 + hole_count * (4.0 + 44.0 * flood_passes + 10.0), 0.0};
+        launch_work filter_work = {pixels * 2.0, pixels * (2.0 * FILTER_RADIUS + 1) * (2.0 * FILTER_RADIUS + 1)};
+        // Median: each group's tile with its 2-pixel halo in, the map out; the number of
+        // bisection steps depends on the window
+        const double median_groups = (double)((WIDTH + LOCAL_WIDTH - 1) / LOCAL_WIDTH) * ((HEIGHT + LOCAL_HEIGHT - 1) / LOCAL_HEIGHT);
+        launch_work median_work = {median_groups * (LOCAL_WIDTH + 4.0) * (LOCAL_HEIGHT + 4.0) + pixels, 0.0};
+        printf("\nPer-launch model work and achieved throughput\n");
+        printf("%-32s %9s %9s %9s %9s %9s\n", "launch", "ms", "MB", "GB/s", "GFLOP", "GFLOP/s");
+        if (separate_resize && !host_decimate) {
+            print_launch_work("resize (left)", resize_events[0], resize_work);
+            print_launch_work("resize (right)", resize_events[1], resize_work);
+        }
+        if (separate_resize) {
+            print_launch_work("rgba_to_grayscale (left)", gray_events[0], gray_work);
+            print_launch_work("rgba_to_grayscale (right)", gray_events[1], gray_work);
+        } else if (host_decimate != HOST_DECIMATE_GRAY && !zncc_tiles_from_rgba) {
+            print_launch_work("resize_grayscale (left)", gray_events[0], gray_work);
+            print_launch_work("resize_grayscale (right)", gray_events[1], gray_work);
+        }
+        if (fused_zncc) {
+            print_launch_work("zncc_bidirectional", cross_check_kernel_event, zncc_launch_work(1));
+        } else {
+            print_launch_work(ZNCC_SEPARATE[zncc_separate_variant].left, zncc_events[0], zncc_launch_work(0));
+            print_launch_work(ZNCC_SEPARATE[zncc_separate_variant].right, zncc_events[1], zncc_launch_work(0));
+            print_launch_work("cross_check", cross_check_kernel_event, cross_work);
+        }
+        print_launch_span("occlusion fill (jump flooding)", occlusion_seed_event, occlusion_kernel_event, occlusion_work);
+        if (use_median_filter)
+            print_launch_work("weighted_median", filter_event, median_work);
+        else
+            print_launch_work("moving_average_5x5", filter_event, filter_work);
+        // Reduction reads the map once, the rescale reads and writes it
+        launch_work normalize_work = {pixels * 3.0, pixels * 4.0};
+        if (outputs & OUTPUT_OCCLUSION)
+            print_launch_span("normalize (occlusion)", normalize_occlusion_events[0], normalize_occlusion_events[1], normalize_work);
+        if (outputs & OUTPUT_FILTERED)
+            print_launch_span("normalize (filtered)", normalize_filtered_events[0], normalize_filtered_events[1], normalize_work);
+    }
 
 
 
@@ -456,53 +2467,1466 @@ lodepng_encode_file("output/cross_checked.png", cross_checked_img, WIDTH, HEIGHT
     
     
     /*................Cleanup............*/
-    clReleaseMemObject(im0_buf);
-    clReleaseMemObject(im1_buf);
+    // Buffers still held go back to the pool for the next frame
+    if (im0_buf && pinned) {
+        clReleaseMemObject(im0_buf);
+        clReleaseMemObject(im1_buf);
+    } else if (im0_buf) {
+        pool_release(im0_buf);
+        pool_release(im1_buf);
+    }
+    if (host_decimate) {
+        for (int i = 0; i < 2; i++)
+            traced_enqueue_unmap_mem_object(queue, staging[i], staged[i], 0, NULL, NULL);
+        clFinish(queue);
+        pool_release(staging[0]);
+        pool_release(staging[1]);
+    }
+    if (svm) {
+        if (filtered_img && !svm->fine_grain)
+            traced_enqueue_svm_unmap(queue, filtered_svm, 0, NULL, NULL);
+        clFinish(queue);
+        clSVMFree(context, filtered_svm);
+        filtered_img = NULL;
+    } else {
+        if (pinned && filtered_img) {
+            traced_enqueue_unmap_mem_object(queue, filtered_occlusion_buff, filtered_img, 0, NULL, NULL);
+            clFinish(queue);
+            filtered_img = NULL;
+        }
+        pool_release(filtered_occlusion_buff);
+    }
+
+
+    free(resized_left_img);
+    free(resized_right_img);
+
+    free(gray_left_img);
+    free(gray_right_img);
+
+    free(disparity_left_img);
+    free(disparity_right_img);
+    free(cross_checked_img);
+    free(occlusion_img);
+    free(filtered_img);
+}
+
+
+/* Copy the rows a sliding window keeps to its front. The copy goes through a
+   scratch buffer because clEnqueueCopyBuffer does not allow overlapping regions */
+void slide_window(cl_command_queue queue, cl_mem window, cl_mem scratch, size_t shift_bytes, size_t keep_bytes) {
+    traced_enqueue_copy_buffer(queue, window, scratch, shift_bytes, 0, keep_bytes, 0, NULL, NULL);
+    traced_enqueue_copy_buffer(queue, scratch, window, 0, 0, keep_bytes, 0, NULL, NULL);
+}
+
+/* Upload the original rows behind gray rows [first_row, first_row + rows), then resize and
+   convert them into gray, whose first row is first_row */
+void preprocess_rows(cl_command_queue queue, pipeline_kernels *k, const unsigned char *im_data,
+                     cl_mem orig_band, cl_mem gray, unsigned first_row, unsigned rows) {
+    const size_t orig_row_bytes = (size_t)ORIG_WIDTH * 4;
+    unsigned orig_first = first_row * RESIZE_SCALE;
+    unsigned orig_rows = rows * RESIZE_SCALE;
+    if (orig_first + orig_rows > ORIG_HEIGHT) orig_rows = ORIG_HEIGHT - orig_first;
+
+    traced_enqueue_write_buffer(queue, orig_band, CL_FALSE, 0, orig_rows * orig_row_bytes,
+                                im_data + orig_first * orig_row_bytes, 0, NULL, NULL);
+
+    size_t global_size[2] = {WIDTH, rows};
+    clSetKernelArg(k->resize_gray_kernel, 0, sizeof(cl_mem), &orig_band);
+    clSetKernelArg(k->resize_gray_kernel, 1, sizeof(cl_mem), &gray);
+    clSetKernelArg(k->resize_gray_kernel, 2, sizeof(int), &ORIG_WIDTH);
+    clSetKernelArg(k->resize_gray_kernel, 3, sizeof(int), &orig_rows);
+    traced_enqueue_ndrange_kernel(queue, k->resize_gray_kernel, 2, NULL, global_size, NULL, 0, NULL, NULL);
+}
+
+/* Row-band streaming execution (low-memory mode).
+   The final map is produced band_rows rows at a time. Disparity is computed in chunks of at
+   most band_rows rows: a chunk converts the gray rows its ZNCC windows read (WINDOW_SIZE rows
+   of context, converted again by the next chunk), runs both searches and the cross check,
+   and copies its cross-checked rows into a window that slides down the image with the band.
+   The window holds `reach` = MAX_SEARCH_RADIUS + FILTER_RADIUS rows on each side of the band,
+   every row the fill of the smoothed rows can read. The fill is the exact ring search
+   (occlusion_ring_fill), which needs nothing beyond those rows, so each filled row is
+   computed once into a second window of FILTER_RADIUS rows around the band and smoothed
+   from there. parse_options keeps band_rows + 2 * reach below HEIGHT, so every device buffer
+   is sized by band_rows and the constant halos, not by the image height.
+   The result matches full-frame mode wherever its jump flooding finds the nearest valid
+   pixel, which on the reference pair is every pixel. The host holds the decoded pair and the
+   output map, as in every mode: lodepng decodes and encodes whole images. */
+void run_banded(cl_context context, cl_command_queue queue, pipeline_kernels *k,
+                unsigned char *im0_data, unsigned char *im1_data, unsigned band_rows) {
+    const unsigned reach = MAX_SEARCH_RADIUS + FILTER_RADIUS;
+    unsigned chunk_rows = band_rows + 2 * WINDOW_SIZE;
+    if (chunk_rows > HEIGHT) chunk_rows = HEIGHT;
+    const unsigned window_rows = band_rows + 2 * reach;
+    const unsigned occlusion_rows = band_rows + 2 * FILTER_RADIUS;
+
+    // Chunk buffers: original rows, gray rows with their ZNCC context, disparity and cross check
+    size_t orig_chunk_bytes = (size_t)ORIG_WIDTH * 4 * chunk_rows * RESIZE_SCALE;
+    size_t chunk_bytes = (size_t)WIDTH * chunk_rows;
+    cl_mem orig_left_chunk = clCreateBuffer(context, CL_MEM_READ_ONLY, orig_chunk_bytes, NULL, NULL);
+    cl_mem orig_right_chunk = clCreateBuffer(context, CL_MEM_READ_ONLY, orig_chunk_bytes, NULL, NULL);
+    cl_mem gray_left_chunk = clCreateBuffer(context, CL_MEM_READ_WRITE, chunk_bytes, NULL, NULL);
+    cl_mem gray_right_chunk = clCreateBuffer(context, CL_MEM_READ_WRITE, chunk_bytes, NULL, NULL);
+    cl_mem disparity_left_chunk = clCreateBuffer(context, CL_MEM_READ_WRITE, chunk_bytes, NULL, NULL);
+    cl_mem disparity_right_chunk = clCreateBuffer(context, CL_MEM_READ_WRITE, chunk_bytes, NULL, NULL);
+    cl_mem cross_checked_chunk = clCreateBuffer(context, CL_MEM_READ_WRITE, chunk_bytes, NULL, NULL);
+
+    // Sliding windows of the cross-checked and the filled rows; scratch serves both slides
+    size_t window_bytes = (size_t)WIDTH * window_rows;
+    size_t occlusion_bytes = (size_t)WIDTH * occlusion_rows;
+    cl_mem cross_checked_win = clCreateBuffer(context, CL_MEM_READ_WRITE, window_bytes, NULL, NULL);
+    cl_mem occlusion_win = clCreateBuffer(context, CL_MEM_READ_WRITE, occlusion_bytes, NULL, NULL);
+    cl_mem filtered_win = clCreateBuffer(context, CL_MEM_READ_WRITE, occlusion_bytes, NULL, NULL);
+    cl_mem scratch = clCreateBuffer(context, CL_MEM_READ_WRITE, window_bytes, NULL, NULL);
+
+    unsigned char *filtered_img = (unsigned char*)malloc(WIDTH * HEIGHT);
+    size_t local_size[2] = {LOCAL_WIDTH, LOCAL_HEIGHT};
+    unsigned window_base = 0, occlusion_base = 0;   // first image row of each window
+    unsigned zncc_done = 0, occlusion_done = 0;     // rows computed so far per stage
+    unsigned num_bands = 0, num_chunks = 0;
+
+    for (unsigned y0 = 0; y0 < HEIGHT; y0 += band_rows, num_bands++) {
+        unsigned y1 = y0 + band_rows < HEIGHT ? y0 + band_rows : HEIGHT;
+
+        // Slide the windows so they start `reach` and FILTER_RADIUS rows above the band
+        unsigned new_base = y0 > reach ? y0 - reach : 0;
+        if (new_base > HEIGHT - window_rows) new_base = HEIGHT - window_rows;
+        if (new_base > window_base) {
+            size_t shift_bytes = (size_t)(new_base - window_base) * WIDTH;
+            slide_window(queue, cross_checked_win, scratch, shift_bytes, window_bytes - shift_bytes);
+            window_base = new_base;
+        }
+        new_base = y0 > FILTER_RADIUS ? y0 - FILTER_RADIUS : 0;
+        if (new_base > HEIGHT - occlusion_rows) new_base = HEIGHT - occlusion_rows;
+        if (new_base > occlusion_base) {
+            size_t shift_bytes = (size_t)(new_base - occlusion_base) * WIDTH;
+            slide_window(queue, occlusion_win, scratch, shift_bytes, occlusion_bytes - shift_bytes);
+            occlusion_base = new_base;
+        }
+
+        // Disparity and cross-check, a chunk at a time, for every row the occlusion fill can reach
+        unsigned zncc_target = y1 + reach < HEIGHT ? y1 + reach : HEIGHT;
+        while (zncc_done < zncc_target) {
+            unsigned z0 = zncc_done;
+            unsigned z1 = zncc_target - z0 < band_rows ? zncc_target : z0 + band_rows;
+            unsigned g0 = z0 > WINDOW_SIZE ? z0 - WINDOW_SIZE : 0;
+            unsigned g1 = z1 + WINDOW_SIZE < HEIGHT ? z1 + WINDOW_SIZE : HEIGHT;
+            int gray_rows = g1 - g0;
+            preprocess_rows(queue, k, im0_data, orig_left_chunk, gray_left_chunk, g0, gray_rows);
+            preprocess_rows(queue, k, im1_data, orig_right_chunk, gray_right_chunk, g0, gray_rows);
+
+            // The chunk's gray rows are a map gray_rows high: its first and last WINDOW_SIZE
+            // rows are only border rows where they are the image's
+            size_t offset[2] = {0, z0 - g0};
+            size_t global_size[2] = {
+                ((WIDTH + local_size[0]-1)/local_size[0])*local_size[0],
+                ((z1 - z0 + local_size[1]-1)/local_size[1])*local_size[1]
+            };
+            size_t global_size_rows[2] = {WIDTH, z1 - z0};
+
+            clSetKernelArg(k->zncc_left_to_right_kernel, 0, sizeof(cl_mem), &gray_left_chunk);
+            clSetKernelArg(k->zncc_left_to_right_kernel, 1, sizeof(cl_mem), &gray_right_chunk);
+            clSetKernelArg(k->zncc_left_to_right_kernel, 2, sizeof(cl_mem), &disparity_left_chunk);
+            clSetKernelArg(k->zncc_left_to_right_kernel, 3, sizeof(int), &WIDTH);
+            clSetKernelArg(k->zncc_left_to_right_kernel, 4, sizeof(int), &gray_rows);
+            clSetKernelArg(k->zncc_left_to_right_kernel, 5, sizeof(int), &MAX_DISP);
+            clSetKernelArg(k->zncc_left_to_right_kernel, 6, sizeof(int), &WINDOW_SIZE);
+            traced_enqueue_ndrange_kernel(queue, k->zncc_left_to_right_kernel, 2, offset, global_size, local_size, 0, NULL, NULL);
+
+            clSetKernelArg(k->zncc_right_to_left_kernel, 0, sizeof(cl_mem), &gray_right_chunk);
+            clSetKernelArg(k->zncc_right_to_left_kernel, 1, sizeof(cl_mem), &gray_left_chunk);
+            clSetKernelArg(k->zncc_right_to_left_kernel, 2, sizeof(cl_mem), &disparity_right_chunk);
+            clSetKernelArg(k->zncc_right_to_left_kernel, 3, sizeof(int), &WIDTH);
+            clSetKernelArg(k->zncc_right_to_left_kernel, 4, sizeof(int), &gray_rows);
+            clSetKernelArg(k->zncc_right_to_left_kernel, 5, sizeof(int), &MAX_DISP);
+            clSetKernelArg(k->zncc_right_to_left_kernel, 6, sizeof(int), &WINDOW_SIZE);
+            traced_enqueue_ndrange_kernel(queue, k->zncc_right_to_left_kernel, 2, offset, global_size, local_size, 0, NULL, NULL);
+
+            clSetKernelArg(k->cross_check_kernel, 0, sizeof(cl_mem), &disparity_left_chunk);
+            clSetKernelArg(k->cross_check_kernel, 1, sizeof(cl_mem), &disparity_right_chunk);
+            clSetKernelArg(k->cross_check_kernel, 2, sizeof(cl_mem), &cross_checked_chunk);
+            clSetKernelArg(k->cross_check_kernel, 3, sizeof(int), &WIDTH);
+            clSetKernelArg(k->cross_check_kernel, 4, sizeof(int), &THRESHOLD);
+            traced_enqueue_ndrange_kernel(queue, k->cross_check_kernel, 2, offset, global_size_rows, NULL, 0, NULL, NULL);
+
+            traced_enqueue_copy_buffer(queue, cross_checked_chunk, cross_checked_win, (size_t)(z0 - g0) * WIDTH,
+                                       (size_t)(z0 - window_base) * WIDTH, (size_t)(z1 - z0) * WIDTH, 0, NULL, NULL);
+            zncc_done = z1;
+            num_chunks++;
+        }
+
+        // Fill the rows the moving average reads that no earlier band filled
+        unsigned occlusion_target = y1 + FILTER_RADIUS < HEIGHT ? y1 + FILTER_RADIUS : HEIGHT;
+        if (occlusion_target > occlusion_done) {
+            int window_height = zncc_done - window_base;
+            int filled_first_row = occlusion_base - window_base;
+            size_t offset[2] = {0, occlusion_done - window_base};
+            size_t global_size[2] = {WIDTH, occlusion_target - occlusion_done};
+            clSetKernelArg(k->occlusion_ring_kernel, 0, sizeof(cl_mem), &cross_checked_win);
+            clSetKernelArg(k->occlusion_ring_kernel, 1, sizeof(cl_mem), &occlusion_win);
+            clSetKernelArg(k->occlusion_ring_kernel, 2, sizeof(int), &WIDTH);
+            clSetKernelArg(k->occlusion_ring_kernel, 3, sizeof(int), &window_height);
+            clSetKernelArg(k->occlusion_ring_kernel, 4, sizeof(int), &filled_first_row);
+            clSetKernelArg(k->occlusion_ring_kernel, 5, sizeof(int), &MAX_SEARCH_RADIUS);
+            traced_enqueue_ndrange_kernel(queue, k->occlusion_ring_kernel, 2, offset, global_size, NULL, 0, NULL, NULL);
+            occlusion_done = occlusion_target;
+        }
+
+        // Smoothing over the band itself, then hand the band to the host
+        enqueue_smoothing(queue, k, occlusion_win, filtered_win, NULL, occlusion_done - occlusion_base,
+                          y0 - occlusion_base, y1 - y0, 0, NULL, NULL);
+        traced_enqueue_read_buffer(queue, filtered_win, CL_TRUE, (size_t)(y0 - occlusion_base) * WIDTH,
+                                   (size_t)(y1 - y0) * WIDTH, filtered_img + (size_t)y0 * WIDTH, 0, NULL, NULL);
+    }
+
+    // The bands are never on the device together, so the whole-map normalization stays on the host
+    normalize_occlusion(filtered_img, WIDTH, HEIGHT);
+    traced_encode_file("output/filtered_occlusion.png", filtered_img, WIDTH, HEIGHT, LCT_GREY, 8);
+
+    // Chunks: 2 original, 2 gray, 2 disparity, 1 cross-checked; windows: cross-checked and
+    // scratch, filled and filtered
+    size_t band_device_bytes = 2 * orig_chunk_bytes + 5 * chunk_bytes + 2 * window_bytes + 2 * occlusion_bytes;
+    size_t full_device_bytes = 2 * (size_t)ORIG_WIDTH * ORIG_HEIGHT * 4 + 21 * (size_t)WIDTH * HEIGHT;
+    printf("Band mode: %u bands of %u rows, %u ZNCC chunks of up to %u gray rows, "
+           "cross-checked window %u rows (fill reach %u rows)\n",
+           num_bands, band_rows, num_chunks, chunk_rows, window_rows, reach);
+    printf("Peak device memory: %.2f MB (full-frame mode: %.2f MB)\n",
+           band_device_bytes / (1024.0 * 1024.0), full_device_bytes / (1024.0 * 1024.0));
+
+    clReleaseMemObject(orig_left_chunk);
+    clReleaseMemObject(orig_right_chunk);
+    clReleaseMemObject(gray_left_chunk);
+    clReleaseMemObject(gray_right_chunk);
+    clReleaseMemObject(disparity_left_chunk);
+    clReleaseMemObject(disparity_right_chunk);
+    clReleaseMemObject(cross_checked_chunk);
+    clReleaseMemObject(cross_checked_win);
+    clReleaseMemObject(occlusion_win);
+    clReleaseMemObject(filtered_win);
+    clReleaseMemObject(scratch);
+    free(filtered_img);
+}
+
+/* Hybrid CPU + OpenCL co-execution.
+   Resize and grayscale run on the device and the gray pair is read back. The disparity rows
+   are then split: the device computes rows [0, split) while the CPU matcher computes rows
+   [split, HEIGHT) at the same time. Both sides read the full gray images, so rows on either
+   side of the split see their complete 9x9 window and the two halves stitch without seams.
+   The CPU rows are written into the device disparity buffers and cross-check, occlusion fill
+   and moving average finish on the device. After every frame the split is moved to match
+   the measured rows/ms of both sides.
+   The CPU matcher cannot reproduce the device's rsqrt and fast math bit for bit (see
+   zncc_row_cpu), so after the first frame it also matches the last device work-group row
+   and reports how many of those pixels differ from the device. */
+void run_hybrid(cl_context context, cl_command_queue queue, pipeline_kernels *k,
+                unsigned char *im0_data, unsigned char *im1_data, unsigned frames) {
+    const size_t orig_bytes = (size_t)ORIG_WIDTH * ORIG_HEIGHT * 4;
+    const unsigned split_step = LOCAL_HEIGHT;   // ZNCC work-group height
+    cl_mem im0_buf = clCreateBuffer(context, CL_MEM_READ_ONLY, orig_bytes, NULL, NULL);
+    cl_mem im1_buf = clCreateBuffer(context, CL_MEM_READ_ONLY, orig_bytes, NULL, NULL);
+    cl_mem gray_left_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, WIDTH*HEIGHT, NULL, NULL);
+    cl_mem gray_right_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, WIDTH*HEIGHT, NULL, NULL);
+    cl_mem disparity_left_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, WIDTH*HEIGHT, NULL, NULL);
+    cl_mem disparity_right_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, WIDTH*HEIGHT, NULL, NULL);
+    cl_mem cross_checked_buff = clCreateBuffer(context, CL_MEM_READ_WRITE, WIDTH*HEIGHT, NULL, NULL);
+    fill_buffers fill;
+    create_fill_buffers(context, HEIGHT, &fill);
+    cl_mem occlusion_buff = clCreateBuffer(context, CL_MEM_READ_WRITE, WIDTH*HEIGHT, NULL, NULL);
+    cl_mem filtered_occlusion_buff = clCreateBuffer(context, CL_MEM_READ_WRITE, WIDTH*HEIGHT, NULL, NULL);
+    cl_mem min_max_buff = clCreateBuffer(context, CL_MEM_READ_WRITE, 2 * sizeof(cl_uint), NULL, NULL);
 
+    unsigned char *gray_left_img = (unsigned char*)malloc(WIDTH*HEIGHT);
+    unsigned char *gray_right_img = (unsigned char*)malloc(WIDTH*HEIGHT);
+    unsigned char *disparity_left_img = (unsigned char*)malloc(WIDTH*HEIGHT);
+    unsigned char *disparity_right_img = (unsigned char*)malloc(WIDTH*HEIGHT);
+    unsigned char *filtered_img = (unsigned char*)malloc(WIDTH*HEIGHT);
+
+    size_t global_size_image[2] = {WIDTH, HEIGHT};
+    size_t local_size[2] = {LOCAL_WIDTH, LOCAL_HEIGHT};
+    unsigned split = (HEIGHT / 2 / split_step) * split_step;   // Start with an even split
+    double total_ms = 0.0;
+
+    for (unsigned frame = 0; frame < frames; frame++) {
+        double frame_start = omp_get_wtime();
+
+        // Preprocess on the device and bring the gray pair back for the CPU matcher
+        traced_enqueue_write_buffer(queue, im0_buf, CL_FALSE, 0, orig_bytes, im0_data, 0, NULL, NULL);
+        traced_enqueue_write_buffer(queue, im1_buf, CL_FALSE, 0, orig_bytes, im1_data, 0, NULL, NULL);
+        clSetKernelArg(k->resize_gray_kernel, 2, sizeof(int), &ORIG_WIDTH);
+        clSetKernelArg(k->resize_gray_kernel, 3, sizeof(int), &ORIG_HEIGHT);
+        clSetKernelArg(k->resize_gray_kernel, 0, sizeof(cl_mem), &im0_buf);
+        clSetKernelArg(k->resize_gray_kernel, 1, sizeof(cl_mem), &gray_left_buf);
+        traced_enqueue_ndrange_kernel(queue, k->resize_gray_kernel, 2, NULL, global_size_image, NULL, 0, NULL, NULL);
+        clSetKernelArg(k->resize_gray_kernel, 0, sizeof(cl_mem), &im1_buf);
+        clSetKernelArg(k->resize_gray_kernel, 1, sizeof(cl_mem), &gray_right_buf);
+        traced_enqueue_ndrange_kernel(queue, k->resize_gray_kernel, 2, NULL, global_size_image, NULL, 0, NULL, NULL);
+        traced_enqueue_read_buffer(queue, gray_left_buf, CL_TRUE, 0, WIDTH*HEIGHT, gray_left_img, 0, NULL, NULL);
+        traced_enqueue_read_buffer(queue, gray_right_buf, CL_TRUE, 0, WIDTH*HEIGHT, gray_right_img, 0, NULL, NULL);
+
+        // Device share: rows [0, split)
+        cl_event zncc_events[2];
+        if (split > 0) {
+            size_t global_size[2] = {
+                ((WIDTH + local_size[0]-1)/local_size[0])*local_size[0],
+                split
+            };
+            clSetKernelArg(k->zncc_left_to_right_kernel, 0, sizeof(cl_mem), &gray_left_buf);
+            clSetKernelArg(k->zncc_left_to_right_kernel, 1, sizeof(cl_mem), &gray_right_buf);
+            clSetKernelArg(k->zncc_left_to_right_kernel, 2, sizeof(cl_mem), &disparity_left_buf);
+            clSetKernelArg(k->zncc_left_to_right_kernel, 3, sizeof(int), &WIDTH);
+            clSetKernelArg(k->zncc_left_to_right_kernel, 4, sizeof(int), &HEIGHT);
+            clSetKernelArg(k->zncc_left_to_right_kernel, 5, sizeof(int), &MAX_DISP);
+            clSetKernelArg(k->zncc_left_to_right_kernel, 6, sizeof(int), &WINDOW_SIZE);
+            traced_enqueue_ndrange_kernel(queue, k->zncc_left_to_right_kernel, 2, NULL, global_size, local_size, 0, NULL, &zncc_events[0]);
+
+            clSetKernelArg(k->zncc_right_to_left_kernel, 0, sizeof(cl_mem), &gray_right_buf);
+            clSetKernelArg(k->zncc_right_to_left_kernel, 1, sizeof(cl_mem), &gray_left_buf);
+            clSetKernelArg(k->zncc_right_to_left_kernel, 2, sizeof(cl_mem), &disparity_right_buf);
+            clSetKernelArg(k->zncc_right_to_left_kernel, 3, sizeof(int), &WIDTH);
+            clSetKernelArg(k->zncc_right_to_left_kernel, 4, sizeof(int), &HEIGHT);
+            clSetKernelArg(k->zncc_right_to_left_kernel, 5, sizeof(int), &MAX_DISP);
+            clSetKernelArg(k->zncc_right_to_left_kernel, 6, sizeof(int), &WINDOW_SIZE);
+            traced_enqueue_ndrange_kernel(queue, k->zncc_right_to_left_kernel, 2, NULL, global_size, local_size, 0, NULL, &zncc_events[1]);
+            clFlush(queue);
+        }
+
+        // CPU share: rows [split, HEIGHT), overlapping the device kernels
+        double cpu_start = omp_get_wtime();
+        zncc_disparity_cpu(gray_left_img, gray_right_img, disparity_left_img, disparity_right_img,
+                           WIDTH, HEIGHT, split, HEIGHT);
+        double cpu_ms = (omp_get_wtime() - cpu_start) * 1000.0;
+
+        double device_ms = 0.0;
+        if (split > 0) {
+            cl_ulong start, end;
+            clWaitForEvents(2, zncc_events);
+            clGetEventProfilingInfo(zncc_events[0], CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+            clGetEventProfilingInfo(zncc_events[1], CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+            device_ms = (end - start) * 1e-6;
+            clReleaseEvent(zncc_events[0]);
+            clReleaseEvent(zncc_events[1]);
+        }
+
+        // Stitch: the CPU rows overwrite the tail of the device disparity maps
+        if (split < HEIGHT) {
+            traced_enqueue_write_buffer(queue, disparity_left_buf, CL_FALSE, split*WIDTH, (HEIGHT-split)*WIDTH,
+                                        disparity_left_img + split*WIDTH, 0, NULL, NULL);
+            traced_enqueue_write_buffer(queue, disparity_right_buf, CL_FALSE, split*WIDTH, (HEIGHT-split)*WIDTH,
+                                        disparity_right_img + split*WIDTH, 0, NULL, NULL);
+        }
+
+        // Post-processing on the device
+        clSetKernelArg(k->cross_check_kernel, 0, sizeof(cl_mem), &disparity_left_buf);
+        clSetKernelArg(k->cross_check_kernel, 1, sizeof(cl_mem), &disparity_right_buf);
+        clSetKernelArg(k->cross_check_kernel, 2, sizeof(cl_mem), &cross_checked_buff);
+        clSetKernelArg(k->cross_check_kernel, 3, sizeof(int), &WIDTH);
+        clSetKernelArg(k->cross_check_kernel, 4, sizeof(int), &THRESHOLD);
+        traced_enqueue_ndrange_kernel(queue, k->cross_check_kernel, 2, NULL, global_size_image, NULL, 0, NULL, NULL);
+
+        enqueue_occlusion_fill(queue, k, cross_checked_buff, &fill, occlusion_buff, HEIGHT, 1, 0, NULL, NULL, NULL);
+
+        enqueue_smoothing(queue, k, occlusion_buff, filtered_occlusion_buff, NULL, HEIGHT, 0, HEIGHT, 0, NULL, NULL);
+        enqueue_normalize(queue, k, filtered_occlusion_buff, NULL, min_max_buff, 0, NULL, NULL, NULL);
+        traced_enqueue_read_buffer(queue, filtered_occlusion_buff, CL_TRUE, 0, WIDTH*HEIGHT, filtered_img, 0, NULL, NULL);
+
+        double frame_ms = (omp_get_wtime() - frame_start) * 1000.0;
+        total_ms += frame_ms;
+        printf("Frame %u: device rows %u (%.3f ms), CPU rows %u (%.3f ms), frame %.3f ms\n",
+               frame, split, device_ms, HEIGHT - split, cpu_ms, frame_ms);
+
+        // Match the last device rows on the CPU too, outside the timed frame
+        if (frame == 0 && split > 0) {
+            unsigned check_first = split > split_step ? split - split_step : 0;
+            size_t check_bytes = (size_t)(split - check_first) * WIDTH;
+            unsigned char *device_rows = (unsigned char*)malloc(2 * check_bytes);
+            traced_enqueue_read_buffer(queue, disparity_left_buf, CL_FALSE, check_first * WIDTH, check_bytes,
+                                       device_rows, 0, NULL, NULL);
+            traced_enqueue_read_buffer(queue, disparity_right_buf, CL_TRUE, check_first * WIDTH, check_bytes,
+                                       device_rows + check_bytes, 0, NULL, NULL);
+            zncc_disparity_cpu(gray_left_img, gray_right_img, disparity_left_img, disparity_right_img,
+                               WIDTH, HEIGHT, check_first, split);
+            size_t mismatches = 0;
+            for (size_t i = 0; i < check_bytes; i++) {
+                mismatches += device_rows[i] != disparity_left_img[check_first * WIDTH + i];
+                mismatches += device_rows[check_bytes + i] != disparity_right_img[check_first * WIDTH + i];
+            }
+            printf("CPU matcher on device rows %u-%u: %.3f%% of the disparities differ from the device\n",
+                   check_first, split - 1, 100.0 * mismatches / (2 * check_bytes));
+            free(device_rows);
+        }
+
+        // Re-balance from the measured throughput, keeping at least one work-group row on
+        // each side so both rates stay measurable
+        if (split > 0 && split < HEIGHT && device_ms > 0.0 && cpu_ms > 0.0) {
+            double device_rate = split / device_ms;
+            double cpu_rate = (HEIGHT - split) / cpu_ms;
+            double device_share = device_rate / (device_rate + cpu_rate);
+            unsigned new_split = (unsigned)(device_share * HEIGHT / split_step + 0.5) * split_step;
+            if (new_split < split_step) new_split = split_step;
+            if (new_split > HEIGHT - split_step) new_split = ((HEIGHT - split_step) / split_step) * split_step;
+            split = new_split;
+        }
+    }
+
+    printf("Hybrid mode: %u frames, average %.3f ms per frame, final device share %.1f%%\n",
+           frames, total_ms / frames, 100.0 * split / HEIGHT);
+
+    traced_encode_file("output/filtered_occlusion.png", filtered_img, WIDTH, HEIGHT, LCT_GREY, 8);
 
-    clReleaseMemObject(resized_left_buf);
-    clReleaseMemObject(resized_right_buf);
+    clReleaseMemObject(im0_buf);
+    clReleaseMemObject(im1_buf);
     clReleaseMemObject(gray_left_buf);
     clReleaseMemObject(gray_right_buf);
     clReleaseMemObject(disparity_left_buf);
     clReleaseMemObject(disparity_right_buf);
     clReleaseMemObject(cross_checked_buff);
+    release_fill_buffers(&fill);
     clReleaseMemObject(occlusion_buff);
     clReleaseMemObject(filtered_occlusion_buff);
+    clReleaseMemObject(min_max_buff);
+
+    free(gray_left_img);
+    free(gray_right_img);
+    free(disparity_left_img);
+    free(disparity_right_img);
+    free(filtered_img);
+}
 
+/* Multi-frame streaming.
+   NUM_STREAM_SLOTS complete sets of device buffers rotate over the frames. Uploads go to an
+   upload queue, the kernel chain to the compute queue and the readback of the final map to a
+   download queue, chained by events. Frame N+1 is decoded and uploaded and frame N-1 is read
+   back while frame N's kernels run. The host only blocks when it needs a slot back, i.e. on
+   the download of frame N-NUM_STREAM_SLOTS. */
+#define NUM_STREAM_SLOTS 3
+
+typedef struct {
+    cl_mem im0_buf, im1_buf;
+    cl_mem gray_buf[2], disparity_buf[2];
+    cl_mem cross_checked_buff, occlusion_buff, filtered_occlusion_buff, min_max_buff;
+    fill_buffers fill;
+    unsigned char *left_host, *right_host;  // Decoded input, owned when read from a sequence
+    unsigned char *filtered_img;
+    cl_event upload_events[2], first_kernel_event, compute_event, download_event;
+    unsigned frame;
+    int busy;
+} stream_slot;
+
+// Load frame `frame` of a sequence directory: DIR/im0_0000.png, DIR/im1_0000.png, ...
+int load_sequence_frame(const char *dir, unsigned frame, unsigned char **left, unsigned char **right) {
+    char path[1024];
+    unsigned w, h;
+    snprintf(path, sizeof(path), "%s/im0_%04u.png", dir, frame);
+    if (traced_decode32_file(left, &w, &h, path) || w != ORIG_WIDTH || h != ORIG_HEIGHT) {
+        free(*left);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/im1_%04u.png", dir, frame);
+    if (traced_decode32_file(right, &w, &h, path) || w != ORIG_WIDTH || h != ORIG_HEIGHT) {
+        free(*left);
+        free(*right);
+        return -1;
+    }
+    return 0;
+}
 
-    clReleaseKernel(resize_kernel);
-    clReleaseKernel(gray_kernel);
-    clReleaseKernel(zncc_left_to_right_kernel);
-    clReleaseKernel(zncc_right_to_left_kernel);
-    clReleaseKernel(cross_check_kernel);
-    clReleaseKernel(occlusion_kernel);
-    clReleaseKernel(filter_kernel);
+// Enqueue upload, kernel chain and readback of one frame on its slot without blocking
+void enqueue_stream_frame(cl_command_queue upload_queue, cl_command_queue compute_queue,
+                          cl_command_queue download_queue, pipeline_kernels *k, stream_slot *s) {
+    const size_t orig_bytes = (size_t)ORIG_WIDTH * ORIG_HEIGHT * 4;
+    size_t global_size_image[2] = {WIDTH, HEIGHT};
+    size_t local_size[2] = {LOCAL_WIDTH, LOCAL_HEIGHT};
+    size_t global_size_zncc[2] = {
+        ((WIDTH + local_size[0]-1)/local_size[0])*local_size[0],
+        ((HEIGHT + local_size[1]-1)/local_size[1])*local_size[1]
+    };
+    cl_mem inputs[2] = {s->im0_buf, s->im1_buf};
+    cl_event resize_events[2];
 
+    traced_enqueue_write_buffer(upload_queue, s->im0_buf, CL_FALSE, 0, orig_bytes, s->left_host, 0, NULL, &s->upload_events[0]);
+    traced_enqueue_write_buffer(upload_queue, s->im1_buf, CL_FALSE, 0, orig_bytes, s->right_host, 0, NULL, &s->upload_events[1]);
+
+    // The compute queue is in-order, so only the cross-queue dependencies need events
+    clSetKernelArg(k->resize_gray_kernel, 2, sizeof(int), &ORIG_WIDTH);
+    clSetKernelArg(k->resize_gray_kernel, 3, sizeof(int), &ORIG_HEIGHT);
+    for (int i = 0; i < 2; i++) {
+        clSetKernelArg(k->resize_gray_kernel, 0, sizeof(cl_mem), &inputs[i]);
+        clSetKernelArg(k->resize_gray_kernel, 1, sizeof(cl_mem), &s->gray_buf[i]);
+        traced_enqueue_ndrange_kernel(compute_queue, k->resize_gray_kernel, 2, NULL, global_size_image, NULL,
+                                      1, &s->upload_events[i], &resize_events[i]);
+    }
+    s->first_kernel_event = resize_events[0];
+    clReleaseEvent(resize_events[1]);
+
+    clSetKernelArg(k->zncc_left_to_right_kernel, 0, sizeof(cl_mem), &s->gray_buf[0]);
+    clSetKernelArg(k->zncc_left_to_right_kernel, 1, sizeof(cl_mem), &s->gray_buf[1]);
+    clSetKernelArg(k->zncc_left_to_right_kernel, 2, sizeof(cl_mem), &s->disparity_buf[0]);
+    clSetKernelArg(k->zncc_left_to_right_kernel, 3, sizeof(int), &WIDTH);
+    clSetKernelArg(k->zncc_left_to_right_kernel, 4, sizeof(int), &HEIGHT);
+    clSetKernelArg(k->zncc_left_to_right_kernel, 5, sizeof(int), &MAX_DISP);
+    clSetKernelArg(k->zncc_left_to_right_kernel, 6, sizeof(int), &WINDOW_SIZE);
+    traced_enqueue_ndrange_kernel(compute_queue, k->zncc_left_to_right_kernel, 2, NULL, global_size_zncc, local_size, 0, NULL, NULL);
+
+    clSetKernelArg(k->zncc_right_to_left_kernel, 0, sizeof(cl_mem), &s->gray_buf[1]);
+    clSetKernelArg(k->zncc_right_to_left_kernel, 1, sizeof(cl_mem), &s->gray_buf[0]);
+    clSetKernelArg(k->zncc_right_to_left_kernel, 2, sizeof(cl_mem), &s->disparity_buf[1]);
+    clSetKernelArg(k->zncc_right_to_left_kernel, 3, sizeof(int), &WIDTH);
+    clSetKernelArg(k->zncc_right_to_left_kernel, 4, sizeof(int), &HEIGHT);
+    clSetKernelArg(k->zncc_right_to_left_kernel, 5, sizeof(int), &MAX_DISP);
+    clSetKernelArg(k->zncc_right_to_left_kernel, 6, sizeof(int), &WINDOW_SIZE);
+    traced_enqueue_ndrange_kernel(compute_queue, k->zncc_right_to_left_kernel, 2, NULL, global_size_zncc, local_size, 0, NULL, NULL);
+
+    clSetKernelArg(k->cross_check_kernel, 0, sizeof(cl_mem), &s->disparity_buf[0]);
+    clSetKernelArg(k->cross_check_kernel, 1, sizeof(cl_mem), &s->disparity_buf[1]);
+    clSetKernelArg(k->cross_check_kernel, 2, sizeof(cl_mem), &s->cross_checked_buff);
+    clSetKernelArg(k->cross_check_kernel, 3, sizeof(int), &WIDTH);
+    clSetKernelArg(k->cross_check_kernel, 4, sizeof(int), &THRESHOLD);
+    traced_enqueue_ndrange_kernel(compute_queue, k->cross_check_kernel, 2, NULL, global_size_image, NULL, 0, NULL, NULL);
+
+    enqueue_occlusion_fill(compute_queue, k, s->cross_checked_buff, &s->fill, s->occlusion_buff,
+                           HEIGHT, 1, 0, NULL, NULL, NULL);
+
+    enqueue_smoothing(compute_queue, k, s->occlusion_buff, s->filtered_occlusion_buff, NULL, HEIGHT, 0, HEIGHT,
+                      0, NULL, NULL);
+    enqueue_normalize(compute_queue, k, s->filtered_occlusion_buff, NULL, s->min_max_buff, 0, NULL, NULL, &s->compute_event);
+
+    traced_enqueue_read_buffer(download_queue, s->filtered_occlusion_buff, CL_FALSE, 0, WIDTH*HEIGHT, s->filtered_img,
+                               1, &s->compute_event, &s->download_event);
+
+    // Submit now so the device does not wait for the next blocking call
+    clFlush(upload_queue);
+    clFlush(compute_queue);
+    clFlush(download_queue);
+    s->busy = 1;
+}
 
-    clReleaseProgram(resize_prog);
-    clReleaseProgram(gray_prog);
-    clReleaseProgram(zncc_prog_left);
-    clReleaseProgram(zncc_prog_right);
-    clReleaseProgram(cross_check_prog);
-    clReleaseProgram(occlusion_prog);
-    clReleaseProgram(filter_prog);
+/* Wait for the frame on a slot, report its timeline and hand the slot back.
+   Returns the frame latency (first upload queued to result on the host) in ms */
+double finish_stream_slot(stream_slot *s, int owns_input, int save_each) {
+    cl_ulong queued, upload_end, compute_start, compute_end, download_end;
+    clWaitForEvents(1, &s->download_event);
+    clGetEventProfilingInfo(s->upload_events[0], CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, NULL);
+    clGetEventProfilingInfo(s->upload_events[1], CL_PROFILING_COMMAND_END, sizeof(upload_end), &upload_end, NULL);
+    clGetEventProfilingInfo(s->first_kernel_event, CL_PROFILING_COMMAND_START, sizeof(compute_start), &compute_start, NULL);
+    clGetEventProfilingInfo(s->compute_event, CL_PROFILING_COMMAND_END, sizeof(compute_end), &compute_end, NULL);
+    clGetEventProfilingInfo(s->download_event, CL_PROFILING_COMMAND_END, sizeof(download_end), &download_end, NULL);
+    double latency_ms = (download_end - queued) * 1e-6;
+    printf("Frame %u: latency %.3f ms (upload done +%.3f, kernels %.3f-%.3f, result +%.3f)\n",
+           s->frame, latency_ms, (upload_end - queued) * 1e-6,
+           (compute_start - queued) * 1e-6, (compute_end - queued) * 1e-6, latency_ms);
+
+    if (save_each) {
+        char path[64];
+        snprintf(path, sizeof(path), "output/filtered_%04u.png", s->frame);
+        traced_encode_file(path, s->filtered_img, WIDTH, HEIGHT, LCT_GREY, 8);
+    }
 
+    clReleaseEvent(s->upload_events[0]);
+    clReleaseEvent(s->upload_events[1]);
+    clReleaseEvent(s->first_kernel_event);
+    clReleaseEvent(s->compute_event);
+    clReleaseEvent(s->download_event);
+    if (owns_input) {
+        free(s->left_host);
+        free(s->right_host);
+    }
+    s->busy = 0;
+    return latency_ms;
+}
 
-    free(im0_data);
-    free(im1_data);
+void run_streaming(cl_context context, cl_device_id device, cl_command_queue compute_queue,
+                   pipeline_kernels *k, unsigned char *im0_data, unsigned char *im1_data,
+                   unsigned frames, const char *sequence) {
+    const size_t orig_bytes = (size_t)ORIG_WIDTH * ORIG_HEIGHT * 4;
+    cl_queue_properties queue_props[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0};
+    cl_command_queue upload_queue = clCreateCommandQueueWithProperties(context, device, queue_props, NULL);
+    cl_command_queue download_queue = clCreateCommandQueueWithProperties(context, device, queue_props, NULL);
+
+    stream_slot slots[NUM_STREAM_SLOTS];
+    memset(slots, 0, sizeof(slots));
+    for (int i = 0; i < NUM_STREAM_SLOTS; i++) {
+        stream_slot *s = &slots[i];
+        s->im0_buf = clCreateBuffer(context, CL_MEM_READ_ONLY, orig_bytes, NULL, NULL);
+        s->im1_buf = clCreateBuffer(context, CL_MEM_READ_ONLY, orig_bytes, NULL, NULL);
+        for (int j = 0; j < 2; j++) {
+            s->gray_buf[j] = clCreateBuffer(context, CL_MEM_READ_WRITE, WIDTH*HEIGHT, NULL, NULL);
+            s->disparity_buf[j] = clCreateBuffer(context, CL_MEM_READ_WRITE, WIDTH*HEIGHT, NULL, NULL);
+        }
+        s->cross_checked_buff = clCreateBuffer(context, CL_MEM_READ_WRITE, WIDTH*HEIGHT, NULL, NULL);
+        create_fill_buffers(context, HEIGHT, &s->fill);
+        s->occlusion_buff = clCreateBuffer(context, CL_MEM_READ_WRITE, WIDTH*HEIGHT, NULL, NULL);
+        s->filtered_occlusion_buff = clCreateBuffer(context, CL_MEM_READ_WRITE, WIDTH*HEIGHT, NULL, NULL);
+        s->min_max_buff = clCreateBuffer(context, CL_MEM_READ_WRITE, 2 * sizeof(cl_uint), NULL, NULL);
+        s->filtered_img = (unsigned char*)malloc(WIDTH*HEIGHT);
+    }
 
-    free(resized_left_img);
-    free(resized_right_img);
+    int owns_input = sequence != NULL;
+    unsigned submitted = 0;
+    double latency_sum = 0.0, latency_max = 0.0;
+    double stream_start = omp_get_wtime();
+
+    for (unsigned frame = 0; frame < frames; frame++) {
+        stream_slot *s = &slots[frame % NUM_STREAM_SLOTS];
+        if (s->busy) {
+            double latency_ms = finish_stream_slot(s, owns_input, owns_input);
+            latency_sum += latency_ms;
+            if (latency_ms > latency_max) latency_max = latency_ms;
+        }
 
-    free(gray_left_img);
-    free(gray_right_img);
+        // Decoding the next pair overlaps the device work already in flight
+        if (sequence) {
+            if (load_sequence_frame(sequence, frame, &s->left_host, &s->right_host) != 0) {
+                printf("Sequence ends after %u frames\n", frame);
+                break;
+            }
+        } else {
+            s->left_host = im0_data;
+            s->right_host = im1_data;
+        }
+        s->frame = frame;
+        enqueue_stream_frame(upload_queue, compute_queue, download_queue, k, s);
+        submitted++;
+    }
 
-    free(disparity_left_img);
-    free(disparity_right_img);
+    // Drain the slots in frame order
+    stream_slot *last = NULL;
+    for (unsigned frame = submitted > NUM_STREAM_SLOTS ? submitted - NUM_STREAM_SLOTS : 0; frame < submitted; frame++) {
+        stream_slot *s = &slots[frame % NUM_STREAM_SLOTS];
+        last = s;
+        if (!s->busy) continue;   // Already reclaimed before a sequence ran out
+        double latency_ms = finish_stream_slot(s, owns_input, owns_input);
+        latency_sum += latency_ms;
+        if (latency_ms > latency_max) latency_max = latency_ms;
+    }
+    double stream_s = omp_get_wtime() - stream_start;
+
+    if (submitted > 0) {
+        printf("Streaming mode: %u frames in %.3f s, %.2f frames/s, latency average %.3f ms, max %.3f ms (%d buffer sets)\n",
+               submitted, stream_s, submitted / stream_s, latency_sum / submitted, latency_max, NUM_STREAM_SLOTS);
+        if (!owns_input)
+            traced_encode_file("output/filtered_occlusion.png", last->filtered_img, WIDTH, HEIGHT, LCT_GREY, 8);
+    }
+
+    for (int i = 0; i < NUM_STREAM_SLOTS; i++) {
+        stream_slot *s = &slots[i];
+        clReleaseMemObject(s->im0_buf);
+        clReleaseMemObject(s->im1_buf);
+        for (int j = 0; j < 2; j++) {
+            clReleaseMemObject(s->gray_buf[j]);
+            clReleaseMemObject(s->disparity_buf[j]);
+        }
+        clReleaseMemObject(s->cross_checked_buff);
+        release_fill_buffers(&s->fill);
+        clReleaseMemObject(s->occlusion_buff);
+        clReleaseMemObject(s->filtered_occlusion_buff);
+        clReleaseMemObject(s->min_max_buff);
+        free(s->filtered_img);
+    }
+    clReleaseCommandQueue(upload_queue);
+    clReleaseCommandQueue(download_queue);
+}
+
+
+
+/* ZNCC auto-tuning (--autotune). Every configuration is built with its own -D LOCAL_WIDTH/
+   LOCAL_HEIGHT, timed on the device and checked against the CPU matcher. The fastest correct
+   one is saved as a per-device profile that later runs load before building the pipeline */
+typedef struct {
+    int fused;                          // zncc_bidirectional instead of left + right + cross_check
+    unsigned local_width, local_height; // work-group shape; the local tile is this plus halo and search range
+    int separate;                       // ZNCC_* kernels of the separate stage
+} zncc_config;
+
+// Profile and report name of a configuration's variant
+const char *zncc_variant_name(int fused, int separate) {
+    return fused ? "fused" : ZNCC_SEPARATE[separate].name;
+}
+
+const unsigned TUNE_SHAPES[][2] = {
+    {8, 8}, {16, 4}, {16, 8}, {8, 16}, {32, 4}, {16, 16}, {32, 8}, {64, 4}, {32, 16}, {16, 32}
+};
+#define NUM_TUNE_SHAPES ((int)(sizeof(TUNE_SHAPES) / sizeof(TUNE_SHAPES[0])))
+#define TUNE_RUNS 5                 // timed runs per configuration after one warm-up, the fastest counts
+#define TUNE_MAX_MISMATCH 0.005     // fraction of pixels allowed to differ from the CPU reference (fast math)
+
+// Local memory of the ZNCC kernels for a work-group shape, from the tile sizes in the .cl files
+size_t zncc_local_mem_bytes(int fused, unsigned w, unsigned h) {
+    size_t ws = WINDOW_SIZE, ext = MAX_DISP - 1, tile_h = h + 2 * ws;
+    if (fused)
+        return tile_h * (w + 2 * ext + 2 * ws) + tile_h * (w + ext + 2 * ws)
+             + (size_t)h * (w + 2 * ext) * (sizeof(cl_ushort) + sizeof(cl_uint))
+             + (size_t)h * (w + ext) * (sizeof(cl_ushort) + sizeof(cl_uint));
+    size_t tiles = tile_h * (w + 2 * ws) + tile_h * (w + 2 * ws + MAX_DISP);
+    // The sliding kernels add the search window sums, the L*R column sums of every run and
+    // slice, and the merge of their disparity slices
+    if (zncc_separate_variant == ZNCC_SLIDING)
+        return tiles + (size_t)h * (w + 2 * ws + MAX_DISP) * (sizeof(cl_ushort) + sizeof(cl_uint))
+             + (size_t)w * h * ((ZNCC_RUN + 2 * ws) * sizeof(cl_uint) + sizeof(float) + 1);
+    // The subgroup kernels add window statistics and the lane reduction
+    if (zncc_separate_variant == ZNCC_SUBGROUP)
+        return tiles + (size_t)w * h * 4 * sizeof(float);
+    return tiles;
+}
+
+/* The profile sits next to the program cache, keyed by device and driver like the binaries
+   and by the matching parameters it was tuned for */
+void tune_profile_path(cl_device_id dev, char *path, size_t path_size) {
+    char params[64];
+    snprintf(params, sizeof(params), "-D WINDOW_SIZE=%u -D MAX_DISP=%u", WINDOW_SIZE, MAX_DISP);
+    uint64_t key = program_cache_key(dev, params, strlen(params), NULL);
+    snprintf(path, path_size, "%s/tune_%016llx.txt", PROGRAM_CACHE_DIR, (unsigned long long)key);
+}
+
+// Returns -1 when this device has no (valid) profile
+int load_tune_profile(cl_device_id dev, zncc_config *cfg) {
+    char path[512], line[256], variant[32] = {0};
+    tune_profile_path(dev, path, sizeof(path));
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+
+    zncc_config c = *cfg;
+    int have_local = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "local %u %u", &c.local_width, &c.local_height) == 2)
+            have_local = 1;
+        else
+            sscanf(line, "variant %31s", variant);
+    }
+    fclose(fp);
+    c.fused = strcmp(variant, "fused") == 0;
+    c.separate = -1;
+    for (int i = 0; i < NUM_ZNCC_SEPARATE; i++)
+        if (c.fused || strcmp(variant, ZNCC_SEPARATE[i].name) == 0) {
+            c.separate = i;
+            break;
+        }
+    if (!have_local || c.local_width == 0 || c.local_height == 0 || c.separate < 0)
+        return -1;
+    *cfg = c;
+    return 0;
+}
+
+void save_tune_profile(cl_device_id dev, const zncc_config *cfg, double time_ms) {
+    char path[512], device_name[256] = {0};
+    clGetDeviceInfo(dev, CL_DEVICE_NAME, sizeof(device_name) - 1, device_name, NULL);
+    make_dir(PROGRAM_CACHE_DIR);
+    tune_profile_path(dev, path, sizeof(path));
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror("Couldn't write the tuning profile");
+        return;
+    }
+    fprintf(fp, "# ZNCC tuning profile for %s\n", device_name);
+    fprintf(fp, "variant %s\n", zncc_variant_name(cfg->fused, cfg->separate));
+    fprintf(fp, "local %u %u\n", cfg->local_width, cfg->local_height);
+    fprintf(fp, "time_ms %.3f\n", time_ms);
+    fclose(fp);
+    printf("Tuning profile saved to %s\n", path);
+}
+
+/* Run the ZNCC stage as built into k (the current LOCAL_WIDTH/LOCAL_HEIGHT) on the gray pair.
+   Returns the fastest device time in ms and leaves the cross-checked map in result_img */
+double time_zncc_stage(cl_command_queue queue, pipeline_kernels *k, int fused, cl_mem gray[2],
+                       cl_mem disparity[2], cl_mem result, unsigned char *result_img) {
+    size_t local_size[2] = {LOCAL_WIDTH, LOCAL_HEIGHT};
+    size_t global_size[2] = {
+        ((WIDTH + local_size[0]-1)/local_size[0])*local_size[0],
+        ((HEIGHT + local_size[1]-1)/local_size[1])*local_size[1]
+    };
+    size_t global_size_cross[2] = {WIDTH, HEIGHT};
+
+    if (fused) {
+        clSetKernelArg(k->zncc_bidirectional_kernel, 0, sizeof(cl_mem), &gray[0]);
+        clSetKernelArg(k->zncc_bidirectional_kernel, 1, sizeof(cl_mem), &gray[1]);
+        clSetKernelArg(k->zncc_bidirectional_kernel, 2, sizeof(cl_mem), &result);
+        clSetKernelArg(k->zncc_bidirectional_kernel, 3, sizeof(int), &WIDTH);
+        clSetKernelArg(k->zncc_bidirectional_kernel, 4, sizeof(int), &HEIGHT);
+        clSetKernelArg(k->zncc_bidirectional_kernel, 5, sizeof(int), &THRESHOLD);
+    } else {
+        cl_kernel zncc[2] = {k->zncc_left_to_right_kernel, k->zncc_right_to_left_kernel};
+        for (int i = 0; i < 2; i++) {
+            clSetKernelArg(zncc[i], 0, sizeof(cl_mem), &gray[i]);
+            clSetKernelArg(zncc[i], 1, sizeof(cl_mem), &gray[1 - i]);
+            clSetKernelArg(zncc[i], 2, sizeof(cl_mem), &disparity[i]);
+            clSetKernelArg(zncc[i], 3, sizeof(int), &WIDTH);
+            clSetKernelArg(zncc[i], 4, sizeof(int), &HEIGHT);
+            clSetKernelArg(zncc[i], 5, sizeof(int), &MAX_DISP);
+            clSetKernelArg(zncc[i], 6, sizeof(int), &WINDOW_SIZE);
+        }
+        clSetKernelArg(k->cross_check_kernel, 0, sizeof(cl_mem), &disparity[0]);
+        clSetKernelArg(k->cross_check_kernel, 1, sizeof(cl_mem), &disparity[1]);
+        clSetKernelArg(k->cross_check_kernel, 2, sizeof(cl_mem), &result);
+        clSetKernelArg(k->cross_check_kernel, 3, sizeof(int), &WIDTH);
+        clSetKernelArg(k->cross_check_kernel, 4, sizeof(int), &THRESHOLD);
+    }
+
+    double best_ms = -1.0;
+    for (int run = 0; run <= TUNE_RUNS; run++) {
+        cl_event first, last;
+        if (fused) {
+            traced_enqueue_ndrange_kernel(queue, k->zncc_bidirectional_kernel, 2, NULL, global_size, local_size, 0, NULL, &first);
+            last = first;
+            clRetainEvent(last);
+        } else {
+            traced_enqueue_ndrange_kernel(queue, k->zncc_left_to_right_kernel, 2, NULL, global_size, local_size, 0, NULL, &first);
+            traced_enqueue_ndrange_kernel(queue, k->zncc_right_to_left_kernel, 2, NULL, global_size, local_size, 0, NULL, NULL);
+            traced_enqueue_ndrange_kernel(queue, k->cross_check_kernel, 2, NULL, global_size_cross, NULL, 0, NULL, &last);
+        }
+        clFinish(queue);
+
+        cl_ulong start, end;
+        clGetEventProfilingInfo(first, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+        clGetEventProfilingInfo(last, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+        double ms = (end - start) * 1e-6;
+        if (run > 0 && (best_ms < 0.0 || ms < best_ms)) best_ms = ms;   // run 0 is the warm-up
+        clReleaseEvent(first);
+        clReleaseEvent(last);
+    }
+
+    traced_enqueue_read_buffer(queue, result, CL_TRUE, 0, WIDTH*HEIGHT, result_img, 0, NULL, NULL);
+    return best_ms;
+}
+
+// Largest work-group a kernel of the built program accepts on the device
+size_t kernel_max_work_group(cl_kernel kernel, cl_device_id dev) {
+    size_t size = 0;
+    clGetKernelWorkGroupInfo(kernel, dev, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size), &size, NULL);
+    return size;
+}
+
+/* Benchmark both ZNCC variants over TUNE_SHAPES on this device. The reference is the CPU
+   matcher plus the cross-check rule of cross_check.cl on the same gray pair. Returns the
+   time of the winner, written to best, or -1 when no configuration passed */
+double run_autotune(cl_context context, cl_device_id device, cl_command_queue queue,
+                    const unsigned char *im0_data, const unsigned char *im1_data, zncc_config *best) {
+    const size_t image_bytes = (size_t)WIDTH * HEIGHT;
+    unsigned char *gray_img[2], *reference_disparity[2];
+    for (int i = 0; i < 2; i++) {
+        gray_img[i] = (unsigned char*)malloc(image_bytes);
+        reference_disparity[i] = (unsigned char*)malloc(image_bytes);
+    }
+    decimate_gray_cpu(im0_data, gray_img[0]);
+    decimate_gray_cpu(im1_data, gray_img[1]);
+
+    unsigned char *reference = (unsigned char*)malloc(image_bytes);
+    unsigned char *result_img = (unsigned char*)malloc(image_bytes);
+    zncc_disparity_cpu(gray_img[0], gray_img[1], reference_disparity[0], reference_disparity[1],
+                       WIDTH, HEIGHT, 0, HEIGHT);
+    for (unsigned y = 0; y < HEIGHT; y++) {
+        for (unsigned x = 0; x < WIDTH; x++) {
+            int d = reference_disparity[0][y * WIDTH + x];
+            int d_right = (int)x - d >= 0 ? reference_disparity[1][y * WIDTH + x - d] : 0;
+            reference[y * WIDTH + x] = ((int)x - d < 0 || abs(d - d_right) > (int)THRESHOLD) ? 0 : (unsigned char)d;
+        }
+    }
+
+    cl_mem gray[2], disparity[2];
+    for (int i = 0; i < 2; i++) {
+        gray[i] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, image_bytes, gray_img[i], NULL);
+        disparity[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, image_bytes, NULL, NULL);
+    }
+    cl_mem result = clCreateBuffer(context, CL_MEM_READ_WRITE, image_bytes, NULL, NULL);
+
+    size_t max_work_group = 0;
+    cl_ulong local_mem = 0;
+    clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_work_group), &max_work_group, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem), &local_mem, NULL);
+
+    // The tuner feeds gray images, so the RGBA tile variant is off while it builds
+    int tiles_from_rgba = zncc_tiles_from_rgba;
+    zncc_tiles_from_rgba = 0;
+    unsigned default_width = LOCAL_WIDTH, default_height = LOCAL_HEIGHT;
+
+    printf("Auto-tuning the ZNCC stage (%d runs per configuration)\n", TUNE_RUNS);
+    double best_ms = -1.0;
+    // Variants: fused, then every kernel set of the separate stage
+    for (int variant = -1; variant < NUM_ZNCC_SEPARATE; variant++) {
+        int fused = variant < 0;
+        zncc_separate_variant = fused ? ZNCC_OPTIMIZED : variant;
+        for (int s = 0; s < NUM_TUNE_SHAPES; s++) {
+            unsigned w = TUNE_SHAPES[s][0], h = TUNE_SHAPES[s][1];
+            printf("  %-8s %2ux%-2u  ", zncc_variant_name(fused, zncc_separate_variant), w, h);
+            if (zncc_separate_variant == ZNCC_SLIDING && w % ZNCC_RUN != 0) {
+                printf("skipped: the width is not a multiple of %d\n", ZNCC_RUN);
+                continue;
+            }
+            if (zncc_separate_variant == ZNCC_SUBGROUP && (w * h) % ZNCC_LANES != 0) {
+                printf("skipped: the work-group is not a multiple of %d\n", ZNCC_LANES);
+                continue;
+            }
+            size_t needed = zncc_local_mem_bytes(fused, w, h);
+            if ((size_t)w * h > max_work_group || needed > local_mem) {
+                printf("skipped: %zu work-items, %zu bytes of local memory\n", (size_t)w * h, needed);
+                continue;
+            }
+
+            LOCAL_WIDTH = w;
+            LOCAL_HEIGHT = h;
+            pipeline_kernels k;
+            create_pipeline_kernels(context, device, &k);
+            size_t kernel_limit = kernel_max_work_group(fused ? k.zncc_bidirectional_kernel : k.zncc_left_to_right_kernel, device);
+            if (!fused) {
+                size_t right_limit = kernel_max_work_group(k.zncc_right_to_left_kernel, device);
+                if (right_limit < kernel_limit) kernel_limit = right_limit;
+            }
+            if ((size_t)w * h > kernel_limit) {
+                printf("skipped: the compiled kernel allows %zu work-items\n", kernel_limit);
+                release_pipeline_kernels(&k);
+                continue;
+            }
+
+            double ms = time_zncc_stage(queue, &k, fused, gray, disparity, result, result_img);
+            release_pipeline_kernels(&k);
+
+            size_t mismatches = 0;
+            for (size_t i = 0; i < image_bytes; i++)
+                mismatches += result_img[i] != reference[i];
+            double mismatch = (double)mismatches / image_bytes;
+            int correct = mismatch <= TUNE_MAX_MISMATCH;
+            printf("%8.3f ms, %.3f%% differ from the CPU%s\n", ms, mismatch * 100.0, correct ? "" : "  REJECTED");
+            if (correct && (best_ms < 0.0 || ms < best_ms)) {
+                best_ms = ms;
+                best->fused = fused;
+                best->separate = zncc_separate_variant;
+                best->local_width = w;
+                best->local_height = h;
+            }
+        }
+    }
+    zncc_separate_variant = ZNCC_OPTIMIZED;
+
+    if (best_ms >= 0.0) {
+        printf("Best: %s ZNCC, %ux%u work-groups, %.3f ms\n",
+               zncc_variant_name(best->fused, best->separate), best->local_width, best->local_height, best_ms);
+    } else {
+        printf("No configuration matched the CPU reference, keeping the defaults\n");
+        LOCAL_WIDTH = default_width;
+        LOCAL_HEIGHT = default_height;
+    }
+    zncc_tiles_from_rgba = tiles_from_rgba;
+    // The tuning builds are not part of the pipeline build reported afterwards
+    program_cache_hits = 0;
+    program_cache_misses = 0;
+
+    for (int i = 0; i < 2; i++) {
+        clReleaseMemObject(gray[i]);
+        clReleaseMemObject(disparity[i]);
+        free(gray_img[i]);
+        free(reference_disparity[i]);
+    }
+    clReleaseMemObject(result);
+    free(reference);
+    free(result_img);
+    return best_ms;
+}
+
+
+
+/*................Multi-device row partitioning................*/
+#define MAX_PARTITIONS 16
+
+/* One device of the multi-device mode: a whole device (--multi-device) or a sub-device of
+   one CPU (--sub-devices N), each with its own context, queue and specialized kernels.
+   Buffers are full-frame sized and addressed in image rows, so a band runs the same kernels
+   with a global offset instead of re-basing coordinates */
+typedef struct {
+    cl_device_id device;
+    int sub_device;                 // from clCreateSubDevices, released with clReleaseDevice
+    char name[128];
+    cl_context context;
+    cl_command_queue queue;
+    pipeline_kernels kernels;
+    int fused;                      // the fused ZNCC kernel fits this device's local memory
+    cl_mem orig_buf[2], gray_buf[2], disparity_buf[2], cross_checked_buf;
+    unsigned y0, y1;                // output rows of the current frame
+    cl_event first_event, last_event;
+    double ms;                      // device time of the last band, upload to download
+    double build_ms;
+} device_partition;
+
+void open_partition(device_partition *p, cl_device_id device, int sub_device, int fused) {
+    const size_t orig_bytes = (size_t)ORIG_WIDTH * ORIG_HEIGHT * 4;
+    p->device = device;
+    p->sub_device = sub_device;
+    memset(p->name, 0, sizeof(p->name));
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(p->name) - 1, p->name, NULL);
+    p->context = clCreateContext(NULL, 1, &device, NULL, NULL, NULL);
+    cl_queue_properties queue_props[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0};
+    p->queue = clCreateCommandQueueWithProperties(p->context, device, queue_props, NULL);
+    double build_start = omp_get_wtime();
+    create_pipeline_kernels(p->context, device, &p->kernels);
+    p->build_ms = (omp_get_wtime() - build_start) * 1000.0;
+
+    cl_ulong local_mem = 0;
+    clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem), &local_mem, NULL);
+    p->fused = fused && zncc_local_mem_bytes(1, LOCAL_WIDTH, LOCAL_HEIGHT) <= local_mem;
+
+    for (int i = 0; i < 2; i++) {
+        p->orig_buf[i] = clCreateBuffer(p->context, CL_MEM_READ_ONLY, orig_bytes, NULL, NULL);
+        p->gray_buf[i] = clCreateBuffer(p->context, CL_MEM_READ_WRITE, WIDTH*HEIGHT, NULL, NULL);
+        p->disparity_buf[i] = p->fused ? NULL : clCreateBuffer(p->context, CL_MEM_READ_WRITE, WIDTH*HEIGHT, NULL, NULL);
+    }
+    p->cross_checked_buf = clCreateBuffer(p->context, CL_MEM_READ_WRITE, WIDTH*HEIGHT, NULL, NULL);
+}
+
+void close_partition(device_partition *p) {
+    for (int i = 0; i < 2; i++) {
+        clReleaseMemObject(p->orig_buf[i]);
+        clReleaseMemObject(p->gray_buf[i]);
+        if (p->disparity_buf[i]) clReleaseMemObject(p->disparity_buf[i]);
+    }
+    clReleaseMemObject(p->cross_checked_buf);
+    release_pipeline_kernels(&p->kernels);
+    clReleaseCommandQueue(p->queue);
+    clReleaseContext(p->context);
+    if (p->sub_device) clReleaseDevice(p->device);
+}
+
+/* Every available device with a compiler on every platform, or, with sub_devices > 0, that
+   many equal partitions of the first CPU device (CL_DEVICE_PARTITION_BY_COUNTS). Returns the
+   number of partitions opened */
+int open_partitions(device_partition *parts, int sub_devices, int fused) {
+    // One work-group row per partition at least
+    int max_parts = (int)(HEIGHT / LOCAL_HEIGHT) < MAX_PARTITIONS ? (int)(HEIGHT / LOCAL_HEIGHT) : MAX_PARTITIONS;
+    cl_platform_id platforms[8];
+    cl_uint num_platforms = 0;
+    clGetPlatformIDs(8, platforms, &num_platforms);
+    if (num_platforms > 8) num_platforms = 8;
+    int n = 0;
+
+    if (sub_devices > 0) {
+        cl_device_id cpu = NULL;
+        for (cl_uint i = 0; i < num_platforms && !cpu; i++) {
+            if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_CPU, 1, &cpu, NULL) != CL_SUCCESS)
+                cpu = NULL;
+        }
+        if (!cpu) {
+            printf("--sub-devices needs an OpenCL CPU device\n");
+            exit(1);
+        }
+        cl_uint compute_units = 0, max_sub_devices = 0;
+        clGetDeviceInfo(cpu, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
+        clGetDeviceInfo(cpu, CL_DEVICE_PARTITION_MAX_SUB_DEVICES, sizeof(max_sub_devices), &max_sub_devices, NULL);
+        int count = sub_devices;
+        if (count > (int)max_sub_devices) count = (int)max_sub_devices;
+        if (count > (int)compute_units) count = (int)compute_units;
+        if (count > max_parts) count = max_parts;
+        if (count < 1) {
+            printf("The CPU device can not be partitioned\n");
+            exit(1);
+        }
+
+        // Compute units split as evenly as possible, the remainder to the first partitions
+        cl_device_partition_property props[MAX_PARTITIONS + 3];
+        props[0] = CL_DEVICE_PARTITION_BY_COUNTS;
+        for (int i = 0; i < count; i++)
+            props[1 + i] = compute_units / count + ((cl_uint)i < compute_units % count ? 1 : 0);
+        props[1 + count] = CL_DEVICE_PARTITION_BY_COUNTS_LIST_END;
+        props[2 + count] = 0;
+
+        cl_device_id subs[MAX_PARTITIONS];
+        cl_uint num_subs = 0;
+        if (clCreateSubDevices(cpu, props, (cl_uint)count, subs, &num_subs) != CL_SUCCESS || num_subs == 0) {
+            printf("clCreateSubDevices failed\n");
+            exit(1);
+        }
+        for (cl_uint i = 0; i < num_subs; i++)
+            open_partition(&parts[n++], subs[i], 1, fused);
+        printf("Partitioned the CPU device (%u compute units) into %u sub-devices\n", compute_units, num_subs);
+    } else {
+        for (cl_uint i = 0; i < num_platforms && n < max_parts; i++) {
+            cl_device_id devices[MAX_PARTITIONS];
+            cl_uint num_devices = 0;
+            if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, MAX_PARTITIONS, devices, &num_devices) != CL_SUCCESS)
+                continue;
+            if (num_devices > MAX_PARTITIONS) num_devices = MAX_PARTITIONS;
+            for (cl_uint j = 0; j < num_devices && n < max_parts; j++) {
+                cl_bool available = CL_FALSE, compiler = CL_FALSE;
+                clGetDeviceInfo(devices[j], CL_DEVICE_AVAILABLE, sizeof(available), &available, NULL);
+                clGetDeviceInfo(devices[j], CL_DEVICE_COMPILER_AVAILABLE, sizeof(compiler), &compiler, NULL);
+                if (available && compiler)
+                    open_partition(&parts[n++], devices[j], 0, fused);
+            }
+        }
+        if (n == 0) {
+            perror("Couldn't access any devices");
+            exit(1);
+        }
+    }
+    return n;
+}
+
+/* Consecutive output bands proportional to weights, in whole work-group rows with at least
+   one per partition */
+void split_rows(device_partition *parts, int n, const double *weights) {
+    const unsigned step = LOCAL_HEIGHT;
+    const unsigned steps = (HEIGHT + step - 1) / step;
+    double total = 0.0, cumulative = 0.0;
+    for (int i = 0; i < n; i++) total += weights[i];
+
+    unsigned y = 0;
+    for (int i = 0; i < n; i++) {
+        cumulative += weights[i];
+        unsigned end = i == n - 1 ? steps : (unsigned)(cumulative / total * steps + 0.5);
+        unsigned min_end = y / step + 1;
+        unsigned max_end = steps - (unsigned)(n - 1 - i);
+        if (end < min_end) end = min_end;
+        if (end > max_end) end = max_end;
+        parts[i].y0 = y;
+        parts[i].y1 = end * step < HEIGHT ? end * step : HEIGHT;
+        y = parts[i].y1;
+    }
+}
+
+/* Disparity and cross-check of rows [y0, y1) on one partition. Only the gray rows the ZNCC
+   windows reach, [y0 - WINDOW_SIZE, y1 + WINDOW_SIZE), are preprocessed, and only the
+   original rows behind them are uploaded */
+void enqueue_partition_band(device_partition *p, unsigned char *im_data[2]) {
+    const size_t orig_row_bytes = (size_t)ORIG_WIDTH * 4;
+    pipeline_kernels *k = &p->kernels;
+    unsigned g0 = p->y0 > WINDOW_SIZE ? p->y0 - WINDOW_SIZE : 0;
+    unsigned g1 = p->y1 + WINDOW_SIZE < HEIGHT ? p->y1 + WINDOW_SIZE : HEIGHT;
+    unsigned orig_first = g0 * RESIZE_SCALE;
+    unsigned orig_end = g1 * RESIZE_SCALE < ORIG_HEIGHT ? g1 * RESIZE_SCALE : ORIG_HEIGHT;
+
+    size_t gray_offset[2] = {0, g0};
+    size_t gray_size[2] = {WIDTH, g1 - g0};
+    for (int i = 0; i < 2; i++) {
+        traced_enqueue_write_buffer(p->queue, p->orig_buf[i], CL_FALSE, orig_first * orig_row_bytes,
+                                    (orig_end - orig_first) * orig_row_bytes, im_data[i] + orig_first * orig_row_bytes,
+                                    0, NULL, i == 0 ? &p->first_event : NULL);
+        clSetKernelArg(k->resize_gray_kernel, 0, sizeof(cl_mem), &p->orig_buf[i]);
+        clSetKernelArg(k->resize_gray_kernel, 1, sizeof(cl_mem), &p->gray_buf[i]);
+        clSetKernelArg(k->resize_gray_kernel, 2, sizeof(int), &ORIG_WIDTH);
+        clSetKernelArg(k->resize_gray_kernel, 3, sizeof(int), &ORIG_HEIGHT);
+        traced_enqueue_ndrange_kernel(p->queue, k->resize_gray_kernel, 2, gray_offset, gray_size, NULL, 0, NULL, NULL);
+    }
+
+    size_t local_size[2] = {LOCAL_WIDTH, LOCAL_HEIGHT};
+    size_t band_offset[2] = {0, p->y0};
+    size_t global_size[2] = {
+        ((WIDTH + local_size[0]-1)/local_size[0])*local_size[0],
+        ((p->y1 - p->y0 + local_size[1]-1)/local_size[1])*local_size[1]
+    };
+    if (p->fused) {
+        clSetKernelArg(k->zncc_bidirectional_kernel, 0, sizeof(cl_mem), &p->gray_buf[0]);
+        clSetKernelArg(k->zncc_bidirectional_kernel, 1, sizeof(cl_mem), &p->gray_buf[1]);
+        clSetKernelArg(k->zncc_bidirectional_kernel, 2, sizeof(cl_mem), &p->cross_checked_buf);
+        clSetKernelArg(k->zncc_bidirectional_kernel, 3, sizeof(int), &WIDTH);
+        clSetKernelArg(k->zncc_bidirectional_kernel, 4, sizeof(int), &HEIGHT);
+        clSetKernelArg(k->zncc_bidirectional_kernel, 5, sizeof(int), &THRESHOLD);
+        traced_enqueue_ndrange_kernel(p->queue, k->zncc_bidirectional_kernel, 2, band_offset, global_size, local_size, 0, NULL, NULL);
+    } else {
+        cl_kernel zncc[2] = {k->zncc_left_to_right_kernel, k->zncc_right_to_left_kernel};
+        for (int i = 0; i < 2; i++) {
+            clSetKernelArg(zncc[i], 0, sizeof(cl_mem), &p->gray_buf[i]);
+            clSetKernelArg(zncc[i], 1, sizeof(cl_mem), &p->gray_buf[1 - i]);
+            clSetKernelArg(zncc[i], 2, sizeof(cl_mem), &p->disparity_buf[i]);
+            clSetKernelArg(zncc[i], 3, sizeof(int), &WIDTH);
+            clSetKernelArg(zncc[i], 4, sizeof(int), &HEIGHT);
+            clSetKernelArg(zncc[i], 5, sizeof(int), &MAX_DISP);
+            clSetKernelArg(zncc[i], 6, sizeof(int), &WINDOW_SIZE);
+            traced_enqueue_ndrange_kernel(p->queue, zncc[i], 2, band_offset, global_size, local_size, 0, NULL, NULL);
+        }
+        size_t band_size[2] = {WIDTH, p->y1 - p->y0};
+        clSetKernelArg(k->cross_check_kernel, 0, sizeof(cl_mem), &p->disparity_buf[0]);
+        clSetKernelArg(k->cross_check_kernel, 1, sizeof(cl_mem), &p->disparity_buf[1]);
+        clSetKernelArg(k->cross_check_kernel, 2, sizeof(cl_mem), &p->cross_checked_buf);
+        clSetKernelArg(k->cross_check_kernel, 3, sizeof(int), &WIDTH);
+        clSetKernelArg(k->cross_check_kernel, 4, sizeof(int), &THRESHOLD);
+        traced_enqueue_ndrange_kernel(p->queue, k->cross_check_kernel, 2, band_offset, band_size, NULL, 0, NULL, NULL);
+    }
+}
+
+/* Multi-device mode (--multi-device, --sub-devices N). Each frame the output rows are split
+   into one band per partition. Every partition computes the cross-checked disparity of its
+   band from its own upload, with a WINDOW_SIZE-row halo of gray rows, so the stitched map is
+   identical to the full-frame one. The occlusion fill and moving average, whose halo would
+   be MAX_SEARCH_RADIUS rows, run on the first partition over the stitched map. After every
+   frame the bands are re-balanced from each partition's measured rows per millisecond */
+void run_multi_device(unsigned char *im0_data, unsigned char *im1_data, unsigned frames,
+                      int sub_devices, int fused) {
+    device_partition parts[MAX_PARTITIONS];
+    int n = open_partitions(parts, sub_devices, fused);
+    double weights[MAX_PARTITIONS];
+    for (int i = 0; i < n; i++) {
+        weights[i] = 1.0;
+        printf("Partition %d: %s, program build %.3f ms%s\n", i, parts[i].name, parts[i].build_ms,
+               parts[i].fused ? "" : " (separate ZNCC kernels)");
+    }
+    split_rows(parts, n, weights);
+
+    // Post-processing buffers on the first partition
+    device_partition *post = &parts[0];
+    fill_buffers fill;
+    create_fill_buffers(post->context, HEIGHT, &fill);
+    cl_mem occlusion_buff = clCreateBuffer(post->context, CL_MEM_READ_WRITE, WIDTH*HEIGHT, NULL, NULL);
+    cl_mem filtered_occlusion_buff = clCreateBuffer(post->context, CL_MEM_READ_WRITE, WIDTH*HEIGHT, NULL, NULL);
+    cl_mem min_max_buff = clCreateBuffer(post->context, CL_MEM_READ_WRITE, 2 * sizeof(cl_uint), NULL, NULL);
+    unsigned char *cross_checked_img = (unsigned char*)malloc(WIDTH*HEIGHT);
+    unsigned char *filtered_img = (unsigned char*)malloc(WIDTH*HEIGHT);
+    unsigned char *im_data[2] = {im0_data, im1_data};
+    double total_ms = 0.0;
+
+    for (unsigned frame = 0; frame < frames; frame++) {
+        double frame_start = omp_get_wtime();
+
+        // All bands in flight at once, one queue per partition
+        for (int i = 0; i < n; i++) {
+            device_partition *p = &parts[i];
+            enqueue_partition_band(p, im_data);
+            traced_enqueue_read_buffer(p->queue, p->cross_checked_buf, CL_FALSE, (size_t)p->y0 * WIDTH,
+                                       (size_t)(p->y1 - p->y0) * WIDTH, cross_checked_img + (size_t)p->y0 * WIDTH,
+                                       0, NULL, &p->last_event);
+            clFlush(p->queue);
+        }
+        for (int i = 0; i < n; i++) {
+            device_partition *p = &parts[i];
+            cl_ulong start, end;
+            clWaitForEvents(1, &p->last_event);
+            clGetEventProfilingInfo(p->first_event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+            clGetEventProfilingInfo(p->last_event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+            p->ms = (end - start) * 1e-6;
+            clReleaseEvent(p->first_event);
+            clReleaseEvent(p->last_event);
+        }
+        double bands_ms = (omp_get_wtime() - frame_start) * 1000.0;
+
+        // Occlusion fill and moving average over the stitched map
+        traced_enqueue_write_buffer(post->queue, post->cross_checked_buf, CL_FALSE, 0, WIDTH*HEIGHT, cross_checked_img, 0, NULL, NULL);
+        enqueue_occlusion_fill(post->queue, &post->kernels, post->cross_checked_buf, &fill, occlusion_buff,
+                               HEIGHT, 1, 0, NULL, NULL, NULL);
+
+        enqueue_smoothing(post->queue, &post->kernels, occlusion_buff, filtered_occlusion_buff, NULL, HEIGHT, 0, HEIGHT,
+                          0, NULL, NULL);
+        enqueue_normalize(post->queue, &post->kernels, filtered_occlusion_buff, NULL, min_max_buff, 0, NULL, NULL, NULL);
+        traced_enqueue_read_buffer(post->queue, filtered_occlusion_buff, CL_TRUE, 0, WIDTH*HEIGHT, filtered_img, 0, NULL, NULL);
+
+        double frame_ms = (omp_get_wtime() - frame_start) * 1000.0;
+        total_ms += frame_ms;
+        printf("Frame %u: bands %.3f ms, frame %.3f ms\n", frame, bands_ms, frame_ms);
+        for (int i = 0; i < n; i++)
+            printf("  partition %d: rows %u-%u (%.3f ms)\n", i, parts[i].y0, parts[i].y1, parts[i].ms);
+
+        // Re-balance: each partition's next share follows its measured throughput
+        int measured = 1;
+        for (int i = 0; i < n; i++) {
+            if (parts[i].ms <= 0.0) measured = 0;
+            else weights[i] = (parts[i].y1 - parts[i].y0) / parts[i].ms;
+        }
+        if (measured) split_rows(parts, n, weights);
+    }
+
+    printf("Multi-device mode: %d partitions, %u frames, average %.3f ms per frame\n",
+           n, frames, total_ms / frames);
+
+    traced_encode_file("output/filtered_occlusion.png", filtered_img, WIDTH, HEIGHT, LCT_GREY, 8);
+
+    release_fill_buffers(&fill);
+    clReleaseMemObject(occlusion_buff);
+    clReleaseMemObject(filtered_occlusion_buff);
+    clReleaseMemObject(min_max_buff);
     free(cross_checked_img);
-    free(occlusion_img);
     free(filtered_img);
+    for (int i = 0; i < n; i++)
+        close_partition(&parts[i]);
+}
+
+
+
+int main(int argc, char **argv){
+
+    pipeline_options opts;
+    parse_options(argc, argv, &opts);
+    if (opts.trace) trace_start(opts.trace);
+
+    /*..........Get the DEVICE information................*/
+    // Print device information
+    print_platform_and_device_info();
+
+
+
+
+    /*................Prepare the DEVICE for input.....................*/
+    // Create device, context and queues
+    cl_device_id device = create_device();
+    cl_context context = clCreateContext(NULL, 1, &device, NULL, NULL, NULL);
+    cl_queue_properties queue_props[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 // Terminator
+    };
+    cl_command_queue queue = clCreateCommandQueueWithProperties(context, device, queue_props, NULL);
+
+
+
+
+    /*...............Load images..........................*/
+    // Load input images
+    unsigned char *im0_data = NULL, *im1_data = NULL;
+    unsigned l_width, l_height, r_width, r_height;
+
+    // Pinned mode: decode straight into mapped device-visible memory. The other modes use
+    // the mapping as page-locked staging for their writes
+    pinned_pair pinned;
+    // SVM: chosen automatically for the full-frame mode when the device supports it
+    svm_pair svm;
+    int use_svm = 0;
+    int multi_device = opts.multi_device || opts.sub_devices > 0;
+    int full_frame = opts.band_rows == 0 && !opts.stream && !opts.hybrid && !multi_device;
+    if (!opts.pinned && opts.svm >= 0 && full_frame && !opts.host_decimate && opts.frames == 1) {
+        cl_device_svm_capabilities caps = query_svm_capabilities(device);
+        if (caps && create_svm_pair(context, queue, caps, &svm, "im0.png", "im1.png") == 0)
+            use_svm = 1;
+        else if (opts.svm > 0)
+            printf("SVM not available on this device, using explicit copies\n");
+    }
+
+    if (opts.pinned) {
+        create_pinned_pair(context, queue, &pinned, "im0.png", "im1.png");
+        im0_data = pinned.ptr[0];
+        im1_data = pinned.ptr[1];
+    } else if (use_svm) {
+        im0_data = svm.ptr[0];
+        im1_data = svm.ptr[1];
+    } else {
+        unsigned error = traced_decode32_file(&im0_data, &l_width, &l_height, "im0.png");
+        if(error) printf("Error %u: %s\n", error, lodepng_error_text(error));
+
+        error = traced_decode32_file(&im1_data, &r_width, &r_height, "im1.png");
+        if(error) printf("Error %u: %s\n", error, lodepng_error_text(error));
+
+        //Check if your image loaded correctly
+        printf("Loaded left image: %ux%u\n", l_width, l_height);
+        printf("Loaded right image: %ux%u\n", r_width, r_height);
+        if(l_width != ORIG_WIDTH || l_height != ORIG_HEIGHT) {
+            printf("Error: Left image has incorrect dimensions!\n");
+            exit(1);
+        }
+    }
+
+    // ZNCC variant and work-group shape: tuned now, or taken from this device's profile
+    zncc_config zncc_cfg = {1, LOCAL_WIDTH, LOCAL_HEIGHT, ZNCC_OPTIMIZED};
+    int have_profile = 0;
+    if (opts.autotune) {
+        double tuned_ms = run_autotune(context, device, queue, im0_data, im1_data, &zncc_cfg);
+        if (tuned_ms >= 0.0) save_tune_profile(device, &zncc_cfg, tuned_ms);
+        have_profile = tuned_ms >= 0.0;
+    } else if (opts.use_profile && load_tune_profile(device, &zncc_cfg) == 0) {
+        printf("Tuning profile: %s ZNCC, %ux%u work-groups\n",
+               zncc_variant_name(zncc_cfg.fused, zncc_cfg.separate), zncc_cfg.local_width, zncc_cfg.local_height);
+        have_profile = 1;
+    }
+    LOCAL_WIDTH = zncc_cfg.local_width;
+    LOCAL_HEIGHT = zncc_cfg.local_height;
+    // Without a profile or a ZNCC option, a device with 8-bit dot products on uchar4 runs the
+    // dot-product kernels. The embedded SPIR-V has no dot-product path; such a device compiles
+    // the sources instead (build_pipeline_program)
+    if (!have_profile && opts.fused_zncc < 0 && opts.separate_kernels < 0
+        && pipeline_extension_enabled(device, "zncc_dot.cl")) {
+        printf("Device has 4x8-bit cl_khr_integer_dot_product, using the dot-product ZNCC kernels\n");
+        opts.fused_zncc = 0;
+        opts.separate_kernels = ZNCC_DOT;
+    }
+    if (opts.fused_zncc < 0) opts.fused_zncc = zncc_cfg.fused;   // --separate-zncc wins over the profile
+    if (opts.separate_kernels < 0) opts.separate_kernels = zncc_cfg.separate;
+    // The sliding kernels split the work-group width into whole runs, the subgroup kernels'
+    // local reduction the work-group into lanes
+    if (opts.separate_kernels == ZNCC_SLIDING && LOCAL_WIDTH % ZNCC_RUN != 0) {
+        printf("Sliding ZNCC needs a work-group width that is a multiple of %d, using the separate kernels\n", ZNCC_RUN);
+        opts.separate_kernels = ZNCC_OPTIMIZED;
+    }
+    if (opts.separate_kernels == ZNCC_SUBGROUP && (LOCAL_WIDTH * LOCAL_HEIGHT) % ZNCC_LANES != 0) {
+        printf("Subgroup ZNCC needs a work-group that is a multiple of %d, using the separate kernels\n", ZNCC_LANES);
+        opts.separate_kernels = ZNCC_OPTIMIZED;
+    }
+    zncc_separate_variant = opts.separate_kernels;
+
+    // A wide disparity range can outgrow local memory in the fused kernel's tiles, and in the
+    // sliding kernels' window sums
+    cl_ulong local_mem = 0;
+    clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem), &local_mem, NULL);
+    if (opts.fused_zncc && zncc_local_mem_bytes(1, LOCAL_WIDTH, LOCAL_HEIGHT) > local_mem) {
+        printf("Fused ZNCC needs %zu bytes of local memory, using the separate kernels\n",
+               zncc_local_mem_bytes(1, LOCAL_WIDTH, LOCAL_HEIGHT));
+        opts.fused_zncc = 0;
+    }
+    if (!opts.fused_zncc && zncc_local_mem_bytes(0, LOCAL_WIDTH, LOCAL_HEIGHT) > local_mem) {
+        printf("%s ZNCC needs %zu bytes of local memory, using the optimized separate kernels\n",
+               zncc_variant_name(0, zncc_separate_variant), zncc_local_mem_bytes(0, LOCAL_WIDTH, LOCAL_HEIGHT));
+        zncc_separate_variant = ZNCC_OPTIMIZED;
+    }
+    printf("Matching: %ux%u window, %u disparities\n", 2 * WINDOW_SIZE + 1, 2 * WINDOW_SIZE + 1, MAX_DISP);
+
+    // Build every kernel of the pipeline (the multi-device mode builds it once per partition)
+    pipeline_kernels kernels;
+    if (!multi_device) {
+        double build_start = omp_get_wtime();
+        create_pipeline_kernels(context, device, &kernels);
+        trace_host_span("Program build from", program_origin, build_start);
+        double build_ms = (omp_get_wtime() - build_start) * 1000.0;
+        if (!use_program_cache)
+            printf("Program build: %.3f ms from %s (program cache disabled)\n", build_ms, program_origin);
+        else
+            printf("Program build: %.3f ms from %s (%s start: %u programs from cache, %u built)\n",
+                   build_ms, program_origin, program_cache_misses == 0 ? "warm" : "cold",
+                   program_cache_hits, program_cache_misses);
+        if (opts.kernel_report) print_kernel_resources(&kernels, device);
+
+        // The path the program was built with, which the embedded SPIR-V may lack
+        if (!opts.fused_zncc && zncc_separate_variant == ZNCC_SUBGROUP) {
+            if (pipeline_extension_built("zncc_subgroup.cl"))
+                printf("Subgroup ZNCC: sub_group_reduce_max over the device's sub-groups (cl_khr_subgroups)\n");
+            else
+                printf("Subgroup ZNCC: local-memory reduction over %d lanes\n", ZNCC_LANES);
+        }
+        if (!opts.fused_zncc && zncc_separate_variant == ZNCC_DOT)
+            printf("Dot-product ZNCC: %s\n", pipeline_extension_built("zncc_dot.cl")
+                   ? "dot_acc_sat (cl_khr_integer_dot_product)"
+                   : "mad24 chains");
+    }
+
+
+
+    /*................Run the pipeline.....................*/
+    if (multi_device)
+        run_multi_device(im0_data, im1_data, opts.frames, opts.sub_devices, opts.fused_zncc);
+    else if (opts.band_rows > 0)
+        run_banded(context, queue, &kernels, im0_data, im1_data, opts.band_rows);
+    else if (opts.stream)
+        run_streaming(context, device, queue, &kernels, im0_data, im1_data, opts.frames, opts.sequence);
+    else if (opts.hybrid)
+        run_hybrid(context, queue, &kernels, im0_data, im1_data, opts.frames);
+    else {
+        // Repeated frames recycle their device buffers through the pool (parse_options keeps
+        // the pinned pair, handed over by unmapping it, to a single frame)
+        unsigned frames = opts.frames;
+        double frames_start = omp_get_wtime();
+        for (unsigned frame = 0; frame < frames; frame++)
+            run_full_frame(context, queue, &kernels, im0_data, im1_data, &opts,
+                           opts.pinned ? &pinned : NULL, use_svm ? &svm : NULL);
+        if (frames > 1)
+            printf("Full-frame mode: %u frames, average %.3f ms per frame\n",
+                   frames, (omp_get_wtime() - frames_start) * 1000.0 / frames);
+        print_pool_report();
+    }
+
+
+
+
+    /*................Cleanup............*/
+    trace_finish();
+    drain_buffer_pool();
+    if (!multi_device) release_pipeline_kernels(&kernels);
+    release_specializations();
+    if (opts.pinned) {
+        release_pinned_pair(queue, &pinned);
+    } else if (use_svm) {
+        release_svm_pair(context, queue, &svm);
+    } else {
+        free(im0_data);
+        free(im1_data);
+    }
+    clReleaseCommandQueue(queue);
+    clReleaseContext(context);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,13 +1,8 @@
-#define WINDOW_SIZE 4       // Hardcoded for loop unrolling and optimizations
-#define MAX_DISP 65         // Maximum disparity, adjust based on requirements
-#define LOCAL_WIDTH 16      // Workgroup width (adjust for your hardware)
-#define LOCAL_HEIGHT 16     // Workgroup height
-#define NUM_PIXELS 81       // (2*WINDOW_SIZE+1)^2 = 9x9
-#define INV_N 0.012345679f  // 1.0/NUM_PIXELS
+#include "zncc_common.h"  // WINDOW_SIZE, MAX_DISP, LOCAL_WIDTH/HEIGHT come from the build options
 
 __kernel void zncc_disparity_left_optimized(
-    __global const uchar* left,
-    __global const uchar* right,
+    __global const zncc_pixel* left,
+    __global const zncc_pixel* right,
     __global uchar* disparity,
     int width,
     int height,
@@ -15,8 +10,6 @@ __kernel void zncc_disparity_left_optimized(
     int window_size)
 {
     // Local memory tile dimensions (including halo and disparity)
-    #define TILE_WIDTH (LOCAL_WIDTH + 2 * WINDOW_SIZE)
-    #define TILE_HEIGHT (LOCAL_HEIGHT + 2 * WINDOW_SIZE)
     #define RIGHT_TILE_WIDTH (TILE_WIDTH + MAX_DISP)
 
     __local uchar left_tile[TILE_HEIGHT][TILE_WIDTH];       // Left image tile with halo
@@ -27,9 +20,10 @@ __kernel void zncc_disparity_left_optimized(
     const int group_x = get_group_id(0);
     const int group_y = get_group_id(1);
 
-    // Calculate global tile coordinates with halo
-    const int base_x = group_x * LOCAL_WIDTH - WINDOW_SIZE;
-    const int base_y = group_y * LOCAL_HEIGHT - WINDOW_SIZE;
+    // Calculate global tile coordinates with halo (the global offset lets the
+    // host run the kernel over a band of rows)
+    const int base_x = group_x * LOCAL_WIDTH + (int)get_global_offset(0) - WINDOW_SIZE;
+    const int base_y = group_y * LOCAL_HEIGHT + (int)get_global_offset(1) - WINDOW_SIZE;
 
     // Coalesced loading of left tile with boundary clamping
     for(int ty = local_y; ty < TILE_HEIGHT; ty += LOCAL_HEIGHT) {
@@ -38,7 +32,7 @@ __kernel void zncc_disparity_left_optimized(
         for(int tx = local_x; tx < TILE_WIDTH; tx += LOCAL_WIDTH) {
             int gx = base_x + tx;
             gx = clamp(gx, 0, width-1);
-            left_tile[ty][tx] = left[gy * width + gx];
+            left_tile[ty][tx] = ZNCC_LOAD(left, gx, gy, width);
         }
     }
 
@@ -50,7 +44,7 @@ __kernel void zncc_disparity_left_optimized(
         for(int tx = local_x; tx < RIGHT_TILE_WIDTH; tx += LOCAL_WIDTH) {
             int gx = right_base_x + tx;
             gx = clamp(gx, 0, width-1);
-            right_tile[ty][tx] = right[gy * width + gx];
+            right_tile[ty][tx] = ZNCC_LOAD(right, gx, gy, width);
         }
     }
 
@@ -59,6 +53,7 @@ __kernel void zncc_disparity_left_optimized(
     // Global coordinates and border check
     const int x = get_global_id(0);
     const int y = get_global_id(1);
+    if(x >= width || y >= height) return;  // Padding of the rounded-up NDRange
     if(x < WINDOW_SIZE || x >= width - WINDOW_SIZE || 
        y < WINDOW_SIZE || y >= height - WINDOW_SIZE) {
         disparity[y * width + x] = 0;
@@ -1,11 +1,8 @@
-#define WINDOW_SIZE 4       // Hardcoded for loop unrolling and optimizations
-#define MAX_DISP 65         // Maximum disparity, adjust based on requirements
-#define LOCAL_WIDTH 16      // Workgroup width (adjust for your hardware)
-#define LOCAL_HEIGHT 16     // Workgroup height
+#include "zncc_common.h"  // WINDOW_SIZE, MAX_DISP, LOCAL_WIDTH/HEIGHT come from the build options
 
 __kernel void zncc_disparity_right_optimized(
-    __global const uchar* right,
-    __global const uchar* left,
+    __global const zncc_pixel* right,
+    __global const zncc_pixel* left,
     __global uchar* disparity,
     int width,
     int height,
@@ -13,8 +10,6 @@ __kernel void zncc_disparity_right_optimized(
     int window_size)
 {
     // Local memory tile dimensions (including halo and disparity)
-    #define TILE_WIDTH (LOCAL_WIDTH + 2 * WINDOW_SIZE)
-    #define TILE_HEIGHT (LOCAL_HEIGHT + 2 * WINDOW_SIZE)
     #define LEFT_TILE_WIDTH (TILE_WIDTH + MAX_DISP)
 
     __local uchar right_tile[TILE_HEIGHT][TILE_WIDTH];      // Right image tile with halo
@@ -25,9 +20,10 @@ __kernel void zncc_disparity_right_optimized(
     const int group_x = get_group_id(0);
     const int group_y = get_group_id(1);
 
-    // Calculate global tile coordinates with halo
-    const int base_x = group_x * LOCAL_WIDTH - WINDOW_SIZE;
-    const int base_y = group_y * LOCAL_HEIGHT - WINDOW_SIZE;
+    // Calculate global tile coordinates with halo (the global offset lets the
+    // host run the kernel over a band of rows)
+    const int base_x = group_x * LOCAL_WIDTH + (int)get_global_offset(0) - WINDOW_SIZE;
+    const int base_y = group_y * LOCAL_HEIGHT + (int)get_global_offset(1) - WINDOW_SIZE;
 
     // Coalesced loading of right tile with boundary clamping
     for(int ty = local_y; ty < TILE_HEIGHT; ty += LOCAL_HEIGHT) {
@@ -36,7 +32,7 @@ __kernel void zncc_disparity_right_optimized(
         for(int tx = local_x; tx < TILE_WIDTH; tx += LOCAL_WIDTH) {
             int gx = base_x + tx;
             gx = clamp(gx, 0, width-1);
-            right_tile[ty][tx] = right[gy * width + gx];
+            right_tile[ty][tx] = ZNCC_LOAD(right, gx, gy, width);
         }
     }
 
@@ -48,7 +44,7 @@ __kernel void zncc_disparity_right_optimized(
         for(int tx = local_x; tx < LEFT_TILE_WIDTH; tx += LOCAL_WIDTH) {
             int gx = left_base_x + tx;
             gx = clamp(gx, 0, width-1);
-            left_tile[ty][tx] = left[gy * width + gx];
+            left_tile[ty][tx] = ZNCC_LOAD(left, gx, gy, width);
         }
     }
 
@@ -57,6 +53,7 @@ __kernel void zncc_disparity_right_optimized(
     // Global coordinates and border check
     const int x = get_global_id(0);
     const int y = get_global_id(1);
+    if(x >= width || y >= height) return;  // Padding of the rounded-up NDRange
     if(x < WINDOW_SIZE || x >= width - WINDOW_SIZE || 
        y < WINDOW_SIZE || y >= height - WINDOW_SIZE) {
         disparity[y * width + x] = 0;
@@ -65,8 +62,7 @@ __kernel void zncc_disparity_right_optimized(
 
     float max_zncc = -INFINITY;
     int best_d = 0;
-    const int num_pixels = (2*WINDOW_SIZE+1)*(2*WINDOW_SIZE+1);
-    const float inv_n = 1.0f / num_pixels;
+    const float inv_n = INV_N;
 
     // Precompute right window sums once
     float sum_R = 0.0f, sum_R2 = 0.0f;
@@ -0,0 +1,329 @@
+#include "zncc_common.h"  // WINDOW_SIZE, MAX_DISP, LOCAL_WIDTH/HEIGHT come from the build options
+
+/* Sliding-window variants of zncc_disparity_left_optimized / _right_optimized (--sliding-zncc).
+   Same arguments, tiles and NDRange, so the host launches them the same way. Work-items are
+   grouped by ZNCC_RUN (a build option) along x: the group shares a run of ZNCC_RUN consecutive
+   pixels of a row, and each one searches its own slice of the disparity range for the whole
+   run. None of the per-candidate sums walks a full window:
+   - The window sums of R and R^2 do not depend on the candidate, only on where the window
+     starts in the search tile. The work-group builds them once per tile in local memory:
+     column sums slid down the rows, then slid along each row.
+   - For each candidate, the column sums of L*R of a run are built once for the whole block
+     column. The work-items that share the run and the slice, one per row, each take a
+     column: they sum its first WINDOW_DIM rows, then slide down the block by adding the
+     entering row and subtracting the leaving one. Each work-item then slides its row's
+     window along the run, adding the entering column and subtracting the leaving one.
+   Per pixel and candidate this costs two table reads, two sliding updates and
+   (ZNCC_RUN + 2 * WINDOW_SIZE) / ZNCC_RUN column updates of two products each, plus a
+   WINDOW_DIM / LOCAL_HEIGHT share of each column's start, so it hardly grows with the window.
+   The slices are merged in local memory in disparity order.
+   The sums are integers, converted to float only for the same final formulas as the
+   optimized kernels, so the results match them. LOCAL_WIDTH must be a multiple of ZNCC_RUN;
+   the host only selects these kernels then. */
+
+#define RUN_COLUMNS (ZNCC_RUN + 2 * WINDOW_SIZE)
+#define SEARCH_TILE_WIDTH (TILE_WIDTH + MAX_DISP)
+#define SEARCH_POSITIONS (LOCAL_WIDTH + MAX_DISP)   // Window start columns in the search tile
+
+// Candidate d of pixel x exists: the loop bounds of the optimized kernels
+int sliding_candidate(int direction, int x, int d, int width) {
+    return direction < 0 ? x - d >= 0 : x + d + WINDOW_SIZE < width;
+}
+
+/* Window sums of R and R^2 for every block row and window start column of the search tile.
+   Column sums first, each slid down the block; then each row slides its windows along the
+   columns, in place */
+void search_window_sums(__local const uchar* search_tile,   // TILE_HEIGHT x SEARCH_TILE_WIDTH
+                        __local ushort* box_sum,             // LOCAL_HEIGHT x SEARCH_TILE_WIDTH
+                        __local uint* box_sum2)              // LOCAL_HEIGHT x SEARCH_TILE_WIDTH
+{
+    const int local_id = get_local_id(1) * LOCAL_WIDTH + get_local_id(0);
+
+    for(int t = local_id; t < SEARCH_TILE_WIDTH; t += LOCAL_WIDTH * LOCAL_HEIGHT) {
+        uint s = 0, s2 = 0;
+        for(int wy = 0; wy < WINDOW_DIM; ++wy) {
+            const uint q = search_tile[wy * SEARCH_TILE_WIDTH + t];
+            s += q;
+            s2 += q * q;
+        }
+        box_sum[t] = (ushort)s;
+        box_sum2[t] = s2;
+        for(int y = 1; y < LOCAL_HEIGHT; ++y) {
+            const uint in = search_tile[(y + 2 * WINDOW_SIZE) * SEARCH_TILE_WIDTH + t];
+            const uint out = search_tile[(y - 1) * SEARCH_TILE_WIDTH + t];
+            s += in - out;
+            s2 += in * in - out * out;
+            box_sum[y * SEARCH_TILE_WIDTH + t] = (ushort)s;
+            box_sum2[y * SEARCH_TILE_WIDTH + t] = s2;
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Column j + 2 * WINDOW_SIZE is read before window j is written, column j just before
+    for(int r = local_id; r < 2 * LOCAL_HEIGHT; r += LOCAL_WIDTH * LOCAL_HEIGHT) {
+        const int row = (r % LOCAL_HEIGHT) * SEARCH_TILE_WIDTH;
+        uint sum = 0;
+        if(r < LOCAL_HEIGHT) {
+            for(int c = 0; c < 2 * WINDOW_SIZE; ++c) sum += box_sum[row + c];
+            for(int j = 0; j < SEARCH_POSITIONS; ++j) {
+                sum += box_sum[row + j + 2 * WINDOW_SIZE];
+                const uint leaving = box_sum[row + j];
+                box_sum[row + j] = (ushort)sum;
+                sum -= leaving;
+            }
+        } else {
+            for(int c = 0; c < 2 * WINDOW_SIZE; ++c) sum += box_sum2[row + c];
+            for(int j = 0; j < SEARCH_POSITIONS; ++j) {
+                sum += box_sum2[row + j + 2 * WINDOW_SIZE];
+                const uint leaving = box_sum2[row + j];
+                box_sum2[row + j] = sum;
+                sum -= leaving;
+            }
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+/* Search, merge and write the work-group's disparities. Candidate d of reference tile column c
+   is search tile column c + search_shift + direction * d: direction -1 is the left-to-right
+   search, +1 the right-to-left one */
+void sliding_search(__local const uchar* ref_tile,    // TILE_HEIGHT x TILE_WIDTH
+                    __local const uchar* search_tile, // TILE_HEIGHT x SEARCH_TILE_WIDTH
+                    int search_shift,
+                    int direction,
+                    __local ushort* box_sum,          // LOCAL_HEIGHT x SEARCH_TILE_WIDTH
+                    __local uint* box_sum2,           // LOCAL_HEIGHT x SEARCH_TILE_WIDTH
+                    __local uint* prod_cols,          // LOCAL_WIDTH x LOCAL_HEIGHT x RUN_COLUMNS
+                    __local float* merged_zncc,       // LOCAL_HEIGHT x LOCAL_WIDTH
+                    __local uchar* merged_d,          // LOCAL_HEIGHT x LOCAL_WIDTH
+                    __global uchar* disparity,
+                    int width,
+                    int height)
+{
+    const int local_x = get_local_id(0);
+    const int local_y = get_local_id(1);
+    const int slice = local_x % ZNCC_RUN;
+    const int run_x = local_x - slice;   // First work-group column of the run
+    const int x0 = get_group_id(0) * LOCAL_WIDTH + (int)get_global_offset(0) + run_x;
+
+    search_window_sums(search_tile, box_sum, box_sum2);
+
+    // Candidates of this work-item's slice; every slice takes the same number of steps, so
+    // the barriers below are reached uniformly
+    const int slice_size = (MAX_DISP + ZNCC_RUN - 1) / ZNCC_RUN;
+    const int d_begin = slice * slice_size;
+    const int d_end = min(d_begin + slice_size, MAX_DISP);
+
+    // Reference window statistics of the run, slid along the column sums
+    uint ref_col[RUN_COLUMNS], ref_col2[RUN_COLUMNS];
+    #pragma unroll
+    for(int c = 0; c < RUN_COLUMNS; ++c) {
+        uint s = 0, s2 = 0;
+        #pragma unroll
+        for(int wy = 0; wy < WINDOW_DIM; ++wy) {
+            const uint p = ref_tile[(local_y + wy) * TILE_WIDTH + run_x + c];
+            s += p;
+            s2 += p * p;
+        }
+        ref_col[c] = s;
+        ref_col2[c] = s2;
+    }
+    float sum_ref[ZNCC_RUN], var_ref[ZNCC_RUN], best_zncc[ZNCC_RUN];
+    int best_d[ZNCC_RUN];
+    uint ref_sum = 0, ref_sum2 = 0;
+    #pragma unroll
+    for(int c = 0; c < WINDOW_DIM; ++c) {
+        ref_sum += ref_col[c];
+        ref_sum2 += ref_col2[c];
+    }
+    #pragma unroll
+    for(int i = 0; i < ZNCC_RUN; ++i) {
+        if(i > 0) {
+            ref_sum += ref_col[i + WINDOW_DIM - 1] - ref_col[i - 1];
+            ref_sum2 += ref_col2[i + WINDOW_DIM - 1] - ref_col2[i - 1];
+        }
+        sum_ref[i] = ref_sum;
+        var_ref[i] = (float)ref_sum2 - (sum_ref[i] * sum_ref[i]) * INV_N;
+        best_zncc[i] = -INFINITY;
+        best_d[i] = d_begin;   // Slice 0 keeps disparity 0 without candidates, as the serial search
+    }
+
+    // L*R column sums of this run and slice, shared by its LOCAL_HEIGHT work-items
+    __local uint* run_cols = prod_cols + local_x * LOCAL_HEIGHT * RUN_COLUMNS;
+    __local const uint* row_cols = run_cols + local_y * RUN_COLUMNS;
+
+    // The last pixel of the run keeps left-to-right candidates longest, the first one right-to-left
+    const int x_last = direction < 0 ? x0 + ZNCC_RUN - 1 : x0;
+    for(int k = 0; k < slice_size; ++k) {
+        const int d = d_begin + k;
+        const int active = d < d_end && sliding_candidate(direction, x_last, d, width);
+        const int shift = search_shift + direction * d;   // Search tile column - reference column
+
+        // This work-item's columns, slid down the block
+        if(active) {
+            for(int c = local_y; c < RUN_COLUMNS; c += LOCAL_HEIGHT) {
+                const int t = run_x + c;
+                uint s = 0;
+                for(int wy = 0; wy < WINDOW_DIM; ++wy)
+                    s += (uint)ref_tile[wy * TILE_WIDTH + t] * search_tile[wy * SEARCH_TILE_WIDTH + t + shift];
+                run_cols[c] = s;
+                for(int y = 1; y < LOCAL_HEIGHT; ++y) {
+                    const int in = y + 2 * WINDOW_SIZE, out = y - 1;
+                    s += (uint)ref_tile[in * TILE_WIDTH + t] * search_tile[in * SEARCH_TILE_WIDTH + t + shift]
+                       - (uint)ref_tile[out * TILE_WIDTH + t] * search_tile[out * SEARCH_TILE_WIDTH + t + shift];
+                    run_cols[y * RUN_COLUMNS + c] = s;
+                }
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        // This row's windows, slid along the run
+        if(active) {
+            uint prod = 0;
+            #pragma unroll
+            for(int c = 0; c < WINDOW_DIM; ++c) prod += row_cols[c];
+            #pragma unroll
+            for(int i = 0; i < ZNCC_RUN; ++i) {
+                if(i > 0) prod += row_cols[i + WINDOW_DIM - 1] - row_cols[i - 1];
+                if(!sliding_candidate(direction, x0 + i, d, width)) continue;
+
+                const int pos = local_y * SEARCH_TILE_WIDTH + run_x + i + shift;
+                const float sum_search = box_sum[pos];
+                const float sum2 = box_sum2[pos];
+                float zncc;
+                if(direction < 0) {
+                    // zncc_disparity_left_optimized
+                    const float cov = (float)prod - sum_ref[i] * sum_search * INV_N;
+                    const float var_search = sum2 - (sum_search * sum_search) * INV_N;
+                    zncc = cov * native_rsqrt(var_ref[i] * var_search + 1e-8f);
+                } else {
+                    // zncc_disparity_right_optimized
+                    const float mean_search = sum_search * INV_N;
+                    const float cov = (float)prod - sum_ref[i] * mean_search;
+                    const float var_search = sum2 - (sum_search * sum_search) * INV_N;
+                    zncc = cov * rsqrt(var_ref[i] * var_search + 1e-8f);
+                }
+                if(zncc > best_zncc[i]) {
+                    best_zncc[i] = zncc;
+                    best_d[i] = d;
+                }
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);   // The next candidate overwrites run_cols
+    }
+
+    // Merge the slices in disparity order: a later slice wins only with a strictly higher
+    // score, as a later candidate does in the serial search
+    for(int s = 0; s < ZNCC_RUN; ++s) {
+        if(slice == s) {
+            #pragma unroll
+            for(int i = 0; i < ZNCC_RUN; ++i) {
+                const int m = local_y * LOCAL_WIDTH + run_x + i;
+                if(s == 0 || best_zncc[i] > merged_zncc[m]) {
+                    merged_zncc[m] = best_zncc[i];
+                    merged_d[m] = (uchar)best_d[i];
+                }
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    // Global coordinates and border check
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+    if(x >= width || y >= height) return;  // Padding of the rounded-up NDRange
+    if(x < WINDOW_SIZE || x >= width - WINDOW_SIZE ||
+       y < WINDOW_SIZE || y >= height - WINDOW_SIZE) {
+        disparity[y * width + x] = 0;
+        return;
+    }
+    disparity[y * width + x] = merged_d[local_y * LOCAL_WIDTH + local_x];
+}
+
+__kernel void zncc_disparity_left_sliding(
+    __global const zncc_pixel* left,
+    __global const zncc_pixel* right,
+    __global uchar* disparity,
+    int width,
+    int height,
+    int max_disp,
+    int window_size)
+{
+    __local uchar left_tile[TILE_HEIGHT][TILE_WIDTH];              // Left image tile with halo
+    __local uchar right_tile[TILE_HEIGHT][SEARCH_TILE_WIDTH];      // Right tile + search area
+    __local ushort box_sum[LOCAL_HEIGHT][SEARCH_TILE_WIDTH];       // Search window sums of R
+    __local uint box_sum2[LOCAL_HEIGHT][SEARCH_TILE_WIDTH];        // and of R^2
+    __local uint prod_cols[LOCAL_WIDTH * LOCAL_HEIGHT * RUN_COLUMNS];
+    __local float merged_zncc[LOCAL_HEIGHT][LOCAL_WIDTH];
+    __local uchar merged_d[LOCAL_HEIGHT][LOCAL_WIDTH];
+
+    const int local_x = get_local_id(0);
+    const int local_y = get_local_id(1);
+
+    // Tile origin with halo (the global offset lets the host run the kernel over a band of rows)
+    const int base_x = get_group_id(0) * LOCAL_WIDTH + (int)get_global_offset(0) - WINDOW_SIZE;
+    const int base_y = get_group_id(1) * LOCAL_HEIGHT + (int)get_global_offset(1) - WINDOW_SIZE;
+
+    // Coalesced loading of both tiles with boundary clamping; the right tile reaches back
+    // MAX_DISP columns
+    for(int ty = local_y; ty < TILE_HEIGHT; ty += LOCAL_HEIGHT) {
+        int gy = clamp(base_y + ty, 0, height-1);
+        for(int tx = local_x; tx < TILE_WIDTH; tx += LOCAL_WIDTH) {
+            int gx = clamp(base_x + tx, 0, width-1);
+            left_tile[ty][tx] = ZNCC_LOAD(left, gx, gy, width);
+        }
+        for(int tx = local_x; tx < SEARCH_TILE_WIDTH; tx += LOCAL_WIDTH) {
+            int gx = clamp(base_x - MAX_DISP + tx, 0, width-1);
+            right_tile[ty][tx] = ZNCC_LOAD(right, gx, gy, width);
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    sliding_search(&left_tile[0][0], &right_tile[0][0], MAX_DISP, -1, &box_sum[0][0], &box_sum2[0][0],
+                   prod_cols, &merged_zncc[0][0], &merged_d[0][0], disparity, width, height);
+}
+
+__kernel void zncc_disparity_right_sliding(
+    __global const zncc_pixel* right,
+    __global const zncc_pixel* left,
+    __global uchar* disparity,
+    int width,
+    int height,
+    int max_disp,
+    int window_size)
+{
+    __local uchar right_tile[TILE_HEIGHT][TILE_WIDTH];             // Right image tile with halo
+    __local uchar left_tile[TILE_HEIGHT][SEARCH_TILE_WIDTH];       // Left tile + search area
+    __local ushort box_sum[LOCAL_HEIGHT][SEARCH_TILE_WIDTH];       // Search window sums of R
+    __local uint box_sum2[LOCAL_HEIGHT][SEARCH_TILE_WIDTH];        // and of R^2
+    __local uint prod_cols[LOCAL_WIDTH * LOCAL_HEIGHT * RUN_COLUMNS];
+    __local float merged_zncc[LOCAL_HEIGHT][LOCAL_WIDTH];
+    __local uchar merged_d[LOCAL_HEIGHT][LOCAL_WIDTH];
+
+    const int local_x = get_local_id(0);
+    const int local_y = get_local_id(1);
+
+    // Tile origin with halo (the global offset lets the host run the kernel over a band of rows)
+    const int base_x = get_group_id(0) * LOCAL_WIDTH + (int)get_global_offset(0) - WINDOW_SIZE;
+    const int base_y = get_group_id(1) * LOCAL_HEIGHT + (int)get_global_offset(1) - WINDOW_SIZE;
+
+    // Coalesced loading of both tiles with boundary clamping; the left tile reaches forward
+    // MAX_DISP columns
+    for(int ty = local_y; ty < TILE_HEIGHT; ty += LOCAL_HEIGHT) {
+        int gy = clamp(base_y + ty, 0, height-1);
+        for(int tx = local_x; tx < TILE_WIDTH; tx += LOCAL_WIDTH) {
+            int gx = clamp(base_x + tx, 0, width-1);
+            right_tile[ty][tx] = ZNCC_LOAD(right, gx, gy, width);
+        }
+        for(int tx = local_x; tx < SEARCH_TILE_WIDTH; tx += LOCAL_WIDTH) {
+            int gx = clamp(base_x + tx, 0, width-1);
+            left_tile[ty][tx] = ZNCC_LOAD(left, gx, gy, width);
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    sliding_search(&right_tile[0][0], &left_tile[0][0], 0, 1, &box_sum[0][0], &box_sum2[0][0],
+                   prod_cols, &merged_zncc[0][0], &merged_d[0][0], disparity, width, height);
+}
@@ -0,0 +1,230 @@
+#include "zncc_common.h"  // WINDOW_SIZE, MAX_DISP, LOCAL_WIDTH/HEIGHT come from the build options
+
+/* Disparity-parallel variants of zncc_disparity_left_optimized / _right_optimized
+   (--subgroup-zncc). Same arguments, tiles and NDRange, so the host launches them the same way.
+   Instead of one pixel per work-item, the lanes of a group cooperate on one pixel at a time:
+   lane i scores disparities i, i + lanes, ..., and the group takes the winner with a max
+   reduction, then the smallest disparity with that score (the serial search keeps the first).
+   The groups take the pixels of the work-group's block in turn. Each work-item holds a few
+   candidates instead of MAX_DISP, so the register use and latency of a pixel no longer grow
+   with the disparity range.
+   With -D ZNCC_SUBGROUPS (the host adds it when the device has cl_khr_subgroups) the groups
+   are the device's sub-groups and reduce with sub_group_reduce_max / _min, without local
+   memory or barriers. Otherwise they are ZNCC_LANES (a build option) consecutive work-items
+   reducing in local memory; LOCAL_WIDTH * LOCAL_HEIGHT must then be a multiple of ZNCC_LANES. */
+
+#ifdef ZNCC_SUBGROUPS
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#define LANE_ID() ((int)get_sub_group_local_id())
+#define LANE_COUNT() ((int)get_sub_group_size())
+#define LANE_GROUP_ID() ((int)get_sub_group_id())
+#define LANE_GROUP_COUNT() ((int)get_num_sub_groups())
+#else
+#define LANE_ID() (local_id % ZNCC_LANES)
+#define LANE_COUNT() ZNCC_LANES
+#define LANE_GROUP_ID() (local_id / ZNCC_LANES)
+#define LANE_GROUP_COUNT() (LOCAL_WIDTH * LOCAL_HEIGHT / ZNCC_LANES)
+#endif
+
+#define BLOCK_PIXELS (LOCAL_WIDTH * LOCAL_HEIGHT)
+#define SEARCH_TILE_WIDTH (TILE_WIDTH + MAX_DISP)
+
+/* Search and write the work-group's disparities. Candidate d of reference tile column c is
+   search tile column c + search_shift + direction * d: direction -1 is the left-to-right
+   search, +1 the right-to-left one */
+void subgroup_search(__local const uchar* ref_tile,    // TILE_HEIGHT x TILE_WIDTH
+                     __local const uchar* search_tile, // TILE_HEIGHT x SEARCH_TILE_WIDTH
+                     int search_shift,
+                     int direction,
+                     __local float* ref_sum,           // BLOCK_PIXELS window sums of the reference
+                     __local float* ref_var,           // BLOCK_PIXELS window variances
+                     __local float* lane_zncc,         // BLOCK_PIXELS, local reduction only
+                     __local int* lane_d,              // BLOCK_PIXELS, local reduction only
+                     __global uchar* disparity,
+                     int width,
+                     int height)
+{
+    const int local_id = get_local_id(1) * LOCAL_WIDTH + get_local_id(0);
+    const int group_x0 = get_group_id(0) * LOCAL_WIDTH + (int)get_global_offset(0);
+    const int group_y0 = get_group_id(1) * LOCAL_HEIGHT + (int)get_global_offset(1);
+
+    // Reference window statistics, one pixel per work-item
+    {
+        const int px = local_id % LOCAL_WIDTH;
+        const int py = local_id / LOCAL_WIDTH;
+        uint s = 0, s2 = 0;
+        #pragma unroll
+        for(int wy = 0; wy < WINDOW_DIM; ++wy) {
+            #pragma unroll
+            for(int wx = 0; wx < WINDOW_DIM; ++wx) {
+                const uint p = ref_tile[(py + wy) * TILE_WIDTH + px + wx];
+                s += p;
+                s2 += p * p;
+            }
+        }
+        const float sum = s;
+        ref_sum[local_id] = sum;
+        ref_var[local_id] = (float)s2 - (sum * sum) * INV_N;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    const int lane = LANE_ID();
+    const int lanes = LANE_COUNT();
+    for(int p = LANE_GROUP_ID(); p < BLOCK_PIXELS; p += LANE_GROUP_COUNT()) {
+        const int px = p % LOCAL_WIDTH;
+        const int py = p / LOCAL_WIDTH;
+        const int x = group_x0 + px;
+        const int y = group_y0 + py;
+        const int inside = x >= WINDOW_SIZE && x < width - WINDOW_SIZE &&
+                           y >= WINDOW_SIZE && y < height - WINDOW_SIZE;
+
+        // This lane's candidates
+        float best_zncc = -INFINITY;
+        int best_d = 0;
+        for(int d = lane; inside && d < MAX_DISP; d += lanes) {
+            if(direction < 0 ? x - d < 0 : x + d + WINDOW_SIZE >= width) break;
+
+            const int search_x = px + search_shift + direction * d;
+            uint s = 0, s2 = 0, prod = 0;
+            #pragma unroll
+            for(int wy = 0; wy < WINDOW_DIM; ++wy) {
+                #pragma unroll
+                for(int wx = 0; wx < WINDOW_DIM; ++wx) {
+                    const uint r = ref_tile[(py + wy) * TILE_WIDTH + px + wx];
+                    const uint q = search_tile[(py + wy) * SEARCH_TILE_WIDTH + search_x + wx];
+                    s += q;
+                    s2 += q * q;
+                    prod += r * q;
+                }
+            }
+
+            const float sum_search = s;
+            float zncc;
+            if(direction < 0) {
+                // zncc_disparity_left_optimized
+                const float cov = (float)prod - ref_sum[p] * sum_search * INV_N;
+                const float var_search = (float)s2 - (sum_search * sum_search) * INV_N;
+                zncc = cov * native_rsqrt(ref_var[p] * var_search + 1e-8f);
+            } else {
+                // zncc_disparity_right_optimized
+                const float mean_search = sum_search * INV_N;
+                const float cov = (float)prod - ref_sum[p] * mean_search;
+                const float var_search = (float)s2 - (sum_search * sum_search) * INV_N;
+                zncc = cov * rsqrt(ref_var[p] * var_search + 1e-8f);
+            }
+            if(zncc > best_zncc) {
+                best_zncc = zncc;
+                best_d = d;
+            }
+        }
+
+        // Winner of the group: highest score, then smallest disparity
+#ifdef ZNCC_SUBGROUPS
+        const float top = sub_group_reduce_max(best_zncc);
+        const int winner = sub_group_reduce_min(best_zncc == top ? best_d : MAX_DISP);
+#else
+        lane_zncc[local_id] = best_zncc;
+        lane_d[local_id] = best_d;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for(int stride = ZNCC_LANES / 2; stride > 0; stride /= 2) {
+            if(lane < stride) {
+                const float other = lane_zncc[local_id + stride];
+                const int other_d = lane_d[local_id + stride];
+                if(other > lane_zncc[local_id] || (other == lane_zncc[local_id] && other_d < lane_d[local_id])) {
+                    lane_zncc[local_id] = other;
+                    lane_d[local_id] = other_d;
+                }
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+        const int winner = lane_d[local_id - lane];
+#endif
+
+        if(lane == 0 && x < width && y < height)
+            disparity[y * width + x] = inside ? (uchar)winner : 0;
+    }
+}
+
+__kernel void zncc_disparity_left_subgroup(
+    __global const zncc_pixel* left,
+    __global const zncc_pixel* right,
+    __global uchar* disparity,
+    int width,
+    int height,
+    int max_disp,
+    int window_size)
+{
+    __local uchar left_tile[TILE_HEIGHT][TILE_WIDTH];              // Left image tile with halo
+    __local uchar right_tile[TILE_HEIGHT][SEARCH_TILE_WIDTH];      // Right tile + search area
+    __local float ref_sum[BLOCK_PIXELS], ref_var[BLOCK_PIXELS];
+    __local float lane_zncc[BLOCK_PIXELS];
+    __local int lane_d[BLOCK_PIXELS];
+
+    const int local_x = get_local_id(0);
+    const int local_y = get_local_id(1);
+
+    // Tile origin with halo (the global offset lets the host run the kernel over a band of rows)
+    const int base_x = get_group_id(0) * LOCAL_WIDTH + (int)get_global_offset(0) - WINDOW_SIZE;
+    const int base_y = get_group_id(1) * LOCAL_HEIGHT + (int)get_global_offset(1) - WINDOW_SIZE;
+
+    // Coalesced loading of both tiles with boundary clamping; the right tile reaches back
+    // MAX_DISP columns
+    for(int ty = local_y; ty < TILE_HEIGHT; ty += LOCAL_HEIGHT) {
+        int gy = clamp(base_y + ty, 0, height-1);
+        for(int tx = local_x; tx < TILE_WIDTH; tx += LOCAL_WIDTH) {
+            int gx = clamp(base_x + tx, 0, width-1);
+            left_tile[ty][tx] = ZNCC_LOAD(left, gx, gy, width);
+        }
+        for(int tx = local_x; tx < SEARCH_TILE_WIDTH; tx += LOCAL_WIDTH) {
+            int gx = clamp(base_x - MAX_DISP + tx, 0, width-1);
+            right_tile[ty][tx] = ZNCC_LOAD(right, gx, gy, width);
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    subgroup_search(&left_tile[0][0], &right_tile[0][0], MAX_DISP, -1,
+                    ref_sum, ref_var, lane_zncc, lane_d, disparity, width, height);
+}
+
+__kernel void zncc_disparity_right_subgroup(
+    __global const zncc_pixel* right,
+    __global const zncc_pixel* left,
+    __global uchar* disparity,
+    int width,
+    int height,
+    int max_disp,
+    int window_size)
+{
+    __local uchar right_tile[TILE_HEIGHT][TILE_WIDTH];             // Right image tile with halo
+    __local uchar left_tile[TILE_HEIGHT][SEARCH_TILE_WIDTH];       // Left tile + search area
+    __local float ref_sum[BLOCK_PIXELS], ref_var[BLOCK_PIXELS];
+    __local float lane_zncc[BLOCK_PIXELS];
+    __local int lane_d[BLOCK_PIXELS];
+
+    const int local_x = get_local_id(0);
+    const int local_y = get_local_id(1);
+
+    // Tile origin with halo (the global offset lets the host run the kernel over a band of rows)
+    const int base_x = get_group_id(0) * LOCAL_WIDTH + (int)get_global_offset(0) - WINDOW_SIZE;
+    const int base_y = get_group_id(1) * LOCAL_HEIGHT + (int)get_global_offset(1) - WINDOW_SIZE;
+
+    // Coalesced loading of both tiles with boundary clamping; the left tile reaches forward
+    // MAX_DISP columns
+    for(int ty = local_y; ty < TILE_HEIGHT; ty += LOCAL_HEIGHT) {
+        int gy = clamp(base_y + ty, 0, height-1);
+        for(int tx = local_x; tx < TILE_WIDTH; tx += LOCAL_WIDTH) {
+            int gx = clamp(base_x + tx, 0, width-1);
+            right_tile[ty][tx] = ZNCC_LOAD(right, gx, gy, width);
+        }
+        for(int tx = local_x; tx < SEARCH_TILE_WIDTH; tx += LOCAL_WIDTH) {
+            int gx = clamp(base_x + tx, 0, width-1);
+            left_tile[ty][tx] = ZNCC_LOAD(left, gx, gy, width);
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    subgroup_search(&right_tile[0][0], &left_tile[0][0], 0, 1,
+                    ref_sum, ref_var, lane_zncc, lane_d, disparity, width, height);
+}